@@ -0,0 +1,71 @@
+#include "arena.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static ArenaChunk *chunk_new(size_t size) {
+  ArenaChunk *chunk = (ArenaChunk *)malloc(sizeof(ArenaChunk) + size);
+  if (chunk == NULL) {
+    err("Failed to allocate arena chunk of %zu bytes", size);
+    return NULL;
+  }
+
+  chunk->next = NULL;
+  chunk->size = size;
+  chunk->used = 0;
+
+  return chunk;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+  size = (size + 15) & ~(size_t)15;
+
+  ArenaChunk *chunk = arena->current;
+
+  while (chunk != NULL && chunk->used + size > chunk->size) {
+    chunk = chunk->next;
+    if (chunk != NULL)
+      chunk->used = 0;
+  }
+
+  if (chunk == NULL) {
+    chunk = chunk_new(size > ARENA_CHUNK ? size : ARENA_CHUNK);
+    if (chunk == NULL)
+      return NULL;
+
+    if (arena->current != NULL) {
+      chunk->next = arena->current->next;
+      arena->current->next = chunk;
+    } else {
+      arena->head = chunk;
+    }
+  }
+
+  arena->current = chunk;
+
+  void *ptr = chunk->data + chunk->used;
+  chunk->used += size;
+
+  return ptr;
+}
+
+void arena_reset(Arena *arena) {
+  if (arena->head != NULL)
+    arena->head->used = 0;
+
+  arena->current = arena->head;
+}
+
+void arena_free(Arena *arena) {
+  ArenaChunk *chunk = arena->head;
+
+  while (chunk != NULL) {
+    ArenaChunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+
+  arena->head = NULL;
+  arena->current = NULL;
+}
@@ -0,0 +1,33 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_CHUNK (64 * 1024)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ArenaChunk {
+  struct ArenaChunk *next;
+  size_t size;
+  size_t used;
+  unsigned char data[];
+} ArenaChunk;
+
+/* Bump allocator; everything is released at once by arena_reset(). */
+typedef struct {
+  ArenaChunk *head;
+  ArenaChunk *current;
+} Arena;
+
+void *arena_alloc(Arena *arena, size_t size);
+void arena_reset(Arena *arena);
+void arena_free(Arena *arena);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -12,11 +12,17 @@ Args *get_args(int argc, char *argv[]) {
     return NULL;
   }
 
+  args->daemon = false;
   args->client = false;
+  args->window = 60 * 60;
+  args->refresh = 5;
+  args->record = NULL;
+  args->replay = NULL;
+  args->fast = false;
 
   int opt;
 
-  while ((opt = getopt(argc, argv, "cdhv")) != -1) {
+  while ((opt = getopt(argc, argv, "cdhvw:r:R:p:F")) != -1) {
     switch (opt) {
     case 'v':
 #ifndef VERSION
@@ -32,6 +38,15 @@ Args *get_args(int argc, char *argv[]) {
       printf("  -d, --daemon   Run as a daemon and writes to database, can be "
              "configured by environment variabel NFSTOP_STORE(default: "
              "/var/log/nfstop.log)\n");
+      printf("  -w MINUTES     Show top files of the last MINUTES minutes, 0 "
+             "for all history (default: 60)\n");
+      printf("  -r SECONDS     Redraw at least every SECONDS seconds, new "
+             "data and key presses redraw sooner, q quits (default: 5)\n");
+      printf("  -R FILE        With -d, also record the raw fanotify events "
+             "to FILE for replay\n");
+      printf("  -p FILE        Replay a recorded FILE into the database in "
+             "the foreground, at the recorded pace\n");
+      printf("  -F             With -p, replay as fast as possible\n");
       free(args);
       return NULL;
     case 'd':
@@ -40,8 +55,26 @@ Args *get_args(int argc, char *argv[]) {
     case 'c':
       args->client = true;
       break;
+    case 'w':
+      args->window = atol(optarg) * 60;
+      break;
+    case 'r':
+      args->refresh = atol(optarg) > 0 ? atol(optarg) : 1;
+      break;
+    case 'R':
+      args->record = optarg;
+      break;
+    case 'p':
+      args->replay = optarg;
+      break;
+    case 'F':
+      args->fast = true;
+      break;
     default:
-      fprintf(stderr, "Usage: %s [-h] [-d]\n", argv[0]);
+      fprintf(stderr,
+              "Usage: %s [-h] [-d [-R file]] [-p file [-F]] [-w minutes] "
+              "[-r seconds]\n",
+              argv[0]);
       free(args);
       return NULL;
     }
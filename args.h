@@ -14,6 +14,11 @@ typedef struct option Option;
 typedef struct {
   bool daemon;
   bool client;
+  long window;
+  long refresh;
+  const char *record;
+  const char *replay;
+  bool fast;
 } Args;
 
 Args *get_args(int argc, char *argv[]);
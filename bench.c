@@ -0,0 +1,469 @@
+#include "capture.h"
+#include "event.h"
+#include "mounts.h"
+#include "proc.h"
+#include "stat.h"
+#include "store.h"
+#include "strtab.h"
+#include "utils.h"
+
+#include <glob.h>
+#include <ncurses.h>
+#include <unistd.h>
+
+/* Store sizes to measure at, in rows, ascending. */
+#define BENCH_ROWS                                                             \
+  (getenv("NFSTOP_BENCH_ROWS") ? getenv("NFSTOP_BENCH_ROWS")                   \
+                               : "10000,1000000,10000000")
+
+#define BENCH_OPS                                                              \
+  (getenv("NFSTOP_BENCH_OPS") ? atol(getenv("NFSTOP_BENCH_OPS")) : 1000000)
+
+#define BENCH_INSERTS                                                          \
+  (getenv("NFSTOP_BENCH_INSERTS") ? atol(getenv("NFSTOP_BENCH_INSERTS"))       \
+                                  : 100000)
+
+#define BENCH_SHOWS                                                            \
+  (getenv("NFSTOP_BENCH_SHOWS") ? atol(getenv("NFSTOP_BENCH_SHOWS")) : 20)
+
+#define BENCH_DIR                                                              \
+  (getenv("NFSTOP_BENCH_DIR") ? getenv("NFSTOP_BENCH_DIR") : "/tmp")
+
+/* Reports progress filling the store on stderr. */
+#define BENCH_VERBOSE (getenv("NFSTOP_BENCH_VERBOSE") != NULL)
+
+#define BENCH_FILESYSTEMS 16
+#define BENCH_FILES 4096
+#define BENCH_PIDS 16
+#define BENCH_PID_BASE 1000000
+#define BENCH_BATCH 4096
+#define BENCH_WINDOW (60 * 60)
+#define BENCH_TOP 50
+
+/* A FID record with its 8-byte handle, laid out as the kernel reports it. */
+typedef struct {
+  struct fanotify_event_info_fid info;
+  struct file_handle fh;
+  unsigned char handle[sizeof(uint64_t)];
+} BenchFid;
+
+/* Mostly reads, with a CLOSE_WRITE to invalidate the handle cache. */
+static const uint64_t masks[] = {FAN_OPEN,          FAN_ACCESS, FAN_ACCESS,
+                                 FAN_MODIFY,        FAN_ACCESS,
+                                 FAN_CLOSE_NOWRITE, FAN_CLOSE_WRITE};
+
+#define NMASKS (sizeof(masks) / sizeof(masks[0]))
+
+static size_t nresults;
+static uint32_t paths[BENCH_FILES];
+
+/* Cumulative Zipf (s = 1) weights of the files and ops stored events name. */
+static double file_cdf[BENCH_FILES];
+static double mask_cdf[NMASKS];
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* One JSON object per measurement; `rows` is 0 where the store is unused. */
+static void result(const char *name, long rows, long ops, double ns) {
+  double per_op = ops > 0 ? ns / ops : 0;
+
+  printf("%s\n    {\"name\": \"%s\", \"rows\": %ld, \"ops\": %ld, "
+         "\"ns_per_op\": %.1f, \"events_per_sec\": %.0f}",
+         nresults++ > 0 ? "," : "", name, rows, ops, per_op,
+         per_op > 0 ? 1e9 / per_op : 0);
+  fflush(stdout);
+}
+
+static Fsid bench_fsid(size_t i) {
+  Fsid fsid = {.__val = {(int)i + 1, 0x6e66}};
+  return fsid;
+}
+
+static void bench_path(size_t file, char *buf, size_t len) {
+  snprintf(buf, len, "/export/bench/dir%03zu/file%05zu", file / 64, file);
+}
+
+static void fill_fid(BenchFid *fid, size_t file) {
+  Fsid fsid = bench_fsid(file % BENCH_FILESYSTEMS);
+  uint64_t handle = file + 1;
+
+  memset(fid, 0, sizeof(*fid));
+  fid->info.hdr.info_type = FAN_EVENT_INFO_TYPE_FID;
+  fid->info.hdr.len = sizeof(*fid);
+  memcpy(&fid->info.fsid, &fsid, sizeof(fsid));
+  fid->fh.handle_bytes = sizeof(fid->handle);
+  fid->fh.handle_type = 1;
+  memcpy(fid->handle, &handle, sizeof(handle));
+}
+
+/*
+ * Stands the decoders up without fanotify or root, the way replay does: the
+ * filesystems, nfsd pids and file handles the synthetic events name are
+ * seeded, so every lookup succeeds from memory.
+ */
+static void seed(void) {
+  char buf[sizeof(CapHandle) + sizeof(uint64_t) + PATH_MAX];
+
+  proc_init(false);
+  proc_offline();
+  mounts_offline();
+
+  for (size_t i = 0; i < BENCH_FILESYSTEMS; ++i) {
+    Fsid fsid = bench_fsid(i);
+    mounts_seed(&fsid, makedev(0, 100 + i));
+  }
+
+  for (pid_t pid = 0; pid < BENCH_PIDS; ++pid)
+    proc_seed(BENCH_PID_BASE + pid, 1000, 1000, true);
+
+  for (size_t file = 0; file < BENCH_FILES; ++file) {
+    char path[PATH_MAX];
+    bench_path(file, path, sizeof(path));
+    paths[file] = strtab_intern(path);
+
+    CapHandle h = {.fsid = bench_fsid(file % BENCH_FILESYSTEMS),
+                   .size = (int64_t)(file * 4096),
+                   .dev = makedev(0, 100 + file % BENCH_FILESYSTEMS),
+                   .ino = file + 1,
+                   .handle_type = 1,
+                   .handle_bytes = sizeof(uint64_t),
+                   .path_len = strlen(path) + 1};
+    uint64_t handle = file + 1;
+
+    memcpy(buf, &h, sizeof(h));
+    memcpy(buf + sizeof(h), &handle, sizeof(handle));
+    memcpy(buf + sizeof(h) + sizeof(handle), path, h.path_len);
+    replay_seed_handle(buf, sizeof(h) + sizeof(handle) + h.path_len);
+  }
+}
+
+/* Lays out `n` events, each a metadata header and one FID record. */
+static size_t synth_events(void *buf, size_t n) {
+  const size_t event_len = sizeof(FanEventMetadata) + sizeof(BenchFid);
+  char *ptr = (char *)buf;
+
+  for (size_t i = 0; i < n; ++i) {
+    FanEventMetadata *data = (FanEventMetadata *)ptr;
+    data->event_len = event_len;
+    data->vers = FANOTIFY_METADATA_VERSION;
+    data->metadata_len = sizeof(FanEventMetadata);
+    data->mask = masks[i % NMASKS];
+    data->fd = FAN_NOFD;
+    data->pid = BENCH_PID_BASE + (pid_t)(i % BENCH_PIDS);
+    fill_fid((BenchFid *)(data + 1), (i * 7919) % BENCH_FILES);
+    ptr += event_len;
+  }
+
+  return (size_t)(ptr - (char *)buf);
+}
+
+static void bench_op(long ops) {
+  size_t sum = 0;
+
+  double start = now_ns();
+  for (long i = 0; i < ops; ++i)
+    sum += strlen(op(masks[i % NMASKS] | (i & FAN_ATTRIB)));
+  double ns = now_ns() - start;
+
+  if (sum == 0)
+    warn("op() decoded nothing");
+  result("op", 0, ops, ns);
+}
+
+/* An nfsd thread's /proc/<pid>/stat, as procstat() reads it every sample. */
+static const char stat_line[] =
+    "811 (nfsd) S 2 0 0 0 -1 2129984 0 0 0 0 1742 90211 0 0 20 0 1 0 300 0 0 "
+    "18446744073709551615 0 0 0 0 0 0 0 2147483647 0 0 0 0 17 3 0 0 0 0 0 0 0 "
+    "0 0 0 0 0 0";
+
+static void bench_stat_parse(long ops) {
+  unsigned long long sum = 0;
+  StatLine line;
+
+  double start = now_ns();
+  for (long i = 0; i < ops; ++i) {
+    if (stat_parse(stat_line, sizeof(stat_line) - 1, &line) == 0)
+      sum += line.field[STAT_STIME];
+  }
+  double ns = now_ns() - start;
+
+  if (sum == 0)
+    warn("stat_parse() parsed nothing");
+  result("stat_parse", 0, ops, ns);
+}
+
+/* The sscanf() procstat() used before stat_parse(), for comparison. */
+static void bench_stat_sscanf(long ops) {
+  unsigned long long sum = 0;
+
+  double start = now_ns();
+  for (long i = 0; i < ops; ++i) {
+    char state;
+    unsigned long int min_flt, maj_flt, utime, stime, cutime, cstime, vsize;
+    long int priority, nice, threads, rss;
+    unsigned long long start_time;
+
+    if (sscanf(stat_line,
+               "%*d %*s %c %*d %*d %*d %*d %*d %*u %lu %*u %lu %*u %lu %lu "
+               "%lu %lu %ld %ld %ld %*d %llu %lu %ld",
+               &state, &min_flt, &maj_flt, &utime, &stime, &cutime, &cstime,
+               &priority, &nice, &threads, &start_time, &vsize, &rss) == 13)
+      sum += stime;
+  }
+  double ns = now_ns() - start;
+
+  if (sum == 0)
+    warn("sscanf() parsed nothing");
+  result("stat_sscanf", 0, ops, ns);
+}
+
+/* The mount lookup that get_mount_id() used to be, now mounts_open(). */
+static void bench_mounts_open(long ops) {
+  BenchFid fids[BENCH_FILESYSTEMS];
+  for (size_t i = 0; i < BENCH_FILESYSTEMS; ++i)
+    fill_fid(&fids[i], i);
+
+  double start = now_ns();
+  for (long i = 0; i < ops; ++i) {
+    BenchFid *fid = &fids[i % BENCH_FILESYSTEMS];
+    mounts_open((const Fsid *)&fid->info.fsid, &fid->fh, O_PATH);
+  }
+  double ns = now_ns() - start;
+
+  result("mounts_open", 0, ops, ns);
+}
+
+static void bench_next(long ops) {
+  void *buf = malloc(BUFSIZE);
+  Arena arena = {0};
+  long done = 0;
+  size_t decoded = 0;
+
+  if (buf == NULL) {
+    fatal("Failed to allocate event buffer");
+    exit(EXIT_FAILURE);
+  }
+
+  size_t len = synth_events(buf, BENCH_BATCH);
+  time_t now = time(NULL);
+
+  double start = now_ns();
+  while (done < ops) {
+    const FanEventMetadata *data = (const FanEventMetadata *)buf;
+    size_t left = len;
+    for (; FAN_EVENT_OK(data, left); data = FAN_EVENT_NEXT(data, left)) {
+      decoded += next(data, now, false, &arena) != NULL;
+      done++;
+    }
+    arena_reset(&arena);
+  }
+  double ns = now_ns() - start;
+
+  if (decoded != (size_t)done)
+    warn("next() dropped %zu of %ld events", done - decoded, done);
+  result("next", 0, done, ns);
+
+  arena_free(&arena);
+  free(buf);
+}
+
+static void zipf_init(double *cdf, size_t n) {
+  double sum = 0;
+
+  for (size_t k = 0; k < n; ++k)
+    cdf[k] = sum += 1.0 / (double)(k + 1);
+  for (size_t k = 0; k < n; ++k)
+    cdf[k] /= sum;
+}
+
+/* The rank whose weight covers `u`, uniform in [0, 1). */
+static size_t zipf(const double *cdf, size_t n, double u) {
+  size_t lo = 0, hi = n - 1;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (cdf[mid] <= u)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+/* A uniform draw in [0, 1) that depends only on `x` (splitmix64). */
+static double uniform(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+
+  return (double)(x >> 11) * 0x1.0p-53;
+}
+
+/*
+ * Event `i` of the store benchmarks. Files and ops are Zipf-distributed, so
+ * that, as on a real server, a few hot keys take most of the rollup updates.
+ */
+static void synth_event(Event *ev, long i, time_t now) {
+  size_t file = zipf(file_cdf, BENCH_FILES, uniform((uint64_t)i * 2));
+
+  ev->mask = masks[zipf(mask_cdf, NMASKS, uniform((uint64_t)i * 2 + 1))];
+  ev->time = now - i % BENCH_WINDOW;
+  ev->size = (off_t)(file * 4096);
+  ev->pid = BENCH_PID_BASE + (pid_t)(i % BENCH_PIDS);
+  ev->uid = 1000;
+  ev->gid = 1000;
+  ev->path = paths[file];
+  ev->proc = strtab_intern("nfsd");
+  ev->client = 0;
+}
+
+static int insert(store db, long from, long n, time_t now) {
+  Event ev;
+
+  for (long i = from; i < from + n; ++i) {
+    synth_event(&ev, i, now);
+    if (store_insert(db, &ev, 1, ev.time) != 0)
+      return 1;
+  }
+
+  return store_flush(db);
+}
+
+static int bench_show(store db, long rows, long shows) {
+  SCREEN *screen = NULL;
+  FILE *out = fopen("/dev/null", "w");
+
+  if (out != NULL)
+    screen = newterm("dumb", out, stdin);
+  if (screen == NULL) {
+    warn("No terminal to render into, skipping store_show");
+    if (out != NULL)
+      fclose(out);
+    return 0;
+  }
+
+  WINDOW *win = newpad(BENCH_TOP + 1, 256);
+  int rc = win == NULL;
+
+  double start = now_ns();
+  for (long i = 0; rc == 0 && i < shows; ++i)
+    rc = store_show(db, win, BENCH_WINDOW, 0);
+  double ns = now_ns() - start;
+
+  if (rc == 0)
+    result("store_show", rows, shows, ns);
+
+  if (win != NULL)
+    delwin(win);
+  endwin();
+  delscreen(screen);
+  fclose(out);
+
+  return rc;
+}
+
+/*
+ * Grows one store through each size in turn, measuring its last `inserts`
+ * inserts, or all of them when the size is smaller, and `shows` top-N queries
+ * once it holds that many rows.
+ */
+static int bench_store(long inserts, long shows) {
+  char path[PATH_MAX];
+  char sizes[256];
+  time_t now = time(NULL);
+  long rows = 0;
+  int rc = 0;
+
+  snprintf(path, sizeof(path), "%s/nfstop-bench-%d.db", BENCH_DIR, getpid());
+  setenv("NFSTOP_STORE", path, 1);
+
+  store db = store_open(true);
+  if (db == NULL)
+    return 1;
+
+  zipf_init(file_cdf, BENCH_FILES);
+  zipf_init(mask_cdf, NMASKS);
+
+  snprintf(sizes, sizeof(sizes), "%s", BENCH_ROWS);
+  for (char *tok = strtok(sizes, ","); rc == 0 && tok != NULL;
+       tok = strtok(NULL, ",")) {
+    long target = atol(tok);
+    if (target <= rows) {
+      warn("skipping %ld rows, the store already holds %ld", target, rows);
+      continue;
+    }
+
+    long timed = inserts < target - rows ? inserts : target - rows;
+    if (BENCH_VERBOSE)
+      fprintf(stderr, "filling store to %ld rows\n", target - timed);
+    rc = insert(db, rows, target - timed - rows, now);
+    rows = target - timed;
+    if (rc != 0)
+      break;
+
+    double start = now_ns();
+    rc = insert(db, rows, timed, now);
+    double ns = now_ns() - start;
+    rows += timed;
+    if (rc != 0)
+      break;
+    result("store_insert", rows, timed, ns);
+
+    store reader = store_open(false);
+    if (reader == NULL) {
+      rc = 1;
+      break;
+    }
+    rc = bench_show(reader, rows, shows);
+    store_close(reader);
+  }
+
+  if (store_close(db) != 0)
+    rc = 1;
+
+  /* The store and its day partitions, with their WAL and shm files. */
+  char pattern[PATH_MAX + 8];
+  glob_t files;
+  snprintf(pattern, sizeof(pattern), "%s*", path);
+  if (glob(pattern, 0, NULL, &files) == 0) {
+    for (size_t i = 0; i < files.gl_pathc; ++i)
+      unlink(files.gl_pathv[i]);
+    globfree(&files);
+  }
+
+  return rc;
+}
+
+/*
+ * Measures the hot paths on synthetic events and prints the results as JSON
+ * on stdout, so that releases can be compared.
+ */
+int main(void) {
+  long ops = BENCH_OPS;
+
+  seed();
+
+#ifndef VERSION
+  printf("{\n  \"version\": \"dev-build\",\n  \"results\": [");
+#else
+  printf("{\n  \"version\": \"%s\",\n  \"results\": [", VERSION);
+#endif
+
+  bench_op(ops);
+  bench_stat_parse(ops);
+  bench_stat_sscanf(ops);
+  bench_mounts_open(ops);
+  bench_next(ops);
+  int rc = bench_store(BENCH_INSERTS, BENCH_SHOWS);
+
+  printf("\n  ]\n}\n");
+
+  mounts_stop();
+  return rc;
+}
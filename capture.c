@@ -0,0 +1,378 @@
+#include "capture.h"
+#include "utils.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+static struct {
+  FILE *file;
+  atomic_bool on;
+  uint64_t records;
+  uint64_t bytes;
+} recorder;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Every resolution of one handle in a capture, each a CapHandle record as
+ * written, in recording order. `next` is the one the next lookup returns.
+ */
+typedef struct {
+  char **recs;
+  size_t n;
+  size_t cap;
+  size_t next;
+} Resolutions;
+
+/*
+ * Handle resolutions loaded from a capture, filled before replay starts.
+ * Afterwards only the `next` cursors change.
+ */
+static struct {
+  uint64_t *keys;
+  Resolutions **res;
+  size_t n;
+  size_t cap;
+} snapshots;
+
+int capture_start(const char *path, bool client) {
+  FILE *file = fopen(path, "we");
+  if (file == NULL) {
+    err("Failed to open capture %s: %s", path, strerror(errno));
+    return 1;
+  }
+
+  CaptureHeader header = {.magic = CAPTURE_MAGIC,
+                          .version = CAPTURE_VERSION,
+                          .client = client};
+  if (fwrite(&header, sizeof(header), 1, file) != 1) {
+    err("Failed to write capture %s: %s", path, strerror(errno));
+    fclose(file);
+    return 1;
+  }
+
+  pthread_mutex_lock(&lock);
+  recorder.file = file;
+  atomic_store(&recorder.on, true);
+  pthread_mutex_unlock(&lock);
+
+  debug("recording to %s", path);
+  return 0;
+}
+
+/* Called with the lock held. A failed write ends the capture. */
+static void append(CaptureType type, const void *buf, size_t len) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  CaptureRecord rec = {.type = type,
+                       .len = (uint32_t)len,
+                       .sec = now.tv_sec,
+                       .nsec = now.tv_nsec};
+  if (fwrite(&rec, sizeof(rec), 1, recorder.file) != 1 ||
+      fwrite(buf, 1, len, recorder.file) != len) {
+    err("Failed to write capture: %s, recording stopped", strerror(errno));
+    atomic_store(&recorder.on, false);
+    return;
+  }
+
+  recorder.records++;
+  recorder.bytes += sizeof(rec) + len;
+}
+
+void capture_record(CaptureType type, const void *buf, size_t len) {
+  if (!atomic_load_explicit(&recorder.on, memory_order_relaxed))
+    return;
+
+  pthread_mutex_lock(&lock);
+  if (atomic_load(&recorder.on))
+    append(type, buf, len);
+  pthread_mutex_unlock(&lock);
+}
+
+void capture_handle(const Fsid *fsid, const FileHandle *fh, const char *path,
+                    const FileAttr *attr) {
+  if (!atomic_load_explicit(&recorder.on, memory_order_relaxed))
+    return;
+
+  char buf[sizeof(CapHandle) + MAX_HANDLE_SZ + PATH_MAX];
+  size_t path_len = strnlen(path, PATH_MAX - 1) + 1;
+  if (fh->handle_bytes > MAX_HANDLE_SZ)
+    return;
+
+  CapHandle h = {.fsid = *fsid,
+                 .size = attr->size,
+                 .dev = attr->dev,
+                 .ino = attr->ino,
+                 .handle_type = fh->handle_type,
+                 .handle_bytes = fh->handle_bytes,
+                 .path_len = path_len};
+  memcpy(buf, &h, sizeof(h));
+  memcpy(buf + sizeof(h), fh->f_handle, fh->handle_bytes);
+  memcpy(buf + sizeof(h) + fh->handle_bytes, path, path_len);
+  buf[sizeof(h) + fh->handle_bytes + path_len - 1] = '\0';
+
+  capture_record(CAP_HANDLE, buf, sizeof(h) + fh->handle_bytes + path_len);
+}
+
+void capture_stop(void) {
+  pthread_mutex_lock(&lock);
+  if (recorder.file != NULL) {
+    atomic_store(&recorder.on, false);
+    if (fclose(recorder.file) != 0)
+      err("Failed to close capture: %s", strerror(errno));
+    recorder.file = NULL;
+    debug("captured %lu records, %lu bytes", recorder.records, recorder.bytes);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+Replay *replay_open(const char *path) {
+  FILE *file = fopen(path, "re");
+  if (file == NULL) {
+    err("Failed to open capture %s: %s", path, strerror(errno));
+    return NULL;
+  }
+
+  CaptureHeader header;
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      header.magic != CAPTURE_MAGIC) {
+    err("%s is not an nfstop capture", path);
+    fclose(file);
+    return NULL;
+  }
+  if (header.version != CAPTURE_VERSION) {
+    err("%s is a version %u capture, expected %u", path, header.version,
+        CAPTURE_VERSION);
+    fclose(file);
+    return NULL;
+  }
+
+  Replay *r = (Replay *)calloc(1, sizeof(Replay));
+  if (r == NULL) {
+    fclose(file);
+    return NULL;
+  }
+  r->file = file;
+  r->client = header.client;
+  r->data = ftell(file);
+
+  return r;
+}
+
+/*
+ * The pidfds and event fds a recorded buffer names belonged to the recording
+ * process; replay must never close or read through them.
+ */
+static void scrub(void *buf, size_t len) {
+  FanEventMetadata *data = (FanEventMetadata *)buf;
+  for (; FAN_EVENT_OK(data, len); data = FAN_EVENT_NEXT(data, len)) {
+    data->fd = FAN_NOFD;
+
+    char *ptr = (char *)(data + 1);
+    char *end = (char *)data + data->event_len;
+    while (ptr + sizeof(struct fanotify_event_info_header) <= end) {
+      struct fanotify_event_info_header *hdr =
+          (struct fanotify_event_info_header *)ptr;
+      if (hdr->len == 0 || ptr + hdr->len > end)
+        break;
+      if (hdr->info_type == FAN_EVENT_INFO_TYPE_PIDFD)
+        ((struct fanotify_event_info_pidfd *)hdr)->pidfd = FAN_NOPIDFD;
+      ptr += hdr->len;
+    }
+  }
+}
+
+/*
+ * Reads the next record into `buf`, returning its payload length, or -1 at
+ * the end of the capture. Records larger than `len` are skipped.
+ */
+ssize_t replay_next(Replay *r, CaptureRecord *rec, void *buf, size_t len) {
+  while (fread(rec, sizeof(*rec), 1, r->file) == 1) {
+    if (rec->len > len) {
+      warn("skipping %u byte capture record", rec->len);
+      if (fseek(r->file, rec->len, SEEK_CUR) != 0)
+        return -1;
+      continue;
+    }
+    if (fread(buf, 1, rec->len, r->file) != rec->len) {
+      warn("capture truncated");
+      return -1;
+    }
+    if (rec->type == CAP_EVENTS)
+      scrub(buf, rec->len);
+    return rec->len;
+  }
+
+  return -1;
+}
+
+static uint64_t handle_key(const Fsid *fsid, int type, const void *handle,
+                           size_t len) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  const unsigned char *p = (const unsigned char *)fsid;
+  for (size_t i = 0; i < sizeof(*fsid); ++i)
+    h = (h ^ p[i]) * 0x100000001b3ULL;
+  h = (h ^ (uint32_t)type) * 0x100000001b3ULL;
+  p = (const unsigned char *)handle;
+  for (size_t i = 0; i < len; ++i)
+    h = (h ^ p[i]) * 0x100000001b3ULL;
+  return h | 1;
+}
+
+static bool same_handle(const Resolutions *res, const Fsid *fsid, int type,
+                        const void *handle, size_t len) {
+  const char *rec = res->recs[0];
+  const CapHandle *h = (const CapHandle *)rec;
+  return memcmp(&h->fsid, fsid, sizeof(*fsid)) == 0 &&
+         h->handle_type == type && h->handle_bytes == len &&
+         memcmp(rec + sizeof(*h), handle, len) == 0;
+}
+
+static void snapshot_put(uint64_t key, Resolutions *res) {
+  size_t i = key & (snapshots.cap - 1);
+  while (snapshots.keys[i] != 0)
+    i = (i + 1) & (snapshots.cap - 1);
+  snapshots.keys[i] = key;
+  snapshots.res[i] = res;
+}
+
+static bool snapshot_grow(void) {
+  size_t cap = snapshots.cap ? snapshots.cap * 2 : 1024;
+  uint64_t *keys = (uint64_t *)calloc(cap, sizeof(uint64_t));
+  Resolutions **res = (Resolutions **)calloc(cap, sizeof(Resolutions *));
+  if (keys == NULL || res == NULL) {
+    free(keys);
+    free(res);
+    return false;
+  }
+
+  uint64_t *old_keys = snapshots.keys;
+  Resolutions **old_res = snapshots.res;
+  size_t old_cap = snapshots.cap;
+
+  snapshots.keys = keys;
+  snapshots.res = res;
+  snapshots.cap = cap;
+  for (size_t i = 0; i < old_cap; ++i) {
+    if (old_keys[i] != 0)
+      snapshot_put(old_keys[i], old_res[i]);
+  }
+
+  free(old_keys);
+  free(old_res);
+  return true;
+}
+
+static bool resolutions_add(Resolutions *res, char *rec) {
+  if (res->n == res->cap) {
+    size_t cap = res->cap ? res->cap * 2 : 1;
+    char **recs = (char **)realloc(res->recs, cap * sizeof(char *));
+    if (recs == NULL)
+      return false;
+    res->recs = recs;
+    res->cap = cap;
+  }
+
+  res->recs[res->n++] = rec;
+  return true;
+}
+
+/*
+ * Keeps every resolution of each handle in recording order. The daemon
+ * records one whenever its cache misses, which replay repeats, so a handle
+ * renamed between two misses resolves to each of its names in turn.
+ */
+bool replay_seed_handle(const void *buf, size_t len) {
+  const CapHandle *h = (const CapHandle *)buf;
+  if (len < sizeof(*h) || h->handle_bytes > MAX_HANDLE_SZ ||
+      h->path_len == 0 || len != sizeof(*h) + h->handle_bytes + h->path_len)
+    return false;
+
+  if ((snapshots.n + 1) * 2 > snapshots.cap && !snapshot_grow())
+    return false;
+
+  char *rec = (char *)malloc(len);
+  if (rec == NULL)
+    return false;
+  memcpy(rec, buf, len);
+  rec[len - 1] = '\0';
+
+  const char *handle = rec + sizeof(*h);
+  uint64_t key = handle_key(&h->fsid, h->handle_type, handle, h->handle_bytes);
+  for (size_t i = key & (snapshots.cap - 1); snapshots.keys[i] != 0;
+       i = (i + 1) & (snapshots.cap - 1)) {
+    if (snapshots.keys[i] == key &&
+        same_handle(snapshots.res[i], &h->fsid, h->handle_type, handle,
+                    h->handle_bytes)) {
+      if (resolutions_add(snapshots.res[i], rec))
+        return true;
+      free(rec);
+      return false;
+    }
+  }
+
+  Resolutions *res = (Resolutions *)calloc(1, sizeof(Resolutions));
+  if (res == NULL || !resolutions_add(res, rec)) {
+    free(res);
+    free(rec);
+    return false;
+  }
+
+  snapshot_put(key, res);
+  snapshots.n++;
+  return true;
+}
+
+/*
+ * Resolves a handle from the capture, standing in for open_by_handle_at when
+ * the filesystem it names is not there. Each call moves on to the handle's
+ * next recorded resolution, and the last one is repeated once all are used.
+ */
+bool replay_resolve(const Fsid *fsid, const FileHandle *fh, char *path,
+                    size_t len, FileAttr *attr) {
+  if (snapshots.n == 0)
+    return false;
+
+  uint64_t key =
+      handle_key(fsid, fh->handle_type, fh->f_handle, fh->handle_bytes);
+  for (size_t i = key & (snapshots.cap - 1); snapshots.keys[i] != 0;
+       i = (i + 1) & (snapshots.cap - 1)) {
+    Resolutions *res = snapshots.res[i];
+    if (snapshots.keys[i] != key ||
+        !same_handle(res, fsid, fh->handle_type, fh->f_handle,
+                     fh->handle_bytes))
+      continue;
+
+    size_t next = __atomic_fetch_add(&res->next, 1, __ATOMIC_RELAXED);
+    const char *rec = res->recs[next < res->n ? next : res->n - 1];
+    const CapHandle *h = (const CapHandle *)rec;
+    snprintf(path, len, "%s", rec + sizeof(*h) + h->handle_bytes);
+    if (attr != NULL && h->size >= 0)
+      *attr = (FileAttr){.size = h->size, .dev = h->dev, .ino = h->ino};
+    return true;
+  }
+
+  return false;
+}
+
+void replay_rewind(Replay *r) { fseek(r->file, r->data, SEEK_SET); }
+
+void replay_close(Replay *r) {
+  if (r == NULL)
+    return;
+  fclose(r->file);
+  free(r);
+
+  for (size_t i = 0; i < snapshots.cap; ++i) {
+    if (snapshots.keys[i] == 0)
+      continue;
+    for (size_t j = 0; j < snapshots.res[i]->n; ++j)
+      free(snapshots.res[i]->recs[j]);
+    free(snapshots.res[i]->recs);
+    free(snapshots.res[i]);
+  }
+  free(snapshots.keys);
+  free(snapshots.res);
+  memset(&snapshots, 0, sizeof(snapshots));
+}
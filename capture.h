@@ -0,0 +1,93 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "event.h"
+#include "fhcache.h"
+
+#define CAPTURE_MAGIC 0x5043544eu
+#define CAPTURE_VERSION 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+  CAP_EVENTS = 1,
+  CAP_MOUNT,
+  CAP_PROC,
+  CAP_HANDLE,
+} CaptureType;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t client;
+  uint32_t reserved;
+} CaptureHeader;
+
+/* Every record starts with this header, followed by `len` payload bytes. */
+typedef struct {
+  uint32_t type;
+  uint32_t len;
+  int64_t sec;
+  int64_t nsec;
+} CaptureRecord;
+
+/* A raw fanotify read() buffer is stored as is. */
+
+typedef struct {
+  Fsid fsid;
+  uint64_t dev;
+} CapMount;
+
+typedef struct {
+  int32_t pid;
+  uint32_t uid;
+  uint32_t gid;
+  uint32_t matched;
+} CapProc;
+
+/* Followed by `handle_bytes` of handle and `path_len` bytes of path. */
+typedef struct {
+  Fsid fsid;
+  int64_t size;
+  uint64_t dev;
+  uint64_t ino;
+  int32_t handle_type;
+  uint32_t handle_bytes;
+  uint32_t path_len;
+  uint32_t reserved;
+} CapHandle;
+
+/*
+ * Records what the daemon reads, so that a workload can be replayed through
+ * the decoders and the store without fanotify, nfsd or root: the raw event
+ * buffers, plus the mount table, pid verdicts and handle resolutions the
+ * buffers cannot be decoded without elsewhere. Recording is a no-op until
+ * `capture_start`, and is safe from any thread.
+ */
+int capture_start(const char *path, bool client);
+void capture_record(CaptureType type, const void *buf, size_t len);
+void capture_handle(const Fsid *fsid, const FileHandle *fh, const char *path,
+                    const FileAttr *attr);
+void capture_stop(void);
+
+typedef struct {
+  FILE *file;
+  bool client;
+  long data;
+} Replay;
+
+Replay *replay_open(const char *path);
+ssize_t replay_next(Replay *r, CaptureRecord *rec, void *buf, size_t len);
+bool replay_seed_handle(const void *buf, size_t len);
+bool replay_resolve(const Fsid *fsid, const FileHandle *fh, char *path,
+                    size_t len, FileAttr *attr);
+void replay_rewind(Replay *r);
+void replay_close(Replay *r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,364 @@
+#include "clients.h"
+#include "strtab.h"
+#include "utils.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sysmacros.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REFRESH_MS                                                             \
+  (getenv("NFSTOP_CLIENTS_MS") ? atol(getenv("NFSTOP_CLIENTS_MS")) : 2000)
+
+typedef struct {
+  dev_t dev;
+  ino_t ino;
+  uint32_t client;
+} FileSlot;
+
+typedef struct {
+  uint64_t id;
+  uint32_t label;
+  bool seen;
+} Known;
+
+static struct {
+  bool enabled;
+  long refresh_ms;
+  long refreshed;
+  uint32_t shared;
+
+  FileSlot *files;
+  size_t cap;
+
+  /* Only touched by the refreshing thread. */
+  FileSlot *scratch;
+  size_t nscratch;
+  size_t scratch_cap;
+  Known *known;
+  size_t nknown;
+  size_t known_cap;
+
+  ClientStats stats;
+} clients;
+
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static size_t slot_of(dev_t dev, ino_t ino, size_t cap) {
+  uint64_t h = ((uint64_t)ino ^ (uint64_t)dev << 40) * 0x9e3779b97f4a7c15ULL;
+  return (size_t)(h >> 17) & (cap - 1);
+}
+
+void clients_init(bool client) {
+  DIR *dir = client ? NULL : opendir(NFSD_CLIENTS);
+  if (dir == NULL) {
+    debug("client attribution disabled, no %s", NFSD_CLIENTS);
+    return;
+  }
+  closedir(dir);
+
+  clients.enabled = true;
+  clients.refresh_ms = REFRESH_MS;
+  clients.shared = strtab_pin("(shared)");
+  clients.refreshed = now_ms() - clients.refresh_ms;
+}
+
+/* Copies the quoted value following `key` in `buf`, e.g. address: "...". */
+static bool quoted(const char *buf, const char *key, char *out, size_t len) {
+  const char *p = strstr(buf, key);
+  if (p == NULL)
+    return false;
+
+  p += strlen(key);
+  const char *end = strchr(p, '"');
+  if (end == NULL || (size_t)(end - p) >= len)
+    return false;
+
+  memcpy(out, p, end - p);
+  out[end - p] = '\0';
+  return true;
+}
+
+/*
+ * Builds the label of client `id` from its info file: the address without
+ * the port, followed by the host name Linux clients put at the end of their
+ * client name.
+ */
+static uint32_t read_label(const char *id) {
+  char path[PATH_MAX];
+  char buf[2048];
+  char addr[128];
+  char name[512];
+  char label[256];
+
+  snprintf(path, sizeof(path), "%s/%s/info", NFSD_CLIENTS, id);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0)
+    return 0;
+  buf[n] = '\0';
+
+  if (!quoted(buf, "address: \"", addr, sizeof(addr)))
+    return 0;
+
+  char *port = strrchr(addr, ':');
+  if (port != NULL)
+    *port = '\0';
+  char *host = addr;
+  if (*host == '[') {
+    host++;
+    host[strcspn(host, "]")] = '\0';
+  }
+
+  const char *prefix = "Linux NFSv";
+  if (quoted(buf, "name: \"", name, sizeof(name)) &&
+      strncmp(name, prefix, strlen(prefix)) == 0 &&
+      strrchr(name, ' ') != NULL)
+    snprintf(label, sizeof(label), "%s (%s)", host, strrchr(name, ' ') + 1);
+  else
+    snprintf(label, sizeof(label), "%s", host);
+
+  return strtab_pin(label);
+}
+
+static uint32_t label_of(const char *name) {
+  uint64_t id = strtoull(name, NULL, 10);
+
+  for (size_t i = 0; i < clients.nknown; ++i) {
+    if (clients.known[i].id == id) {
+      clients.known[i].seen = true;
+      return clients.known[i].label;
+    }
+  }
+
+  uint32_t label = read_label(name);
+  if (label == 0)
+    return 0;
+
+  if (clients.nknown == clients.known_cap) {
+    size_t cap = clients.known_cap ? clients.known_cap * 2 : 64;
+    Known *known = (Known *)realloc(clients.known, cap * sizeof(Known));
+    if (known == NULL)
+      return label;
+    clients.known = known;
+    clients.known_cap = cap;
+  }
+
+  clients.known[clients.nknown++] = (Known){id, label, true};
+  debug("nfs client %s is %s", name, strtab_get(label));
+
+  return label;
+}
+
+static void scratch_add(dev_t dev, ino_t ino, uint32_t label) {
+  if (clients.nscratch == clients.scratch_cap) {
+    size_t cap = clients.scratch_cap ? clients.scratch_cap * 2 : 1024;
+    FileSlot *scratch =
+        (FileSlot *)realloc(clients.scratch, cap * sizeof(FileSlot));
+    if (scratch == NULL)
+      return;
+    clients.scratch = scratch;
+    clients.scratch_cap = cap;
+  }
+
+  clients.scratch[clients.nscratch++] = (FileSlot){dev, ino, label};
+}
+
+/* Lists the files client `id` holds open state on, as "superblock: "...". */
+static void read_states(const char *id, uint32_t label) {
+  char path[PATH_MAX];
+  char line[1024];
+
+  snprintf(path, sizeof(path), "%s/%s/states", NFSD_CLIENTS, id);
+  FILE *states = fopen(path, "re");
+  if (states == NULL)
+    return;
+
+  while (fgets(line, sizeof(line), states) != NULL) {
+    const char *sb = strstr(line, "superblock: \"");
+    unsigned int maj, min;
+    unsigned long ino;
+
+    if (sb != NULL && sscanf(sb + strlen("superblock: \""), "%x:%x:%lu", &maj,
+                             &min, &ino) == 3)
+      scratch_add(makedev(maj, min), (ino_t)ino, label);
+  }
+
+  fclose(states);
+}
+
+/*
+ * Drops the clients past the first `n` of `known`, which went away, and
+ * unpins their labels unless a remaining client shares one. Runs once the
+ * table without them is in place: labels that decoders picked up before are
+ * in events the writer stores before its next sweep.
+ */
+static void forget(size_t n) {
+  for (size_t i = n; i < clients.nknown; ++i) {
+    uint32_t label = clients.known[i].label;
+    bool shared = false;
+
+    for (size_t j = 0; j < n && !shared; ++j)
+      shared = clients.known[j].label == label;
+
+    if (!shared)
+      strtab_unpin(label);
+  }
+
+  clients.nknown = n;
+}
+
+/* Puts `f` in `table`, marking files claimed by several clients as shared. */
+static void table_put(FileSlot *table, size_t cap, const FileSlot *f) {
+  size_t i = slot_of(f->dev, f->ino, cap);
+
+  while (table[i].client != 0) {
+    if (table[i].dev == f->dev && table[i].ino == f->ino) {
+      if (table[i].client != f->client)
+        table[i].client = clients.shared;
+      return;
+    }
+    i = (i + 1) & (cap - 1);
+  }
+
+  table[i] = *f;
+}
+
+/*
+ * Rereads every client's open state into a fresh table and swaps it in, at
+ * most once per NFSTOP_CLIENTS_MS. Runs on the daemon's main thread, so the
+ * decoders only ever take the read lock.
+ */
+void clients_refresh(void) {
+  if (!clients.enabled)
+    return;
+
+  long now = now_ms();
+  if (now - clients.refreshed < clients.refresh_ms)
+    return;
+  clients.refreshed = now;
+
+  DIR *dir = opendir(NFSD_CLIENTS);
+  if (dir == NULL)
+    return;
+
+  clients.nscratch = 0;
+  for (size_t i = 0; i < clients.nknown; ++i)
+    clients.known[i].seen = false;
+
+  size_t nclients = 0;
+  struct dirent *ent;
+  while ((ent = readdir(dir)) != NULL) {
+    if (ent->d_name[0] < '0' || ent->d_name[0] > '9')
+      continue;
+
+    uint32_t label = label_of(ent->d_name);
+    if (label == 0)
+      continue;
+
+    read_states(ent->d_name, label);
+    nclients++;
+  }
+  closedir(dir);
+
+  /* Clients that went away move to the end; ids are never reused. */
+  size_t n = 0;
+  for (size_t i = 0; i < clients.nknown; ++i) {
+    if (!clients.known[i].seen)
+      continue;
+
+    Known k = clients.known[n];
+    clients.known[n++] = clients.known[i];
+    clients.known[i] = k;
+  }
+
+  size_t cap = CLIENT_MIN_SLOTS;
+  while (cap < clients.nscratch * 2)
+    cap *= 2;
+
+  FileSlot *table = (FileSlot *)calloc(cap, sizeof(FileSlot));
+  if (table == NULL) {
+    err("Failed to allocate client attribution table");
+    return;
+  }
+
+  for (size_t i = 0; i < clients.nscratch; ++i)
+    table_put(table, cap, &clients.scratch[i]);
+
+  pthread_rwlock_wrlock(&lock);
+
+  FileSlot *old = clients.files;
+  clients.files = table;
+  clients.cap = cap;
+  clients.stats.clients = nclients;
+  clients.stats.files = clients.nscratch;
+  clients.stats.refreshes++;
+
+  pthread_rwlock_unlock(&lock);
+
+  free(old);
+  forget(n);
+}
+
+bool clients_enabled(void) { return clients.enabled; }
+
+/* Returns the label of the client holding the file open, or 0. */
+uint32_t clients_lookup(dev_t dev, ino_t ino) {
+  if (!clients.enabled || ino == 0)
+    return 0;
+
+  uint32_t client = 0;
+
+  pthread_rwlock_rdlock(&lock);
+
+  if (clients.files != NULL) {
+    for (size_t i = slot_of(dev, ino, clients.cap);
+         clients.files[i].client != 0; i = (i + 1) & (clients.cap - 1)) {
+      if (clients.files[i].dev == dev && clients.files[i].ino == ino) {
+        client = clients.files[i].client;
+        break;
+      }
+    }
+  }
+
+  pthread_rwlock_unlock(&lock);
+
+  if (client != 0 && client != clients.shared)
+    __atomic_fetch_add(&clients.stats.hits, 1, __ATOMIC_RELAXED);
+  else
+    __atomic_fetch_add(&clients.stats.misses, 1, __ATOMIC_RELAXED);
+
+  return client == clients.shared ? 0 : client;
+}
+
+void clients_stats(ClientStats *stats) {
+  pthread_rwlock_rdlock(&lock);
+  *stats = clients.stats;
+  pthread_rwlock_unlock(&lock);
+}
+
+void clients_free(void) {
+  pthread_rwlock_wrlock(&lock);
+  free(clients.files);
+  clients.files = NULL;
+  clients.enabled = false;
+  pthread_rwlock_unlock(&lock);
+
+  free(clients.scratch);
+  free(clients.known);
+}
@@ -0,0 +1,41 @@
+#ifndef CLIENTS_H
+#define CLIENTS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define NFSD_CLIENTS "/proc/fs/nfsd/clients"
+
+#define CLIENT_MIN_SLOTS 1024
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t refreshes;
+  size_t clients;
+  size_t files;
+} ClientStats;
+
+/*
+ * Attributes server events to NFSv4 clients through the open state nfsd
+ * lists per client: a file open by exactly one client is charged to that
+ * client's label, "address (hostname)". Files without open state, such as
+ * NFSv3 traffic, and files open by several clients stay unattributed.
+ */
+void clients_init(bool client);
+void clients_refresh(void);
+bool clients_enabled(void);
+uint32_t clients_lookup(dev_t dev, ino_t ino);
+void clients_stats(ClientStats *stats);
+void clients_free(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
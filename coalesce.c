@@ -0,0 +1,157 @@
+#include "coalesce.h"
+#include "utils.h"
+
+static long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static size_t bucket_of(const Event *ev) {
+  uint64_t h = ev->mask * 0x9e3779b97f4a7c15ULL;
+  h ^= ((uint64_t)ev->path << 32 | ev->proc) * 0xff51afd7ed558ccdULL;
+  h ^= (uint64_t)(uint32_t)ev->pid * 0xc4ceb9fe1a85ec53ULL;
+  return (h >> 17) & (COALESCE_BUCKETS - 1);
+}
+
+static bool same(const Event *a, const Event *b) {
+  return a->pid == b->pid && a->mask == b->mask && a->path == b->path &&
+         a->proc == b->proc;
+}
+
+Coalescer *coalesce_new(long window_ms, size_t max_entries, CoalesceFlush flush,
+                        void *ctx) {
+  Coalescer *c = (Coalescer *)calloc(1, sizeof(Coalescer));
+  if (c == NULL) {
+    err("Failed to allocate coalescer");
+    return NULL;
+  }
+
+  c->window_ms = window_ms;
+  c->max_entries = max_entries > 0 ? max_entries : 1;
+  c->flush = flush;
+  c->ctx = ctx;
+
+  return c;
+}
+
+static int pop(Coalescer *c) {
+  CoalesceEntry *e = c->head;
+
+  CoalesceEntry **pp = &c->buckets[bucket_of(&e->event)];
+  while (*pp != e)
+    pp = &(*pp)->next;
+  *pp = e->next;
+
+  c->head = e->fifo;
+  if (c->head == NULL)
+    c->tail = NULL;
+
+  c->stats.entries--;
+  c->stats.out++;
+
+  int rc = c->flush(c->ctx, &e->event, e->count, e->last_time);
+
+  e->next = c->free;
+  c->free = e;
+
+  return rc;
+}
+
+int coalesce_add(Coalescer *c, const Event *event) {
+  size_t b = bucket_of(event);
+
+  c->stats.in++;
+
+  for (CoalesceEntry *e = c->buckets[b]; e != NULL; e = e->next) {
+    if (same(&e->event, event)) {
+      e->count++;
+      e->last_time = event->time;
+      e->event.size = event->size;
+      return 0;
+    }
+  }
+
+  if (c->stats.entries >= c->max_entries) {
+    int rc = pop(c);
+    if (rc != 0)
+      return rc;
+  }
+
+  CoalesceEntry *e = c->free;
+  if (e != NULL) {
+    c->free = e->next;
+  } else {
+    e = (CoalesceEntry *)malloc(sizeof(CoalesceEntry));
+    if (e == NULL) {
+      err("Failed to allocate coalescer entry");
+      return c->flush(c->ctx, event, 1, event->time);
+    }
+  }
+
+  e->event = *event;
+  e->count = 1;
+  e->last_time = event->time;
+  e->deadline = now_ms() + c->window_ms;
+  e->fifo = NULL;
+
+  e->next = c->buckets[b];
+  c->buckets[b] = e;
+
+  if (c->tail != NULL)
+    c->tail->fifo = e;
+  else
+    c->head = e;
+  c->tail = e;
+
+  c->stats.entries++;
+
+  return 0;
+}
+
+int coalesce_tick(Coalescer *c) {
+  if (c->head == NULL)
+    return 0;
+
+  long now = now_ms();
+
+  while (c->head != NULL && c->head->deadline <= now) {
+    int rc = pop(c);
+    if (rc != 0)
+      return rc;
+  }
+
+  return 0;
+}
+
+int coalesce_flush(Coalescer *c) {
+  while (c->head != NULL) {
+    int rc = pop(c);
+    if (rc != 0)
+      return rc;
+  }
+
+  return 0;
+}
+
+void coalesce_stats(const Coalescer *c, CoalesceStats *stats) {
+  stats->in = __atomic_load_n(&c->stats.in, __ATOMIC_RELAXED);
+  stats->out = __atomic_load_n(&c->stats.out, __ATOMIC_RELAXED);
+  stats->entries = __atomic_load_n(&c->stats.entries, __ATOMIC_RELAXED);
+}
+
+void coalesce_free(Coalescer *c) {
+  while (c->head != NULL) {
+    CoalesceEntry *e = c->head;
+    c->head = e->fifo;
+    free(e);
+  }
+
+  while (c->free != NULL) {
+    CoalesceEntry *e = c->free;
+    c->free = e->next;
+    free(e);
+  }
+
+  free(c);
+}
@@ -0,0 +1,60 @@
+#ifndef COALESCE_H
+#define COALESCE_H
+
+#include "event.h"
+
+#define COALESCE_BUCKETS 16384
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef int (*CoalesceFlush)(void *ctx, const Event *event, uint32_t count,
+                             time_t last_time);
+
+typedef struct CoalesceEntry {
+  struct CoalesceEntry *next;
+  struct CoalesceEntry *fifo;
+  Event event;
+  uint32_t count;
+  time_t last_time;
+  long deadline;
+} CoalesceEntry;
+
+typedef struct {
+  uint64_t in;
+  uint64_t out;
+  size_t entries;
+} CoalesceStats;
+
+/*
+ * Merges events with the same (pid, op, path, proc) seen within `window_ms`
+ * into one record carrying a count and the first/last time. Entries leave in
+ * arrival order once their window expires or when `max_entries` is reached.
+ */
+typedef struct {
+  long window_ms;
+  size_t max_entries;
+  CoalesceFlush flush;
+  void *ctx;
+
+  CoalesceEntry *buckets[COALESCE_BUCKETS];
+  CoalesceEntry *head;
+  CoalesceEntry *tail;
+  CoalesceEntry *free;
+  CoalesceStats stats;
+} Coalescer;
+
+Coalescer *coalesce_new(long window_ms, size_t max_entries, CoalesceFlush flush,
+                        void *ctx);
+int coalesce_add(Coalescer *c, const Event *event);
+int coalesce_tick(Coalescer *c);
+int coalesce_flush(Coalescer *c);
+void coalesce_stats(const Coalescer *c, CoalesceStats *stats);
+void coalesce_free(Coalescer *c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,72 +1,278 @@
 #include "event.h"
+#include "capture.h"
+#include "clients.h"
+#include "fhcache.h"
+#include "mounts.h"
+#include "proc.h"
 #include "utils.h"
 
-#define MAX_MOUNTS 100
-
-static struct {
-  Fsid fsid;
-  int mount_fd;
-} fsids[MAX_MOUNTS];
+/* "0" keeps the kernel from attaching a pidfd to every event. */
+#define REPORT_PIDFD                                                           \
+  (getenv("NFSTOP_PIDFD") ? strcmp(getenv("NFSTOP_PIDFD"), "0") != 0 : true)
+
+static unsigned int fan_flags;
+
+/*
+ * Info records attached to one event. In name mode the kernel reports the
+ * parent directory handle plus the entry name, so the path can be rebuilt
+ * from the directory path cache without opening the object itself. `pidfd`
+ * is -1 unless the group reports pidfds.
+ */
+typedef struct {
+  const FanEventInfoFid *fid;
+  const FanEventInfoFid *dfid;
+  const char *name;
+  int pidfd;
+} EventInfo;
+
+static const char *info_name(const FanEventInfoFid *info) {
+  const FileHandle *fh = (const FileHandle *)info->handle;
+  return (const char *)(fh->f_handle + fh->handle_bytes);
+}
 
-static size_t fsids_len;
+static void parse_info(const FanEventMetadata *data, EventInfo *info) {
+  const char *ptr = (const char *)(data + 1);
+  const char *end = (const char *)data + data->event_len;
+
+  memset(info, 0, sizeof(*info));
+  info->pidfd = -1;
+
+  while (ptr + sizeof(struct fanotify_event_info_header) <= end) {
+    const FanEventInfoFid *fid = (const FanEventInfoFid *)ptr;
+
+    if (fid->hdr.len == 0)
+      break;
+
+    switch (fid->hdr.info_type) {
+    case FAN_EVENT_INFO_TYPE_FID:
+      info->fid = fid;
+      break;
+    case FAN_EVENT_INFO_TYPE_DFID:
+      info->dfid = fid;
+      break;
+    case FAN_EVENT_INFO_TYPE_DFID_NAME:
+    case FAN_EVENT_INFO_TYPE_NEW_DFID_NAME:
+      info->dfid = fid;
+      info->name = info_name(fid);
+      break;
+    case FAN_EVENT_INFO_TYPE_OLD_DFID_NAME:
+      if (info->dfid == NULL) {
+        info->dfid = fid;
+        info->name = info_name(fid);
+      }
+      break;
+    case FAN_EVENT_INFO_TYPE_PIDFD:
+      info->pidfd = ((const struct fanotify_event_info_pidfd *)ptr)->pidfd;
+      break;
+    default:
+      debug("skipping event info type %i", fid->hdr.info_type);
+      break;
+    }
 
-void add_fsid(const char *mount_point) {
-  if (fsids_len == MAX_MOUNTS) {
-    warn("Too many mounts, not resolving fd paths for %s", mount_point);
-    return;
+    ptr += fid->hdr.len;
   }
+}
 
-  int fd = open(mount_point, O_RDONLY | O_NOFOLLOW);
-  if (fd < 0) {
-    warn("Failed to open mount point %s", mount_point);
-    return;
+int get_fid_event_fd(const FanEventInfoFid *fid) {
+  int fd = mounts_open((const Fsid *)&fid->fsid, (FileHandle *)fid->handle,
+                       O_RDONLY | O_NONBLOCK | O_LARGEFILE | O_PATH);
+
+  if (fd < 0 && errno != ESTALE)
+    warn("Failed open_by_handle_at with error code: %d", errno);
+
+  return fd;
+}
+
+/*
+ * Fills `attr` from the inode cache, leaving it untouched on failure. On an
+ * NFS client this skips the GETATTR round trip a plain stat() costs.
+ */
+static bool attr_at(int dirfd, const char *path, int flags, FileAttr *attr) {
+  struct statx stx;
+
+  if (statx(dirfd, path, flags | AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+            STATX_SIZE | STATX_INO, &stx) < 0)
+    return false;
+
+  attr->size = (off_t)stx.stx_size;
+  attr->dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+  attr->ino = (ino_t)stx.stx_ino;
+  return true;
+}
+
+/*
+ * Resolves `fid` to a path and, if `attr` is set, its attributes. When
+ * replaying, the capture resolves handles the filesystem cannot.
+ */
+static int fid_path(const FanEventInfoFid *fid, char *path, size_t len,
+                    FileAttr *attr) {
+  int fd = get_fid_event_fd(fid);
+  if (fd < 0)
+    return replay_resolve((const Fsid *)&fid->fsid,
+                          (const FileHandle *)fid->handle, path, len, attr)
+               ? 0
+               : -1;
+
+  if (attr != NULL)
+    attr_at(fd, "", AT_EMPTY_PATH, attr);
+
+  char buf[64];
+  snprintf(buf, sizeof(buf), "/proc/self/fd/%i", fd);
+  ssize_t n = readlink(buf, path, len - 1);
+  if (n < 0) {
+    Stat st;
+    if (fstat(fd, &st) < 0) {
+      err("Failed to fstat, returned exit code: %d", errno);
+      exit(EXIT_FAILURE);
+    }
+    snprintf(path, len, "device %i:%i inode %ld\n", major(st.st_dev),
+             minor(st.st_dev), st.st_ino);
+  } else {
+    path[n] = '\0';
   }
 
-  StatFs s;
-  if (fstatfs(fd, &s) < 0) {
-    warn("Failed to stat mount point %s", mount_point);
-    close(fd);
-    return;
+  close(fd);
+  return 0;
+}
+
+/*
+ * Fills `attr` for the event object through its handle, as fid_path does,
+ * rather than looking up a cached or rebuilt path again. A directory
+ * reporting on itself only carries its handle as the parent's. The path is
+ * only stat'ed when the handle is stale or missing, and never when
+ * replaying, where the capture's resolution of the handle stands in.
+ */
+static bool object_attr(const EventInfo *info, const char *path,
+                        FileAttr *attr) {
+  const FanEventInfoFid *fid = info->fid;
+  if (fid == NULL && (info->name == NULL || strcmp(info->name, ".") == 0))
+    fid = info->dfid;
+
+  if (fid != NULL) {
+    int fd = get_fid_event_fd(fid);
+    if (fd >= 0) {
+      bool ok = attr_at(fd, "", AT_EMPTY_PATH, attr);
+      close(fd);
+      return ok;
+    }
+    if (errno != ESTALE)
+      return false;
+
+    /* The parent's resolutions were recorded for its own path lookups. */
+    char buf[PATH_MAX];
+    if (!mounts_online())
+      return fid == info->fid &&
+             replay_resolve((const Fsid *)&fid->fsid,
+                            (const FileHandle *)fid->handle, buf, sizeof(buf),
+                            attr) &&
+             attr->size >= 0;
   }
 
-  memcpy(&fsids[fsids_len].fsid, &s.f_fsid, sizeof(s.f_fsid));
-  fsids[fsids_len++].mount_fd = fd;
-  debug("mount-> %s, fd-> %i", mount_point, fd);
+  return mounts_online() && attr_at(AT_FDCWD, path, 0, attr);
+}
+
+/* Caches a resolution, and snapshots it for replay when recording. */
+static void remember(const Fsid *fsid, const FileHandle *fh, const char *path,
+                     const FileAttr *attr) {
+  fhcache_put(fsid, fh, path, attr);
+  capture_handle(fsid, fh, path, attr);
 }
 
-int get_mount_id(const fsid_t *fsid) {
-  for (size_t i = 0; i < fsids_len; ++i) {
-    if (memcmp(fsid, &fsids[i].fsid, sizeof(fsids[i].fsid)) == 0) {
-      debug("mapped fsid to fd %i", fsids[i].mount_fd);
-      return fsids[i].mount_fd;
+static int dir_path(const FanEventInfoFid *dfid, char *path, size_t len) {
+  const Fsid *fsid = (const Fsid *)&dfid->fsid;
+  const FileHandle *fh = (const FileHandle *)dfid->handle;
+
+  if (fhcache_get(fsid, fh, path, len, NULL))
+    return 0;
+
+  if (fid_path(dfid, path, len, NULL) < 0)
+    return -1;
+
+  FileAttr attr = {.size = -1};
+  remember(fsid, fh, path, &attr);
+
+  return 0;
+}
+
+static bool name_path(const EventInfo *info, char *path, size_t len) {
+  char dir[PATH_MAX];
+
+  if (dir_path(info->dfid, dir, sizeof(dir)) < 0)
+    return false;
+
+  if (info->name == NULL || strcmp(info->name, ".") == 0)
+    snprintf(path, len, "%s", dir);
+  else if (strcmp(dir, "/") == 0)
+    snprintf(path, len, "/%s", info->name);
+  else
+    snprintf(path, len, "%s/%s", dir, info->name);
+
+  return true;
+}
+
+/*
+ * Creates the group with `flags`, asking for pidfds first (5.15+) so the
+ * pid filter can tell a process from a later one reusing its pid.
+ */
+static int init_group(unsigned int flags) {
+  if (REPORT_PIDFD) {
+    int fan_fd = fanotify_init(flags | FAN_REPORT_PIDFD, O_LARGEFILE);
+    if (fan_fd >= 0) {
+      debug("reporting pidfds");
+      return fan_fd;
     }
   }
 
-  debug("fsid not found, default to AT_FDCWD\n");
-  return AT_FDCWD;
+  return fanotify_init(flags, O_LARGEFILE);
 }
 
-int get_fid_event_fd(const FanEventMetadata *data) {
-  const FanEventInfoFid *fid = (const FanEventInfoFid *)(data + 1);
+int fan_init(void) {
+  const char *capture = getenv("NFSTOP_CAPTURE");
+  int fan_fd;
+
+  if (capture == NULL || strcmp(capture, "fid") != 0) {
+    const unsigned int probes[] = {FAN_REPORT_DFID_NAME_TARGET,
+                                   FAN_REPORT_DFID_NAME | FAN_REPORT_FID};
+
+    for (size_t i = 0; i < sizeof(probes) / sizeof(probes[0]); ++i) {
+      fan_fd = init_group(FAN_CLASS_NOTIF | probes[i]);
+      if (fan_fd >= 0) {
+        fan_flags = probes[i];
+        debug("capture mode: dfid-name (flags 0x%x)", fan_flags);
+        return fan_fd;
+      }
+    }
+
+    debug("FAN_REPORT_DFID_NAME not available, falling back to fid mode");
+  }
 
-  if (fid->hdr.info_type != FAN_EVENT_INFO_TYPE_FID) {
-    fatal("Received unexpected event info type %i", fid->hdr.info_type);
+  fan_fd = init_group(FAN_CLASS_NOTIF | FAN_REPORT_FID);
 
+  if (fan_fd < 0 && errno == EINVAL) {
+    fatal("FAN_REPORT_FID not available");
     exit(EXIT_FAILURE);
   }
 
-  int fd = open_by_handle_at(get_mount_id((const Fsid *)&fid->fsid),
-                             (FileHandle *)fid->handle,
-                             O_RDONLY | O_NONBLOCK | O_LARGEFILE | O_PATH);
+  fan_flags = FAN_REPORT_FID;
 
-  if (fd < 0 && errno != ESTALE)
-    warn("Failed open_by_handle_at with error code: %d", errno);
+  if (fan_fd < 0) {
+    fan_fd = fanotify_init(0, O_LARGEFILE);
+    fan_flags = 0;
+  }
 
-  return fd;
+  if (fan_fd < 0) {
+    fatal("Failed to initialize fanotify");
+    exit(EXIT_FAILURE);
+  }
+
+  return fan_fd;
 }
 
+/* The FAN_REPORT_* flags of the group `fan_init` created. */
+unsigned int fan_report_flags(void) { return fan_flags; }
+
 const char *op(uint64_t mask) {
-  static char buffer[10];
+  static __thread char buffer[10];
   int offset = 0;
 
   if (mask & FAN_ACCESS)
@@ -97,167 +303,260 @@ const char *op(uint64_t mask) {
   return buffer;
 }
 
-off_t size(const char *filename) {
-  Stat st;
-  stat(filename, &st);
-  return st.st_size;
+/*
+ * Inverse of op(), used to migrate stored op strings. "CW" maps back to
+ * FAN_CLOSE_WRITE, a lone 'C' or 'W' to FAN_CLOSE_NOWRITE or FAN_MODIFY.
+ */
+uint64_t op_mask(const char *str) {
+  bool close = strchr(str, 'C') != NULL;
+  bool write = strchr(str, 'W') != NULL;
+  uint64_t mask = 0;
+
+  if (close)
+    mask |= write ? FAN_CLOSE_WRITE : FAN_CLOSE_NOWRITE;
+  else if (write)
+    mask |= FAN_MODIFY;
+
+  for (; *str != '\0'; ++str) {
+    switch (*str) {
+    case 'R':
+      mask |= FAN_ACCESS;
+      break;
+    case 'O':
+      mask |= FAN_OPEN;
+      break;
+    case 'E':
+      mask |= FAN_OPEN_EXEC;
+      break;
+    case '+':
+      mask |= FAN_CREATE;
+      break;
+    case 'D':
+      mask |= FAN_DELETE;
+      break;
+    case '<':
+      mask |= FAN_MOVED_FROM;
+      break;
+    case '>':
+      mask |= FAN_MOVED_TO;
+      break;
+    case '|':
+      mask |= FAN_RENAME;
+      break;
+    case 'M':
+      mask |= FAN_ATTRIB;
+      break;
+    }
+  }
+
+  return mask;
 }
 
-Event *next(const FanEventMetadata *data, time_t *event_time, bool client) {
-  int event_fd = data->fd;
-  static char buf[100];
-  static char proc[100];
-  static int procname_pid = -1;
-  static char path[PATH_MAX];
+/* Every bit op() renders a letter for. */
+#define OP_BITS                                                                \
+  (FAN_ACCESS | FAN_CLOSE | FAN_MODIFY | FAN_OPEN | FAN_OPEN_EXEC |            \
+   FAN_CREATE | FAN_DELETE | FAN_MOVE | FAN_RENAME | FAN_ATTRIB)
 
-  bool got_procname = false;
-  Stat proc_fd_stat;
+/*
+ * Reduces a mask to one value per op() string, which is what events are
+ * grouped by: bits op() does not show, such as FAN_ONDIR, are cleared, and a
+ * close with a write, which reads "CW" however it was reported, becomes
+ * FAN_CLOSE_WRITE alone. The same as op_mask(op(mask)).
+ */
+uint64_t op_normalize(uint64_t mask) {
+  mask &= OP_BITS;
 
-  if ((data->mask & 0xffffffff) == 0 || (data->pid == getpid())) {
-    if (event_fd >= 0)
-      close(event_fd);
-    return NULL;
+  if ((mask & FAN_CLOSE) && (mask & (FAN_MODIFY | FAN_CLOSE_WRITE)))
+    mask = (mask & ~(uint64_t)(FAN_CLOSE | FAN_MODIFY)) | FAN_CLOSE_WRITE;
+
+  return mask;
+}
+
+SizeMode size_mode(void) {
+  static int mode = -1;
+
+  int m = __atomic_load_n(&mode, __ATOMIC_RELAXED);
+  if (m >= 0)
+    return (SizeMode)m;
+
+  const char *env = getenv("NFSTOP_SIZE");
+  if (env == NULL || strcmp(env, "always") == 0)
+    m = SIZE_ALWAYS;
+  else if (strcmp(env, "close-write") == 0)
+    m = SIZE_CLOSE_WRITE;
+  else if (strcmp(env, "lazy") == 0)
+    m = SIZE_LAZY;
+  else if (strcmp(env, "never") == 0)
+    m = SIZE_NEVER;
+  else {
+    warn("Unknown NFSTOP_SIZE %s, using always", env);
+    m = SIZE_ALWAYS;
   }
 
-  snprintf(buf, sizeof(buf), "/proc/%i", data->pid);
-  int proc_fd = open(buf, O_RDONLY | O_DIRECTORY);
-  if (proc_fd >= 0) {
-    int procname_fd = openat(proc_fd, "comm", O_RDONLY);
-    ssize_t len = read(procname_fd, proc, sizeof(proc));
-    if (len >= 0) {
-      while (len > 0 && proc[len - 1] == '\n')
-        len--;
-      proc[len] = '\0';
-      procname_pid = data->pid;
-      got_procname = true;
-    } else {
-      debug("failed to read /proc/%i/comm", data->pid);
-    }
+  __atomic_store_n(&mode, m, __ATOMIC_RELAXED);
+  return (SizeMode)m;
+}
 
-    close(procname_fd);
+/* Whether the daemon records a size for an event with `mask`. */
+static bool records_size(uint64_t mask) {
+  switch (size_mode()) {
+  case SIZE_ALWAYS:
+    return true;
+  case SIZE_CLOSE_WRITE:
+    return (mask & FAN_CLOSE_WRITE) != 0;
+  default:
+    return false;
+  }
+}
 
-    if (fstat(proc_fd, &proc_fd_stat) < 0)
-      debug("failed to stat /proc/%i: %m", data->pid);
+off_t path_size(const char *path) {
+  FileAttr attr = {.size = -1};
+  attr_at(AT_FDCWD, path, 0, &attr);
+  return attr.size;
+}
 
-    close(proc_fd);
-  } else {
-    debug("failed to open /proc/%i: %m", data->pid);
-    proc[0] = '\0';
+/*
+ * Formats a size in KiB for the table. When the daemon that wrote the row ran
+ * with `mode` lazy, a size that was not recorded (-1) is looked up from `path`
+ * at display time; in any other mode -1 means there was none to record.
+ */
+const char *size_str(off_t kb, const char *path, SizeMode mode, char *buf,
+                     size_t len) {
+  if (kb < 0 && mode == SIZE_LAZY && path[0] == '/') {
+    off_t size = path_size(path);
+    kb = size < 0 ? -1 : size / 1024;
   }
 
-  if (!got_procname) {
-    if (data->pid == procname_pid) {
-      debug("re-using cached procname value %s for pid %i", procname,
-            procname_pid);
-    } else if (procname_pid >= 0) {
-      debug("invalidating previously cached procname %s for pid %i", procname,
-            procname_pid);
-      procname_pid = -1;
-      proc[0] = '\0';
-    }
+  if (kb < 0)
+    snprintf(buf, len, "-");
+  else
+    snprintf(buf, len, "%ld", (long)kb);
+
+  return buf;
+}
+
+/*
+ * Resolves the event object to a path and attributes, going through the handle
+ * cache first. Events that may change the object's name or attributes drop
+ * its cache entry before the lookup; directory moves drop everything, as
+ * every cached path below the directory is stale. Attributes are only looked
+ * up if `want` is set, and are otherwise left unknown, with a size of -1.
+ */
+static void resolve(uint64_t mask, const EventInfo *info, bool want,
+                    char *path, size_t len, FileAttr *file) {
+  const Fsid *fsid = NULL;
+  const FileHandle *fh = NULL;
+
+  if (info->fid != NULL) {
+    fsid = (const Fsid *)&info->fid->fsid;
+    fh = (const FileHandle *)info->fid->handle;
   }
 
-  const char *prog_comm = client ? "nfs" : "nfsd";
+  if ((mask & (FAN_DELETE | FAN_MOVE | FAN_RENAME)) && (mask & FAN_ONDIR))
+    fhcache_clear();
+  else if (fh != NULL && (mask & FHCACHE_INVALIDATE))
+    fhcache_remove(fsid, fh);
+
+  if (fh != NULL && fhcache_get(fsid, fh, path, len, file)) {
+    if (want && file->size < 0 && object_attr(info, path, file))
+      remember(fsid, fh, path, file);
+    return;
+  }
+
+  *file = (FileAttr){.size = -1};
+
+  bool named = info->dfid != NULL && name_path(info, path, len);
+  if (named) {
+    debug("resolved %s from directory handle", path);
+    if (want && !(mask & (FAN_DELETE | FAN_MOVED_FROM)))
+      object_attr(info, path, file);
+  } else if (fh == NULL ||
+             fid_path(info->fid, path, len, want ? file : NULL) < 0) {
+    snprintf(path, len, "(deleted)");
+    return;
+  }
+
+  /*
+   * A name the object is leaving is not cached, but replay still looks the
+   * handle up, so the capture keeps it in turn with the others.
+   */
+  if (fh != NULL && !(mask & (FAN_DELETE | FAN_MOVED_FROM)))
+    remember(fsid, fh, path, file);
+  else if (fh != NULL && !named)
+    capture_handle(fsid, fh, path, file);
+}
+
+static Event *decode(const FanEventMetadata *data, const EventInfo *info,
+                     time_t event_time, bool client, Arena *arena) {
+  int event_fd = data->fd;
+  char path[PATH_MAX];
+  uid_t uid;
+  gid_t gid;
 
-  if (strcmp(prog_comm, proc) != 0) {
+  if (op_normalize(data->mask) == 0 || (data->pid == getpid())) {
     if (event_fd >= 0)
       close(event_fd);
     return NULL;
   }
 
-  event_fd = get_fid_event_fd(data);
+  const char *prog_comm = client ? "nfs" : "nfsd";
 
-  if (event_fd >= 0) {
-    snprintf(buf, sizeof(buf), "/proc/self/fd/%i", event_fd);
-    ssize_t len = readlink(buf, path, sizeof(path));
-    if (len < 0) {
-      Stat st;
-      if (fstat(event_fd, &st) < 0) {
-        err("Failed to fstat, returned exit code: %d", errno);
-        exit(EXIT_FAILURE);
-      }
-      snprintf(path, sizeof(path), "device %i:%i inode %ld\n", major(st.st_dev),
-               minor(st.st_dev), st.st_ino);
-    } else {
-      path[len] = '\0';
-    }
+  if (data->mask & FAN_OPEN_EXEC)
+    proc_forget(data->pid);
 
-    close(event_fd);
-  } else {
-    snprintf(path, sizeof(path), "(deleted)");
+  if (!proc_match(data->pid, info->pidfd, &uid, &gid)) {
+    if (event_fd >= 0)
+      close(event_fd);
+    return NULL;
   }
 
-  Event *ev = (Event *)malloc(sizeof(Event));
+  /* Server events need the inode for client attribution. */
+  bool sized = records_size(data->mask);
+  bool want = sized || (!client && clients_enabled());
 
-  ev->client = client;
-  ev->pid = data->pid;
-  ev->uid = proc_fd_stat.st_uid;
-  ev->gid = proc_fd_stat.st_gid;
-  ev->size = path[0] != '\0' ? size(path) : 0;
-  ev->time = event_time;
+  FileAttr file;
+  resolve(data->mask, info, want, path, sizeof(path), &file);
 
-  strncpy(ev->proc_name, proc[0] == '\0' ? "unknown" : proc, sizeof(proc));
-  strncpy(ev->path, path, PATH_MAX);
-  strncpy(ev->op, op(data->mask), sizeof(ev->op));
-
-  return ev;
-}
+  Event *ev = (Event *)arena_alloc(arena, sizeof(Event));
+  if (ev == NULL)
+    return NULL;
 
-void do_mark(int fan_fd, const char *dir, bool fatal) {
-  uint64_t mask = FAN_ACCESS | FAN_MODIFY | FAN_OPEN | FAN_CLOSE | FAN_ONDIR |
-                  FAN_EVENT_ON_CHILD | FAN_CREATE | FAN_DELETE | FAN_MOVE;
+  ev->mask = op_normalize(data->mask);
+  ev->time = event_time;
+  ev->size = sized ? file.size : -1;
+  ev->pid = data->pid;
+  ev->uid = uid;
+  ev->gid = gid;
+  ev->path = strtab_intern(path);
+  ev->proc = strtab_intern(prog_comm);
+  ev->client = client ? 0 : clients_lookup(file.dev, file.ino);
 
-  if (fanotify_mark(fan_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, mask, AT_FDCWD,
-                    dir) < 0) {
-    if (fatal) {
-      err("Failed to add watch for %s", dir);
-      exit(EXIT_FAILURE);
-    } else {
-      warn("Failed to add watch for %s", dir);
-    }
-  }
+  return ev;
 }
 
-void fan_setup(int fan_fd) {
-  do_mark(fan_fd, "/", false);
-  add_fsid("/");
+Event *next(const FanEventMetadata *data, time_t event_time, bool client,
+            Arena *arena) {
+  EventInfo info;
+  parse_info(data, &info);
 
-  FILE *mounts = setmntent("/proc/self/mounts", "r");
-  if (mounts == NULL) {
-    err("Failed to open filesystem description");
-    exit(EXIT_FAILURE);
-  }
+  Event *ev = decode(data, &info, event_time, client, arena);
 
-  Mntent *mount;
-  while ((mount = getmntent(mounts)) != NULL) {
-    if (mount->mnt_fsname == NULL || access(mount->mnt_fsname, F_OK) != 0 ||
-        mount->mnt_fsname[0] != '/') {
-      if (strcmp(mount->mnt_type, "zfs") != 0) {
-        debug("ignore: fsname: %s dir: %s type: %s", mount->mnt_fsname,
-              mount->mnt_dir, mount->mnt_type);
-        continue;
-      }
-    }
-
-    if (strcmp(mount->mnt_dir, "/") == 0)
-      continue;
+  if (info.pidfd >= 0)
+    close(info.pidfd);
 
-    debug("Added watch for mount %s (%s)", mount->mnt_dir, mount->mnt_type);
-    do_mark(fan_fd, mount->mnt_dir, false);
-    add_fsid(mount->mnt_dir);
-  }
-
-  endmntent(mounts);
+  return ev;
 }
 
 void printEvent(const Event *event) {
   char buffer[80];
 
   struct tm *timeinfo;
-  timeinfo = localtime(event->time);
+  timeinfo = localtime(&event->time);
   strftime(buffer, sizeof(buffer), "[%Y-%m-%d] (%H:%M:%S)", timeinfo);
 
-  printf("%s %-5s(%d) [%d:%d]: %3s %s(%lu bytes)\n", buffer, event->proc_name,
-         event->pid, event->uid, event->gid, event->op, event->path,
-         event->size);
+  printf("%s %-5s(%d) [%d:%d]: %3s %s(%ld bytes)%s%s\n", buffer,
+         strtab_get(event->proc), event->pid, event->uid, event->gid,
+         op(event->mask), strtab_get(event->path), event->size,
+         event->client ? " from " : "",
+         event->client ? strtab_get(event->client) : "");
 }
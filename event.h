@@ -1,6 +1,9 @@
 #ifndef NFSTOP_H
 #define NFSTOP_H
 
+#include "arena.h"
+#include "strtab.h"
+
 #include <ctype.h>
 #include <errno.h>
 #include <limits.h>
@@ -22,7 +25,6 @@
 #include <sys/types.h>
 
 #define BUFSIZE 256 * 1024
-#define MAX_MOUNTS 100
 
 #ifdef DEBUG
 #define debug(fmt, ...) fprintf(stderr, "DEBUG: " fmt "\n", ##__VA_ARGS__)
@@ -44,21 +46,42 @@ typedef struct mntent Mntent;
 typedef struct statfs StatFs;
 typedef struct file_handle FileHandle;
 
+/*
+ * Which events get a file size, from NFSTOP_SIZE: every event, CLOSE_WRITE
+ * only, or none. "lazy" records none either, and the TUI looks up the size
+ * of the rows it displays instead.
+ */
+typedef enum { SIZE_ALWAYS, SIZE_CLOSE_WRITE, SIZE_LAZY, SIZE_NEVER } SizeMode;
+
+/*
+ * Compact decoded event. Paths, process names and client labels are interned
+ * in the string table and referenced by id, 0 meaning no client; the op is
+ * kept as the raw fanotify mask. `size` is -1 when it was not recorded.
+ */
 typedef struct {
-  bool client;
-  char proc_name[200];
+  uint64_t mask;
+  time_t time;
+  off_t size;
   pid_t pid;
   uid_t uid;
   gid_t gid;
-  off_t size;
-  char op[10];
-  char path[PATH_MAX];
-  time_t *time;
+  uint32_t path;
+  uint32_t proc;
+  uint32_t client;
 } Event;
 
-Event *next(const FanEventMetadata *data, time_t *event_time, bool client);
+Event *next(const FanEventMetadata *data, time_t event_time, bool client,
+            Arena *arena);
+const char *op(uint64_t mask);
+uint64_t op_mask(const char *str);
+uint64_t op_normalize(uint64_t mask);
 void printEvent(const Event *event);
-void fan_setup(int fan_fd);
+SizeMode size_mode(void);
+off_t path_size(const char *path);
+const char *size_str(off_t kb, const char *path, SizeMode mode, char *buf,
+                     size_t len);
+int fan_init(void);
+unsigned int fan_report_flags(void);
 
 #ifdef __cplusplus
 }
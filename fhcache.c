@@ -0,0 +1,262 @@
+#include "fhcache.h"
+#include "utils.h"
+
+#include <pthread.h>
+
+#define FHCACHE_MB                                                             \
+  (getenv("NFSTOP_FHCACHE_MB") ? atol(getenv("NFSTOP_FHCACHE_MB")) : 64)
+
+typedef struct Entry {
+  struct Entry *next;
+  struct Entry *lru_prev;
+  struct Entry *lru_next;
+  uint64_t hash;
+  Fsid fsid;
+  int handle_type;
+  unsigned int handle_bytes;
+  FileAttr attr;
+  size_t bytes;
+  char *path;
+  unsigned char handle[];
+} Entry;
+
+static struct {
+  Entry **buckets;
+  size_t nbuckets;
+  Entry *lru_head;
+  Entry *lru_tail;
+  size_t limit;
+  FhCacheStats stats;
+} cache;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t hash(const Fsid *fsid, const FileHandle *fh) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  const unsigned char *p = (const unsigned char *)fsid;
+
+  for (size_t i = 0; i < sizeof(Fsid); ++i)
+    h = (h ^ p[i]) * 0x100000001b3ULL;
+
+  h = (h ^ (unsigned int)fh->handle_type) * 0x100000001b3ULL;
+
+  for (unsigned int i = 0; i < fh->handle_bytes; ++i)
+    h = (h ^ fh->f_handle[i]) * 0x100000001b3ULL;
+
+  return h;
+}
+
+static bool init_locked(void) {
+  if (cache.buckets != NULL)
+    return true;
+
+  cache.nbuckets = FHCACHE_MIN_BUCKETS;
+  cache.buckets = (Entry **)calloc(cache.nbuckets, sizeof(Entry *));
+  if (cache.buckets == NULL) {
+    err("Failed to allocate handle cache");
+    return false;
+  }
+
+  long mb = FHCACHE_MB;
+  cache.limit = (size_t)(mb > 0 ? mb : 1) * 1024 * 1024;
+  cache.stats.limit = cache.limit;
+
+  return true;
+}
+
+static Entry **slot(uint64_t h, const Fsid *fsid, const FileHandle *fh) {
+  Entry **pp = &cache.buckets[h & (cache.nbuckets - 1)];
+
+  for (; *pp != NULL; pp = &(*pp)->next) {
+    Entry *e = *pp;
+    if (e->hash == h && e->handle_type == fh->handle_type &&
+        e->handle_bytes == fh->handle_bytes &&
+        memcmp(&e->fsid, fsid, sizeof(Fsid)) == 0 &&
+        memcmp(e->handle, fh->f_handle, fh->handle_bytes) == 0)
+      break;
+  }
+
+  return pp;
+}
+
+static void lru_unlink(Entry *e) {
+  if (e->lru_prev != NULL)
+    e->lru_prev->lru_next = e->lru_next;
+  else
+    cache.lru_head = e->lru_next;
+
+  if (e->lru_next != NULL)
+    e->lru_next->lru_prev = e->lru_prev;
+  else
+    cache.lru_tail = e->lru_prev;
+}
+
+static void lru_push(Entry *e) {
+  e->lru_prev = NULL;
+  e->lru_next = cache.lru_head;
+
+  if (cache.lru_head != NULL)
+    cache.lru_head->lru_prev = e;
+  cache.lru_head = e;
+
+  if (cache.lru_tail == NULL)
+    cache.lru_tail = e;
+}
+
+static void drop_locked(Entry **pp) {
+  Entry *e = *pp;
+
+  *pp = e->next;
+  lru_unlink(e);
+
+  cache.stats.entries--;
+  cache.stats.bytes -= e->bytes;
+  free(e);
+}
+
+static Entry **find_locked(const Entry *e) {
+  Entry **pp = &cache.buckets[e->hash & (cache.nbuckets - 1)];
+
+  while (*pp != e)
+    pp = &(*pp)->next;
+
+  return pp;
+}
+
+static void evict_locked(void) {
+  drop_locked(find_locked(cache.lru_tail));
+  cache.stats.evictions++;
+}
+
+static void grow_locked(void) {
+  size_t nbuckets = cache.nbuckets * 2;
+  Entry **buckets = (Entry **)calloc(nbuckets, sizeof(Entry *));
+  if (buckets == NULL)
+    return;
+
+  for (size_t i = 0; i < cache.nbuckets; ++i) {
+    Entry *e = cache.buckets[i];
+    while (e != NULL) {
+      Entry *next = e->next;
+      e->next = buckets[e->hash & (nbuckets - 1)];
+      buckets[e->hash & (nbuckets - 1)] = e;
+      e = next;
+    }
+  }
+
+  free(cache.buckets);
+  cache.buckets = buckets;
+  cache.nbuckets = nbuckets;
+}
+
+bool fhcache_get(const Fsid *fsid, const FileHandle *fh, char *path,
+                 size_t len, FileAttr *attr) {
+  uint64_t h = hash(fsid, fh);
+
+  pthread_mutex_lock(&lock);
+
+  if (!init_locked()) {
+    pthread_mutex_unlock(&lock);
+    return false;
+  }
+
+  Entry *e = *slot(h, fsid, fh);
+  if (e != NULL) {
+    snprintf(path, len, "%s", e->path);
+    if (attr != NULL)
+      *attr = e->attr;
+
+    lru_unlink(e);
+    lru_push(e);
+    cache.stats.hits++;
+  } else {
+    cache.stats.misses++;
+  }
+
+  pthread_mutex_unlock(&lock);
+
+  return e != NULL;
+}
+
+void fhcache_put(const Fsid *fsid, const FileHandle *fh, const char *path,
+                 const FileAttr *attr) {
+  uint64_t h = hash(fsid, fh);
+  size_t path_len = strlen(path) + 1;
+  size_t bytes = sizeof(Entry) + fh->handle_bytes + path_len;
+
+  pthread_mutex_lock(&lock);
+
+  if (!init_locked()) {
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+
+  Entry **pp = slot(h, fsid, fh);
+  if (*pp != NULL)
+    drop_locked(pp);
+
+  while (cache.lru_tail != NULL && cache.stats.bytes + bytes > cache.limit)
+    evict_locked();
+
+  Entry *e = (Entry *)malloc(bytes);
+  if (e == NULL) {
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+
+  e->hash = h;
+  e->fsid = *fsid;
+  e->handle_type = fh->handle_type;
+  e->handle_bytes = fh->handle_bytes;
+  e->attr = *attr;
+  e->bytes = bytes;
+  memcpy(e->handle, fh->f_handle, fh->handle_bytes);
+  e->path = (char *)e->handle + fh->handle_bytes;
+  memcpy(e->path, path, path_len);
+
+  if (cache.stats.entries >= cache.nbuckets * 2)
+    grow_locked();
+
+  Entry **bucket = &cache.buckets[h & (cache.nbuckets - 1)];
+  e->next = *bucket;
+  *bucket = e;
+  lru_push(e);
+
+  cache.stats.entries++;
+  cache.stats.bytes += bytes;
+
+  pthread_mutex_unlock(&lock);
+}
+
+void fhcache_remove(const Fsid *fsid, const FileHandle *fh) {
+  uint64_t h = hash(fsid, fh);
+
+  pthread_mutex_lock(&lock);
+
+  if (cache.buckets != NULL) {
+    Entry **pp = slot(h, fsid, fh);
+    if (*pp != NULL) {
+      drop_locked(pp);
+      cache.stats.invalidations++;
+    }
+  }
+
+  pthread_mutex_unlock(&lock);
+}
+
+void fhcache_clear(void) {
+  pthread_mutex_lock(&lock);
+
+  while (cache.lru_tail != NULL) {
+    drop_locked(find_locked(cache.lru_tail));
+    cache.stats.invalidations++;
+  }
+
+  pthread_mutex_unlock(&lock);
+}
+
+void fhcache_stats(FhCacheStats *stats) {
+  pthread_mutex_lock(&lock);
+  *stats = cache.stats;
+  pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,51 @@
+#ifndef FHCACHE_H
+#define FHCACHE_H
+
+#include "event.h"
+
+#define FHCACHE_MIN_BUCKETS 4096
+
+#define FHCACHE_INVALIDATE                                                     \
+  (FAN_DELETE | FAN_MOVE | FAN_RENAME | FAN_ATTRIB | FAN_CLOSE_WRITE)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * What a resolved object stats to, cached along with its path. A size of -1
+ * means the attributes were not looked up.
+ */
+typedef struct {
+  off_t size;
+  dev_t dev;
+  ino_t ino;
+} FileAttr;
+
+typedef struct {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t invalidations;
+  size_t entries;
+  size_t bytes;
+  size_t limit;
+} FhCacheStats;
+
+/*
+ * LRU map from (fsid, file handle) to the path and attributes it resolved
+ * to, shared by decoders and bounded by NFSTOP_FHCACHE_MB.
+ */
+bool fhcache_get(const Fsid *fsid, const FileHandle *fh, char *path,
+                 size_t len, FileAttr *attr);
+void fhcache_put(const Fsid *fsid, const FileHandle *fh, const char *path,
+                 const FileAttr *attr);
+void fhcache_remove(const Fsid *fsid, const FileHandle *fh);
+void fhcache_clear(void);
+void fhcache_stats(FhCacheStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,384 @@
+#include "live.h"
+#include "strtab.h"
+#include "utils.h"
+
+#include <stddef.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define LIVE_MIN_SLOTS 256
+
+static uint64_t mix(uint64_t key, uint32_t client) {
+  key ^= (uint64_t)client * 0x9e3779b97f4a7c15ULL;
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return key;
+}
+
+static bool table_grow(LiveTable *t, size_t cap) {
+  LiveEntry *slots = (LiveEntry *)calloc(cap, sizeof(LiveEntry));
+  if (slots == NULL)
+    return false;
+
+  for (size_t i = 0; i < t->cap; ++i) {
+    LiveEntry *e = &t->slots[i];
+    if (e->key == 0 || e->total == 0)
+      continue;
+
+    size_t j = mix(e->key, e->client) & (cap - 1);
+    while (slots[j].key != 0)
+      j = (j + 1) & (cap - 1);
+    slots[j] = *e;
+  }
+
+  size_t n = 0;
+  for (size_t i = 0; i < cap; ++i)
+    n += slots[i].key != 0;
+
+  free(t->slots);
+  t->slots = slots;
+  t->cap = cap;
+  t->n = n;
+
+  return true;
+}
+
+/*
+ * Finds the entry for (`key`, `client`), adding it unless the table holds
+ * `max` keys. Only the files table splits its keys by client.
+ */
+static LiveEntry *table_get(LiveTable *t, uint64_t key, uint32_t client,
+                            size_t max) {
+  if (t->slots == NULL || ((t->n + 1) * 2 > t->cap && t->n < max)) {
+    if (!table_grow(t, t->cap ? t->cap * 2 : LIVE_MIN_SLOTS))
+      return NULL;
+  }
+
+  size_t i = mix(key, client) & (t->cap - 1);
+  while (t->slots[i].key != 0) {
+    if (t->slots[i].key == key && t->slots[i].client == client)
+      return &t->slots[i];
+    i = (i + 1) & (t->cap - 1);
+  }
+
+  if (t->n >= max || (t->n + 1) * 2 > t->cap)
+    return NULL;
+
+  t->slots[i].key = key;
+  t->slots[i].client = client;
+  t->n++;
+
+  return &t->slots[i];
+}
+
+/*
+ * Subtracts slot `idx` from every entry, then drops entries left empty.
+ * Returns whether any count changed.
+ */
+static bool table_expire(LiveTable *t, size_t idx) {
+  size_t live = 0;
+  bool changed = false;
+
+  for (size_t i = 0; i < t->cap; ++i) {
+    LiveEntry *e = &t->slots[i];
+    if (e->key == 0)
+      continue;
+
+    changed |= e->counts[idx] != 0;
+    e->total -= e->counts[idx];
+    e->counts[idx] = 0;
+    live += e->total != 0;
+  }
+
+  if (live != t->n)
+    table_grow(t, t->cap);
+
+  return changed;
+}
+
+static int by_total(const void *a, const void *b) {
+  const LiveEntry *x = *(const LiveEntry *const *)a;
+  const LiveEntry *y = *(const LiveEntry *const *)b;
+
+  return x->total < y->total ? 1 : x->total > y->total ? -1 : 0;
+}
+
+/* Fills `top` with up to `max` entries of `t` in descending count order. */
+static size_t table_top(const LiveTable *t, LiveEntry **top, size_t max) {
+  size_t n = 0;
+
+  for (size_t i = 0; i < t->cap; ++i) {
+    if (t->slots[i].key != 0 && t->slots[i].total != 0)
+      top[n++] = &t->slots[i];
+  }
+
+  qsort(top, n, sizeof(LiveEntry *), by_total);
+
+  return n < max ? n : max;
+}
+
+Live *live_new(long window, size_t max_entries) {
+  Live *live = (Live *)calloc(1, sizeof(Live));
+  if (live == NULL) {
+    err("Failed to allocate live snapshot");
+    return NULL;
+  }
+
+  live->window = window;
+  live->slot_seconds = window / LIVE_SLOTS > 0 ? window / LIVE_SLOTS : 1;
+  live->max_entries = max_entries > 0 ? max_entries : 1;
+  live->slot = time(NULL) / live->slot_seconds;
+
+  live->fd = shm_open(LIVE_SHM, O_CREAT | O_RDWR | O_TRUNC, 0644);
+  if (live->fd < 0) {
+    err("Failed to create shared memory %s, error code: %d", LIVE_SHM, errno);
+    free(live);
+    return NULL;
+  }
+
+  if (ftruncate(live->fd, sizeof(LiveSnapshot)) < 0) {
+    err("Failed to size shared memory %s, error code: %d", LIVE_SHM, errno);
+    live_free(live);
+    return NULL;
+  }
+
+  live->shm = (LiveSnapshot *)mmap(NULL, sizeof(LiveSnapshot),
+                                   PROT_READ | PROT_WRITE, MAP_SHARED,
+                                   live->fd, 0);
+  if (live->shm == MAP_FAILED) {
+    err("Failed to map shared memory %s, error code: %d", LIVE_SHM, errno);
+    live->shm = NULL;
+    live_free(live);
+    return NULL;
+  }
+
+  live->shm->magic = LIVE_MAGIC;
+  live->shm->version = LIVE_VERSION;
+  live->shm->window = live->slot_seconds * LIVE_SLOTS;
+  live->shm->size_mode = size_mode();
+
+  return live;
+}
+
+void live_add(Live *live, const Event *event) {
+  size_t idx = (size_t)(live->slot % LIVE_SLOTS);
+  LiveEntry *e;
+
+  live->dirty = true;
+
+  uint64_t key = (uint64_t)(uint32_t)event->mask << 32 | event->path;
+
+  e = table_get(&live->files, key, event->client, live->max_entries);
+  if (e != NULL) {
+    e->counts[idx]++;
+    e->total++;
+    e->last = *event;
+  } else {
+    live->dropped++;
+  }
+
+  e = table_get(&live->ops, (uint32_t)event->mask, 0, live->max_entries);
+  if (e != NULL) {
+    e->counts[idx]++;
+    e->total++;
+    e->last = *event;
+  }
+
+  e = table_get(&live->procs, event->proc, 0, live->max_entries);
+  if (e != NULL) {
+    e->counts[idx]++;
+    e->total++;
+    e->last = *event;
+  }
+}
+
+static void publish(Live *live) {
+  LiveSnapshot *shm = live->shm;
+  size_t max = live->files.n;
+  if (live->ops.n > max)
+    max = live->ops.n;
+  if (live->procs.n > max)
+    max = live->procs.n;
+
+  LiveEntry **top = (LiveEntry **)malloc((max + 1) * sizeof(LiveEntry *));
+  if (top == NULL)
+    return;
+
+  uint64_t seq = shm->seq;
+  __atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  size_t n = table_top(&live->files, top, LIVE_ROWS);
+  for (size_t i = 0; i < n; ++i) {
+    LiveRow *row = &shm->rows[i];
+    const Event *ev = &top[i]->last;
+
+    row->count = top[i]->total;
+    row->mask = ev->mask;
+    row->pid = ev->pid;
+    row->uid = ev->uid;
+    row->gid = ev->gid;
+    row->size = ev->size;
+    row->time = ev->time;
+    snprintf(row->proc, sizeof(row->proc), "%s", strtab_get(ev->proc));
+    snprintf(row->client, sizeof(row->client), "%s",
+             ev->client ? strtab_get(ev->client) : "-");
+    snprintf(row->path, sizeof(row->path), "%s", strtab_get(ev->path));
+  }
+  shm->nrows = n;
+
+  n = table_top(&live->ops, top, LIVE_TOP);
+  for (size_t i = 0; i < n; ++i) {
+    shm->ops[i].count = top[i]->total;
+    snprintf(shm->ops[i].name, sizeof(shm->ops[i].name), "%s",
+             op(top[i]->last.mask));
+  }
+  shm->nops = n;
+
+  n = table_top(&live->procs, top, LIVE_TOP);
+  for (size_t i = 0; i < n; ++i) {
+    shm->procs[i].count = top[i]->total;
+    snprintf(shm->procs[i].name, sizeof(shm->procs[i].name), "%s",
+             strtab_get(top[i]->last.proc));
+  }
+  shm->nprocs = n;
+
+  __atomic_store_n(&shm->seq, seq + 2, __ATOMIC_RELEASE);
+
+  free(top);
+}
+
+/*
+ * Expires slots that fell out of the window and republishes the snapshot if
+ * it changed, at most once a second. The heartbeat in `updated` is written
+ * every second either way. Called from the writer loop.
+ */
+void live_tick(Live *live) {
+  time_t now = time(NULL);
+  if (now == live->published)
+    return;
+
+  long slot = now / live->slot_seconds;
+  long steps = slot - live->slot;
+  if (steps > LIVE_SLOTS)
+    steps = LIVE_SLOTS;
+
+  for (long i = steps; i > 0; --i) {
+    size_t idx = (size_t)((slot - i + 1) % LIVE_SLOTS);
+
+    live->dirty |= table_expire(&live->files, idx);
+    live->dirty |= table_expire(&live->ops, idx);
+    live->dirty |= table_expire(&live->procs, idx);
+  }
+  live->slot = slot;
+
+  if (live->dirty)
+    publish(live);
+  live->dirty = false;
+
+  __atomic_store_n(&live->shm->updated, now, __ATOMIC_RELEASE);
+  live->published = now;
+}
+
+static void table_keep(const LiveTable *t) {
+  for (size_t i = 0; i < t->cap; ++i) {
+    const LiveEntry *e = &t->slots[i];
+    if (e->key == 0)
+      continue;
+
+    strtab_keep(e->last.path);
+    strtab_keep(e->last.proc);
+    strtab_keep(e->last.client);
+  }
+}
+
+/* Keeps the strings the tables still key on or publish across a sweep. */
+void live_keep(const Live *live) {
+  table_keep(&live->files);
+  table_keep(&live->ops);
+  table_keep(&live->procs);
+}
+
+void live_free(Live *live) {
+  if (live->shm != NULL)
+    munmap(live->shm, sizeof(LiveSnapshot));
+  if (live->fd >= 0) {
+    close(live->fd);
+    shm_unlink(LIVE_SHM);
+  }
+
+  free(live->files.slots);
+  free(live->ops.slots);
+  free(live->procs.slots);
+  free(live);
+}
+
+const LiveSnapshot *live_open(void) {
+  int fd = shm_open(LIVE_SHM, O_RDONLY, 0);
+  if (fd < 0)
+    return NULL;
+
+  Stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(LiveSnapshot)) {
+    close(fd);
+    return NULL;
+  }
+
+  void *shm = mmap(NULL, sizeof(LiveSnapshot), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (shm == MAP_FAILED)
+    return NULL;
+
+  const LiveSnapshot *snap = (const LiveSnapshot *)shm;
+  if (snap->magic != LIVE_MAGIC || snap->version != LIVE_VERSION) {
+    munmap(shm, sizeof(LiveSnapshot));
+    return NULL;
+  }
+
+  return snap;
+}
+
+/*
+ * Copies a consistent snapshot out of the segment. Fails when the writer
+ * keeps it busy or when the daemon has stopped publishing.
+ */
+int live_read(const LiveSnapshot *shm, LiveSnapshot *snapshot) {
+  for (int attempt = 0; attempt < 100; ++attempt) {
+    uint64_t seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+      continue;
+
+    memcpy(snapshot, shm, offsetof(LiveSnapshot, rows));
+    size_t n = snapshot->nrows < LIVE_ROWS ? snapshot->nrows : LIVE_ROWS;
+    memcpy(snapshot->rows, shm->rows, n * sizeof(LiveRow));
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) != seq)
+      continue;
+
+    snapshot->nrows = n;
+    if (snapshot->nops > LIVE_TOP)
+      snapshot->nops = LIVE_TOP;
+    if (snapshot->nprocs > LIVE_TOP)
+      snapshot->nprocs = LIVE_TOP;
+
+    return live_stale(shm) ? 1 : 0;
+  }
+
+  return 1;
+}
+
+bool live_stale(const LiveSnapshot *shm) {
+  time_t updated = __atomic_load_n(&shm->updated, __ATOMIC_ACQUIRE);
+  return updated + LIVE_STALE_SECONDS < time(NULL);
+}
+
+uint64_t live_seq(const LiveSnapshot *shm) {
+  return __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+}
+
+void live_close(const LiveSnapshot *shm) {
+  munmap((void *)shm, sizeof(LiveSnapshot));
+}
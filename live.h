@@ -0,0 +1,115 @@
+#ifndef LIVE_H
+#define LIVE_H
+
+#include "event.h"
+
+#include <limits.h>
+
+#define LIVE_SHM "/nfstop"
+#define LIVE_MAGIC 0x6e667374
+#define LIVE_VERSION 3
+
+#define LIVE_SLOTS 60
+#define LIVE_ROWS 256
+#define LIVE_TOP 16
+
+/* A snapshot older than this is treated as coming from a dead daemon. */
+#define LIVE_STALE_SECONDS 5
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  uint64_t count;
+  uint64_t mask;
+  pid_t pid;
+  uid_t uid;
+  gid_t gid;
+  off_t size;
+  time_t time;
+  char proc[16];
+  char client[64];
+  char path[PATH_MAX];
+} LiveRow;
+
+typedef struct {
+  uint64_t count;
+  char name[16];
+} LiveTop;
+
+/*
+ * Layout of the shared-memory segment. The writer makes `seq` odd while it
+ * updates the snapshot and even again once done; readers retry when `seq` is
+ * odd or changed under them. Rows are ordered by count, highest first.
+ * `updated` is a heartbeat stored every second outside the sequence.
+ * `size_mode` is the daemon's NFSTOP_SIZE, a SizeMode.
+ */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t seq;
+  long window;
+  time_t updated;
+  uint32_t size_mode;
+  uint32_t nrows;
+  uint32_t nops;
+  uint32_t nprocs;
+  LiveTop ops[LIVE_TOP];
+  LiveTop procs[LIVE_TOP];
+  LiveRow rows[LIVE_ROWS];
+} LiveSnapshot;
+
+typedef struct {
+  uint64_t key;
+  uint32_t client;
+  uint64_t total;
+  Event last;
+  uint32_t counts[LIVE_SLOTS];
+} LiveEntry;
+
+typedef struct {
+  LiveEntry *slots;
+  size_t cap;
+  size_t n;
+} LiveTable;
+
+/*
+ * Per-key event counts over the last `window` seconds, split into
+ * LIVE_SLOTS time slots so that expiring the oldest slot is a subtraction.
+ * Owned by the writer thread.
+ */
+typedef struct {
+  long window;
+  long slot_seconds;
+  size_t max_entries;
+  long slot;
+  time_t published;
+  bool dirty;
+  uint64_t dropped;
+
+  LiveTable files;
+  LiveTable ops;
+  LiveTable procs;
+
+  int fd;
+  LiveSnapshot *shm;
+} Live;
+
+Live *live_new(long window, size_t max_entries);
+void live_add(Live *live, const Event *event);
+void live_tick(Live *live);
+void live_keep(const Live *live);
+void live_free(Live *live);
+
+const LiveSnapshot *live_open(void);
+int live_read(const LiveSnapshot *shm, LiveSnapshot *snapshot);
+bool live_stale(const LiveSnapshot *shm);
+uint64_t live_seq(const LiveSnapshot *shm);
+void live_close(const LiveSnapshot *shm);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
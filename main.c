@@ -1,10 +1,26 @@
 #include "args.h"
+#include "capture.h"
+#include "clients.h"
 #include "event.h"
-#include "stat.h"
+#include "mounts.h"
+#include "pipeline.h"
+#include "proc.h"
 #include "store.h"
+#include "tui.h"
 #include "utils.h"
 
-int collect_events(bool client) {
+#define REPLAY_POLL_MS 50
+
+/* Blocked before the pipeline starts, so that only the main thread waits. */
+static void block_signals(sigset_t *signals) {
+  sigemptyset(signals);
+  sigaddset(signals, SIGTERM);
+  sigaddset(signals, SIGINT);
+  sigaddset(signals, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, signals, NULL);
+}
+
+int collect_events(bool client, const char *record) {
 #ifndef DEBUG
   store db = store_open(true);
 
@@ -13,82 +29,164 @@ int collect_events(bool client) {
   }
 #endif
 
-  int fan_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_FID, O_LARGEFILE);
+  if (record != NULL && capture_start(record, client) != 0)
+    return 1;
 
-  if (fan_fd < 0 && errno == EINVAL) {
-    fatal("FAN_REPORT_FID not available");
-    exit(EXIT_FAILURE);
-  }
+  int fan_fd = fan_init();
 
-  if (fan_fd < 0)
-    fan_fd = fanotify_init(0, O_LARGEFILE);
+  mounts_setup(fan_fd, client);
+  proc_init(client);
+  clients_init(client);
 
-  if (fan_fd < 0) {
-    fatal("Failed to initialize fanotify");
-    exit(EXIT_FAILURE);
-  }
+  sigset_t signals;
+  block_signals(&signals);
 
-  fan_setup(fan_fd);
+#ifndef DEBUG
+  Pipeline *pipeline = pipeline_start(fan_fd, db, client);
+#else
+  Pipeline *pipeline = pipeline_start(fan_fd, NULL, client);
+#endif
 
-  void *buffer = NULL;
-  int res = posix_memalign(&buffer, 4096, BUFSIZE);
-  if (res != 0 || buffer == NULL) {
-    fatal("Failed to allocate buffer");
+  if (pipeline == NULL)
     exit(EXIT_FAILURE);
-  }
 
-  time_t event_time;
+  mounts_start();
+
+  struct timespec timeout = {1, 0};
 
-  FanEventMetadata *data;
+  while (!pipeline_done(pipeline)) {
+    int sig = sigtimedwait(&signals, NULL, &timeout);
 
-  while (true) {
-    res = read(fan_fd, buffer, BUFSIZE);
-    if (res == 0) {
-      warn("No more fanotify event (EOF)\n");
+    if (sig > 0) {
+      debug("received signal %d, shutting down", sig);
       break;
     }
 
-    if (res < 0) {
-      if (errno == EINTR)
-        continue;
-      err("Failed to read fanotify events, error code: %d", errno);
-      exit(EXIT_FAILURE);
-    }
+    clients_refresh();
+    pipeline_report(pipeline);
+  }
 
-    data = (FanEventMetadata *)buffer;
+  int rc = pipeline_stop(pipeline);
+  mounts_stop();
+  close(fan_fd);
+  clients_free();
+  capture_stop();
 
-    while (FAN_EVENT_OK(data, res)) {
-      if (data->vers != FANOTIFY_METADATA_VERSION) {
+#ifndef DEBUG
+  int close_rc = store_close(db);
 
-        fatal("Found discrepancy between fanotify metadata version");
-        exit(EXIT_FAILURE);
-      }
+  return rc != 0 ? rc : close_rc;
+#else
+  return rc;
+#endif
+}
+
+/* Loads what decoding needs from a capture, in place of the live system. */
+static void seed(Replay *replay) {
+  CaptureRecord rec;
+  ssize_t len;
+  void *buf = malloc(BUFSIZE);
+
+  if (buf == NULL) {
+    fatal("Failed to allocate replay buffer");
+    exit(EXIT_FAILURE);
+  }
+
+  proc_init(replay->client);
+  proc_offline();
+  mounts_offline();
+
+  while ((len = replay_next(replay, &rec, buf, BUFSIZE)) >= 0) {
+    if (rec.type == CAP_MOUNT && len == sizeof(CapMount)) {
+      const CapMount *m = (const CapMount *)buf;
+      mounts_seed(&m->fsid, (dev_t)m->dev);
+    } else if (rec.type == CAP_PROC && len == sizeof(CapProc)) {
+      const CapProc *pr = (const CapProc *)buf;
+      proc_seed(pr->pid, pr->uid, pr->gid, pr->matched);
+    } else if (rec.type == CAP_HANDLE && !replay_seed_handle(buf, len)) {
+      warn("skipping malformed handle record");
+    }
+  }
+
+  free(buf);
+  replay_rewind(replay);
+}
 
-      time(&event_time);
-      Event *event = next(data, &event_time, client);
+/*
+ * Feeds a capture through the decoders and the store, without fanotify or
+ * root, and reports the rate it was processed at. Events go to a scratch
+ * store next to the capture, `FILE.db`, unless NFSTOP_STORE names one.
+ */
+int replay_events(const char *path, bool fast) {
+  Replay *replay = replay_open(path);
+  if (replay == NULL)
+    return 1;
 
-      if (event != NULL) {
 #ifndef DEBUG
-        int rc = store_insert(db, event);
+  char scratch[PATH_MAX];
+  snprintf(scratch, sizeof(scratch), "%s.db", path);
+  setenv("NFSTOP_STORE", scratch, 0);
+
+  store db = store_open(true);
+
+  if (db == NULL) {
+    replay_close(replay);
+    return 1;
+  }
+#endif
+
+  seed(replay);
+
+  sigset_t signals;
+  block_signals(&signals);
 
-        if (rc != 0) {
-          return rc;
-        }
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+#ifndef DEBUG
+  Pipeline *pipeline = pipeline_replay(replay, fast, db);
 #else
-        printEvent(event);
+  Pipeline *pipeline = pipeline_replay(replay, fast, NULL);
 #endif
 
-        free(event);
-      }
+  if (pipeline == NULL)
+    exit(EXIT_FAILURE);
+
+  struct timespec timeout = {0, REPLAY_POLL_MS * 1000000L};
 
-      data = FAN_EVENT_NEXT(data, res);
+  while (!pipeline_done(pipeline)) {
+    int sig = sigtimedwait(&signals, NULL, &timeout);
+
+    if (sig > 0) {
+      debug("received signal %d, stopping replay", sig);
+      break;
     }
   }
 
+  StageStats stats[STAGE_MAX];
+  pipeline_stats(pipeline, stats);
+  int rc = pipeline_stop(pipeline);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double elapsed =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  printf("replayed %lu events, %lu decoded, in %.3f s (%.0f events/s)\n",
+         stats[STAGE_READER].events, stats[STAGE_DECODER].events, elapsed,
+         elapsed > 0 ? stats[STAGE_READER].events / elapsed : 0.0);
+#ifndef DEBUG
+  printf("stored in %s\n", getenv("NFSTOP_STORE"));
+#endif
+
+  mounts_stop();
+  replay_close(replay);
+
 #ifndef DEBUG
-  return store_close(db);
+  int close_rc = store_close(db);
+
+  return rc != 0 ? rc : close_rc;
 #else
-  return 0;
+  return rc;
 #endif
 }
 
@@ -97,6 +195,10 @@ int main(int argc, char *argv[]) {
 
   if (args == NULL) {
     return 0;
+  } else if (args->replay != NULL) {
+    int rc = replay_events(args->replay, args->fast);
+    free(args);
+    return rc;
   } else if (args->daemon) {
     if (geteuid() != 0) {
       fatal("You need to run daemon with elevated privileges.");
@@ -124,55 +226,12 @@ int main(int argc, char *argv[]) {
     close(STDERR_FILENO);
 #endif
 
-    int rc = collect_events(args->client);
+    int rc = collect_events(args->client, args->record);
     return rc;
-  } else {
-    sqlite3 *db = store_open(false);
-
-    if (db == NULL) {
-      return 1;
-    }
-
-    initscr();
-    cbreak();
-    noecho();
-    keypad(stdscr, TRUE);
-
-    start_color();
-    init_pair(1, COLOR_BLACK, COLOR_WHITE);
-
-    WINDOW *win = newwin(0, 0, 0, 0);
-    box(win, 0, 0);
-    while (true) {
-      ProcStat *p = procstat(args->client);
-
-      if (p == NULL) {
-        sleep(1);
-        endwin();
-        return 1;
-      }
-
-      clear();
-
-      showStat(p, win);
-
-      wattron(win, COLOR_PAIR(1));
-      mvwprintw(win, 6, 2, "%-9s %-15s %-10s %-10s %-10s %-10s %-10s %-10s",
-                "COUNT", "PROC_NAME", "PID", "UID", "GID", "SIZE", "OP",
-                "PATH");
-      wattroff(win, COLOR_PAIR(1));
-
-      if (store_show(db, win) == 1) {
-        break;
-      }
-
-      free(p);
-      wrefresh(win);
-      napms(1000);
-    }
-    endwin();
   }
 
+  int rc = tui_run(args);
+
   free(args);
-  return 0;
+  return rc;
 }
@@ -0,0 +1,729 @@
+#include "mounts.h"
+#include "capture.h"
+#include "utils.h"
+
+#include <poll.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <unistd.h>
+
+/* "auto" marks what the mode serves, "all" every local filesystem. */
+#define MARK_MODE (getenv("NFSTOP_MARK") ? getenv("NFSTOP_MARK") : "auto")
+
+/* Events a mount mark cannot report. */
+#define DIRENT_EVENTS (FAN_CREATE | FAN_DELETE | FAN_MOVE | FAN_ATTRIB)
+
+#define WATCH_POLL_MS 200
+
+typedef enum { MARK_ALL, MARK_EXPORTS, MARK_NFS } MarkMode;
+
+/* `fd` is -1 when the filesystem could not be marked or opened. */
+typedef struct {
+  Fsid fsid;
+  dev_t dev;
+  int fd;
+  bool marked;
+  bool seen;
+} FsMount;
+
+typedef struct {
+  dev_t dev;
+  char *dir;
+  char *type;
+  char *source;
+} MountInfo;
+
+static struct {
+  int fan_fd;
+  MarkMode mode;
+  /* A server in auto mode, which follows its exports as they change. */
+  bool follow_exports;
+
+  FsMount *mounts;
+  size_t n;
+  size_t cap;
+
+  /* Open-addressed indexes holding positions in `mounts` plus one. */
+  uint32_t *by_fsid;
+  uint32_t *by_dev;
+  size_t slots;
+
+  pthread_t watcher;
+  bool watching;
+  bool stop;
+
+  /* Replaying a capture: filesystems are known by fsid but never opened. */
+  bool offline;
+
+  MountStats stats;
+} table;
+
+/*
+ * Decoders hold the read lock across open_by_handle_at, so a rescan cannot
+ * close a mount fd under them; writers are preferred so it is not starved.
+ */
+static pthread_rwlock_t lock =
+    PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+
+/* Serializes rescans; only the scanning thread modifies the table. */
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t fsid_key(const Fsid *fsid) {
+  uint64_t key;
+  memcpy(&key, fsid, sizeof(key));
+  return key;
+}
+
+static size_t slot_of(uint64_t key, size_t slots) {
+  return (size_t)((key * 0x9e3779b97f4a7c15ULL) >> 17) & (slots - 1);
+}
+
+static void index_put(uint32_t *index, uint64_t key, uint32_t pos) {
+  size_t i = slot_of(key, table.slots);
+  while (index[i] != 0)
+    i = (i + 1) & (table.slots - 1);
+  index[i] = pos;
+}
+
+/* Rebuilds both indexes from `mounts`. */
+static void reinsert(void) {
+  memset(table.by_fsid, 0, table.slots * sizeof(uint32_t));
+  memset(table.by_dev, 0, table.slots * sizeof(uint32_t));
+
+  for (size_t i = 0; i < table.n; ++i) {
+    FsMount *m = &table.mounts[i];
+    index_put(table.by_dev, (uint64_t)m->dev, (uint32_t)i + 1);
+    if (m->fd >= 0 || table.offline)
+      index_put(table.by_fsid, fsid_key(&m->fsid), (uint32_t)i + 1);
+  }
+}
+
+static bool reindex(size_t slots) {
+  uint32_t *by_fsid = (uint32_t *)calloc(slots, sizeof(uint32_t));
+  uint32_t *by_dev = (uint32_t *)calloc(slots, sizeof(uint32_t));
+  if (by_fsid == NULL || by_dev == NULL) {
+    free(by_fsid);
+    free(by_dev);
+    return false;
+  }
+
+  free(table.by_fsid);
+  free(table.by_dev);
+  table.by_fsid = by_fsid;
+  table.by_dev = by_dev;
+  table.slots = slots;
+  reinsert();
+
+  return true;
+}
+
+static FsMount *find_dev(dev_t dev) {
+  if (table.by_dev == NULL)
+    return NULL;
+
+  for (size_t i = slot_of((uint64_t)dev, table.slots); table.by_dev[i] != 0;
+       i = (i + 1) & (table.slots - 1)) {
+    FsMount *m = &table.mounts[table.by_dev[i] - 1];
+    if (m->dev == dev)
+      return m;
+  }
+
+  return NULL;
+}
+
+static FsMount *find_fsid(const Fsid *fsid) {
+  if (table.by_fsid == NULL)
+    return NULL;
+
+  for (size_t i = slot_of(fsid_key(fsid), table.slots); table.by_fsid[i] != 0;
+       i = (i + 1) & (table.slots - 1)) {
+    FsMount *m = &table.mounts[table.by_fsid[i] - 1];
+    if (memcmp(&m->fsid, fsid, sizeof(*fsid)) == 0)
+      return m;
+  }
+
+  return NULL;
+}
+
+/* Called with the write lock held. */
+static bool append(const FsMount *m) {
+  bool ok = true;
+  if (table.n == table.cap) {
+    size_t cap = table.cap ? table.cap * 2 : MOUNTS_MIN_SLOTS / 2;
+    FsMount *mounts = (FsMount *)realloc(table.mounts, cap * sizeof(FsMount));
+    ok = mounts != NULL;
+    if (ok) {
+      table.mounts = mounts;
+      table.cap = cap;
+    }
+  }
+  if (ok && (table.n + 1) * 2 > table.slots)
+    ok = reindex(table.slots ? table.slots * 2 : MOUNTS_MIN_SLOTS);
+
+  if (ok) {
+    table.mounts[table.n++] = *m;
+    index_put(table.by_dev, (uint64_t)m->dev, (uint32_t)table.n);
+    if (m->fd >= 0 || table.offline)
+      index_put(table.by_fsid, fsid_key(&m->fsid), (uint32_t)table.n);
+    table.stats.filesystems = table.n;
+    table.stats.marks += m->marked;
+    table.stats.fds += m->fd >= 0;
+    table.stats.added++;
+  }
+
+  return ok;
+}
+
+/*
+ * Records the filesystem of `mount_point`, opening it to resolve handles.
+ * Only the first mount of a superblock keeps an fd; later ones with the same
+ * fsid are recorded by device alone.
+ */
+static void add(const char *mount_point, dev_t dev, bool marked) {
+  FsMount m = {.dev = dev, .fd = -1, .marked = marked, .seen = true};
+
+  if (marked) {
+    StatFs s;
+    m.fd = open(mount_point, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (m.fd < 0) {
+      warn("Failed to open mount point %s", mount_point);
+    } else if (fstatfs(m.fd, &s) < 0) {
+      warn("Failed to stat mount point %s", mount_point);
+      close(m.fd);
+      m.fd = -1;
+    } else if (find_fsid((const Fsid *)&s.f_fsid) != NULL) {
+      debug("%s shares a superblock with a known mount", mount_point);
+      close(m.fd);
+      m.fd = -1;
+    } else {
+      memcpy(&m.fsid, &s.f_fsid, sizeof(m.fsid));
+    }
+  }
+
+  pthread_rwlock_wrlock(&lock);
+  bool ok = append(&m);
+  pthread_rwlock_unlock(&lock);
+
+  if (!ok) {
+    err("Failed to grow the mount table for %s", mount_point);
+    if (m.fd >= 0)
+      close(m.fd);
+    return;
+  }
+
+  if (m.fd >= 0)
+    capture_record(CAP_MOUNT, &(CapMount){.fsid = m.fsid, .dev = dev},
+                   sizeof(CapMount));
+
+  debug("mount-> %s, fd-> %i", mount_point, m.fd);
+}
+
+static uint64_t mark_mask(void) {
+  uint64_t mask = FAN_ACCESS | FAN_MODIFY | FAN_OPEN | FAN_OPEN_EXEC |
+                  FAN_CLOSE | FAN_ONDIR | FAN_EVENT_ON_CHILD | DIRENT_EVENTS;
+
+  /* FAN_RENAME reports both ends of a move, which needs the target name. */
+  if ((fan_report_flags() & FAN_REPORT_DFID_NAME_TARGET) ==
+      FAN_REPORT_DFID_NAME_TARGET)
+    mask |= FAN_RENAME;
+  if (!(fan_report_flags() & FAN_REPORT_FID))
+    mask &= ~(uint64_t)FAN_ATTRIB;
+
+  return mask;
+}
+
+/*
+ * Marks the filesystem holding `dir`. Where the kernel refuses a filesystem
+ * mark, e.g. on a btrfs subvolume, the mount is marked instead; mount marks
+ * cannot report directory entry or attribute events, so those are left out.
+ */
+static bool do_mark(const char *dir) {
+  uint64_t mask = mark_mask();
+
+  if (fanotify_mark(table.fan_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, mask,
+                    AT_FDCWD, dir) == 0)
+    return true;
+
+  if (errno == EXDEV || errno == EINVAL || errno == ENODEV ||
+      errno == EOPNOTSUPP) {
+    if (fanotify_mark(table.fan_fd, FAN_MARK_ADD | FAN_MARK_MOUNT,
+                      mask & ~(DIRENT_EVENTS | FAN_RENAME), AT_FDCWD,
+                      dir) == 0) {
+      debug("marked mount %s without directory entry events", dir);
+      return true;
+    }
+  }
+
+  warn("Failed to add watch for %s", dir);
+  return false;
+}
+
+/*
+ * Removes the mark `do_mark` placed on the filesystem or mount open at `fd`,
+ * for a filesystem that is still mounted but no longer watched.
+ */
+static void do_unmark(int fd) {
+  uint64_t mask = mark_mask();
+
+  if (fanotify_mark(table.fan_fd, FAN_MARK_REMOVE | FAN_MARK_FILESYSTEM, mask,
+                    fd, NULL) != 0)
+    fanotify_mark(table.fan_fd, FAN_MARK_REMOVE | FAN_MARK_MOUNT,
+                  mask & ~(DIRENT_EVENTS | FAN_RENAME), fd, NULL);
+}
+
+/*
+ * Unmarks, closes and drops every filesystem the last scan did not see,
+ * because it was unmounted or the mode no longer covers it.
+ */
+static void prune(size_t entries) {
+  pthread_rwlock_wrlock(&lock);
+
+  size_t n = 0;
+  for (size_t i = 0; i < table.n; ++i) {
+    FsMount *m = &table.mounts[i];
+    if (m->seen) {
+      table.mounts[n++] = *m;
+      continue;
+    }
+
+    debug("forgetting device %u:%u", major(m->dev), minor(m->dev));
+    if (m->fd >= 0) {
+      if (m->marked)
+        do_unmark(m->fd);
+      close(m->fd);
+      table.stats.fds--;
+    }
+    table.stats.marks -= m->marked;
+    table.stats.removed++;
+  }
+
+  if (n != table.n) {
+    table.n = n;
+    reinsert();
+  }
+  table.stats.filesystems = n;
+  table.stats.entries = entries;
+  table.stats.scans++;
+
+  pthread_rwlock_unlock(&lock);
+}
+
+/* Marks the filesystem `dev` mounted at `dir` unless it already is. */
+static void watch(const char *dir, dev_t dev) {
+  FsMount *known = find_dev(dev);
+  if (known != NULL) {
+    known->seen = true;
+    return;
+  }
+
+  debug("Added watch for %s", dir);
+  add(dir, dev, do_mark(dir));
+}
+
+/*
+ * A path on a btrfs subvolume reports a device of its own, so its fsid is
+ * checked as well before the filesystem is marked again.
+ */
+static void watch_path(const char *path) {
+  Stat st;
+  StatFs s;
+
+  if (stat(path, &st) < 0) {
+    warn("Failed to stat %s", path);
+    return;
+  }
+
+  FsMount *known = find_dev(st.st_dev);
+  if (known == NULL && statfs(path, &s) == 0)
+    known = find_fsid((const Fsid *)&s.f_fsid);
+
+  if (known != NULL) {
+    known->seen = true;
+    return;
+  }
+
+  watch(path, st.st_dev);
+}
+
+/* Paths escape whitespace and backslashes as \ooo octal. */
+static void unescape(char *str) {
+  char *out = str;
+
+  for (char *p = str; *p != '\0'; ++p) {
+    if (p[0] == '\\' && p[1] >= '0' && p[1] <= '7' && p[2] >= '0' &&
+        p[2] <= '7' && p[3] >= '0' && p[3] <= '7') {
+      *out++ = (char)((p[1] - '0') << 6 | (p[2] - '0') << 3 | (p[3] - '0'));
+      p += 3;
+    } else {
+      *out++ = *p;
+    }
+  }
+
+  *out = '\0';
+}
+
+/*
+ * Marks the filesystem of every export listed in `file`, one per line as
+ * "PATH<tab>CLIENT(OPTIONS)", or only counts them unless `mark` is set.
+ * Returns the number of exports found.
+ */
+static size_t watch_exports(const char *file, bool mark) {
+  char line[PATH_MAX + 1024];
+  size_t n = 0;
+
+  FILE *exports = fopen(file, "re");
+  if (exports == NULL)
+    return 0;
+
+  while (fgets(line, sizeof(line), exports) != NULL) {
+    if (line[0] != '/')
+      continue;
+
+    if (mark) {
+      line[strcspn(line, " \t\n")] = '\0';
+      unescape(line);
+      watch_path(line);
+    }
+    n++;
+  }
+
+  fclose(exports);
+  return n;
+}
+
+/*
+ * Splits a mountinfo line, "ID PARENT MAJ:MIN ROOT DIR OPTIONS [OPTIONAL...]
+ * - TYPE SOURCE SUPER_OPTIONS", in place.
+ */
+static bool parse_mountinfo(char *line, MountInfo *m) {
+  char *save = NULL;
+  char *field[6];
+  unsigned int maj, min;
+
+  for (int i = 0; i < 6; ++i) {
+    field[i] = strtok_r(i == 0 ? line : NULL, " \n", &save);
+    if (field[i] == NULL)
+      return false;
+  }
+
+  if (sscanf(field[2], "%u:%u", &maj, &min) != 2)
+    return false;
+
+  char *tok;
+  while ((tok = strtok_r(NULL, " \n", &save)) != NULL && strcmp(tok, "-") != 0)
+    ;
+
+  m->type = strtok_r(NULL, " \n", &save);
+  m->source = strtok_r(NULL, " \n", &save);
+  if (tok == NULL || m->type == NULL || m->source == NULL)
+    return false;
+
+  m->dev = makedev(maj, min);
+  m->dir = field[4];
+  unescape(m->dir);
+  unescape(m->source);
+
+  return true;
+}
+
+static bool is_nfs(const MountInfo *m) {
+  return strcmp(m->type, "nfs") == 0 || strcmp(m->type, "nfs4") == 0;
+}
+
+/* Block device filesystems and zfs datasets. */
+static bool is_local(const MountInfo *m) {
+  if (strcmp(m->type, "zfs") == 0)
+    return true;
+
+  return m->source[0] == '/' && access(m->source, F_OK) == 0;
+}
+
+/*
+ * Marks what the mode watches and forgets filesystems that are no longer
+ * mounted. The mountinfo device is the superblock's, so bind mounts of a
+ * known filesystem are skipped without a syscall. Returns the number of
+ * exports or NFS mounts found.
+ */
+static size_t scan(void) {
+  pthread_mutex_lock(&scan_lock);
+
+  for (size_t i = 0; i < table.n; ++i)
+    table.mounts[i].seen = false;
+
+  size_t found = 0;
+  if (table.mode == MARK_EXPORTS)
+    found = watch_exports(NFSD_EXPORTS, true) + watch_exports(NFS_ETAB, true);
+  else if (table.mode == MARK_ALL)
+    watch_path("/");
+
+  FILE *info = fopen(MOUNT_INFO, "re");
+  if (info == NULL) {
+    err("Failed to open filesystem description");
+    pthread_mutex_unlock(&scan_lock);
+    return found;
+  }
+
+  char *line = NULL;
+  size_t len = 0;
+  size_t entries = 0;
+  while (getline(&line, &len, info) > 0) {
+    MountInfo m;
+    if (!parse_mountinfo(line, &m))
+      continue;
+
+    entries++;
+    bool nfs = is_nfs(&m);
+    found += table.mode == MARK_NFS && nfs;
+
+    /* Exports were seen above; a known mount is one the mode covers. */
+    FsMount *known = find_dev(m.dev);
+    if (known != NULL) {
+      if (table.mode == MARK_ALL || (table.mode == MARK_NFS && nfs))
+        known->seen = true;
+      continue;
+    }
+
+    if ((table.mode == MARK_NFS && nfs) ||
+        (table.mode == MARK_ALL && is_local(&m)))
+      watch(m.dir, m.dev);
+    else
+      debug("ignore: source: %s dir: %s type: %s", m.source, m.dir, m.type);
+  }
+
+  free(line);
+  fclose(info);
+
+  prune(entries);
+  pthread_mutex_unlock(&scan_lock);
+
+  return found;
+}
+
+/* A server without exports watches every filesystem until it has some. */
+static MarkMode server_mode(void) {
+  if (watch_exports(NFSD_EXPORTS, false) + watch_exports(NFS_ETAB, false) > 0)
+    return MARK_EXPORTS;
+
+  return MARK_ALL;
+}
+
+/*
+ * Marks only what the mode can see traffic on: the filesystems of the
+ * server's exports, or the client's NFS mounts. The kernel export cache is
+ * filled on demand, so the exportfs table is read as well. A server without
+ * exports falls back to every filesystem.
+ */
+void mounts_setup(int fan_fd, bool client) {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  table.fan_fd = fan_fd;
+
+  if (strcmp(MARK_MODE, "all") == 0) {
+    table.mode = MARK_ALL;
+  } else if (client) {
+    table.mode = MARK_NFS;
+  } else {
+    table.follow_exports = true;
+    table.mode = server_mode();
+  }
+
+  size_t found = scan();
+
+  if (table.mode == MARK_NFS && found == 0)
+    warn("No NFS mounts to watch");
+  else if (table.follow_exports && table.mode == MARK_ALL)
+    warn("No NFS exports found, watching every filesystem until there are");
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  pthread_rwlock_wrlock(&lock);
+  table.stats.startup_ms = (end.tv_sec - start.tv_sec) * 1e3 +
+                           (end.tv_nsec - start.tv_nsec) / 1e6;
+  pthread_rwlock_unlock(&lock);
+}
+
+/* Drains `fd` and reports whether the exportfs table was rewritten. */
+static bool etab_changed(int fd) {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  bool changed = false;
+  ssize_t n;
+
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    const struct inotify_event *ev;
+    for (char *p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+      ev = (const struct inotify_event *)p;
+      changed |= ev->len > 0 && strcmp(ev->name, NFS_ETAB_NAME) == 0;
+    }
+  }
+
+  return changed;
+}
+
+/*
+ * Switches a server between watching its exports and, while it has none,
+ * every filesystem. The next scan unmarks what the new mode leaves out.
+ */
+static void follow_exports(void) {
+  MarkMode mode = server_mode();
+  if (mode == table.mode)
+    return;
+
+  if (mode == MARK_EXPORTS)
+    warn("NFS exports appeared, watching only their filesystems");
+  else
+    warn("No NFS exports left, watching every filesystem");
+
+  table.mode = mode;
+}
+
+/*
+ * The kernel flags the mountinfo fd with POLLPRI whenever the mount table
+ * of the namespace changes. exportfs rewrites etab through a rename, so the
+ * directory is watched rather than the file, also while a server without
+ * exports watches every filesystem, so that it can go back to its exports.
+ */
+static void *watch_mounts(void *arg) {
+  (void)arg;
+  struct pollfd fds[2];
+  nfds_t nfds = 0;
+
+  int info_fd = open(MOUNT_INFO, O_RDONLY | O_CLOEXEC);
+  if (info_fd < 0) {
+    warn("Failed to open %s, not tracking mounts", MOUNT_INFO);
+    return NULL;
+  }
+  fds[nfds++] = (struct pollfd){info_fd, POLLPRI, 0};
+
+  int notify_fd = -1;
+  if (table.follow_exports) {
+    notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (notify_fd >= 0 &&
+        inotify_add_watch(notify_fd, NFS_STATE_DIR,
+                          IN_CLOSE_WRITE | IN_MOVED_TO) >= 0)
+      fds[nfds++] = (struct pollfd){notify_fd, POLLIN, 0};
+    else
+      debug("not watching %s for export changes", NFS_STATE_DIR);
+  }
+
+  while (!__atomic_load_n(&table.stop, __ATOMIC_ACQUIRE)) {
+    if (poll(fds, nfds, WATCH_POLL_MS) <= 0)
+      continue;
+
+    bool changed = fds[0].revents & (POLLPRI | POLLERR);
+    if (nfds > 1 && (fds[1].revents & POLLIN))
+      changed |= etab_changed(notify_fd);
+
+    if (changed) {
+      debug("mount table changed, rescanning");
+      if (table.follow_exports)
+        follow_exports();
+      scan();
+    }
+  }
+
+  if (notify_fd >= 0)
+    close(notify_fd);
+  close(info_fd);
+
+  return NULL;
+}
+
+int mounts_start(void) {
+  if (pthread_create(&table.watcher, NULL, watch_mounts, NULL) != 0) {
+    err("Failed to start the mount watcher");
+    return 1;
+  }
+
+  table.watching = true;
+  return 0;
+}
+
+/*
+ * Opens `fh` relative to the mount of its filesystem, or the working
+ * directory when the filesystem is not known.
+ */
+int mounts_open(const Fsid *fsid, FileHandle *fh, int flags) {
+  int mount_fd = AT_FDCWD;
+
+  pthread_rwlock_rdlock(&lock);
+
+  const FsMount *m = find_fsid(fsid);
+  if (m != NULL)
+    mount_fd = m->fd;
+  else
+    debug("fsid not found, default to AT_FDCWD");
+
+  if (table.offline) {
+    pthread_rwlock_unlock(&lock);
+    errno = ESTALE;
+    return -1;
+  }
+
+  int fd = open_by_handle_at(mount_fd, fh, flags);
+  int saved = errno;
+
+  pthread_rwlock_unlock(&lock);
+
+  errno = saved;
+  return fd;
+}
+
+/*
+ * For replay: filesystems come from the capture through `mounts_seed` and
+ * no handle is opened, the capture's own resolutions standing in.
+ */
+void mounts_offline(void) {
+  pthread_rwlock_wrlock(&lock);
+  table.offline = true;
+  pthread_rwlock_unlock(&lock);
+}
+
+/* Whether handles are opened on the live system, false when replaying. */
+bool mounts_online(void) {
+  pthread_rwlock_rdlock(&lock);
+  bool online = !table.offline;
+  pthread_rwlock_unlock(&lock);
+
+  return online;
+}
+
+void mounts_seed(const Fsid *fsid, dev_t dev) {
+  FsMount m = {.fsid = *fsid, .dev = dev, .fd = -1, .seen = true};
+
+  pthread_rwlock_wrlock(&lock);
+  if (find_fsid(fsid) == NULL && !append(&m))
+    err("Failed to grow the mount table");
+  pthread_rwlock_unlock(&lock);
+}
+
+void mounts_stats(MountStats *stats) {
+  pthread_rwlock_rdlock(&lock);
+  *stats = table.stats;
+  pthread_rwlock_unlock(&lock);
+}
+
+void mounts_stop(void) {
+  if (table.watching) {
+    __atomic_store_n(&table.stop, true, __ATOMIC_RELEASE);
+    pthread_join(table.watcher, NULL);
+    table.watching = false;
+  }
+
+  pthread_rwlock_wrlock(&lock);
+
+  for (size_t i = 0; i < table.n; ++i) {
+    if (table.mounts[i].fd >= 0)
+      close(table.mounts[i].fd);
+  }
+  free(table.mounts);
+  free(table.by_fsid);
+  free(table.by_dev);
+  table.mounts = NULL;
+  table.by_fsid = NULL;
+  table.by_dev = NULL;
+  table.n = table.cap = table.slots = 0;
+
+  pthread_rwlock_unlock(&lock);
+}
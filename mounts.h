@@ -0,0 +1,53 @@
+#ifndef MOUNTS_H
+#define MOUNTS_H
+
+#include "event.h"
+
+#define MOUNT_INFO "/proc/self/mountinfo"
+#define NFSD_EXPORTS "/proc/fs/nfsd/exports"
+#define NFS_STATE_DIR "/var/lib/nfs"
+#define NFS_ETAB_NAME "etab"
+#define NFS_ETAB NFS_STATE_DIR "/" NFS_ETAB_NAME
+
+#define MOUNTS_MIN_SLOTS 64
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * `entries` counts the mountinfo lines of the last scan, `filesystems` the
+ * distinct ones kept, `fds` the mount fds held open.
+ */
+typedef struct {
+  size_t entries;
+  size_t filesystems;
+  size_t marks;
+  size_t fds;
+  double startup_ms;
+  uint64_t scans;
+  uint64_t added;
+  uint64_t removed;
+} MountStats;
+
+/*
+ * The filesystems fanotify watches, indexed by fsid to resolve file handles
+ * and by device to mark each filesystem once. `mounts_setup` marks what the
+ * mode serves; the watcher started by `mounts_start` rescans whenever the
+ * mount table or the exportfs table changes, marking new filesystems and
+ * forgetting unmounted ones.
+ */
+void mounts_setup(int fan_fd, bool client);
+int mounts_start(void);
+int mounts_open(const Fsid *fsid, FileHandle *fh, int flags);
+void mounts_offline(void);
+bool mounts_online(void);
+void mounts_seed(const Fsid *fsid, dev_t dev);
+void mounts_stats(MountStats *stats);
+void mounts_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
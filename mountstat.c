@@ -0,0 +1,467 @@
+#include "mountstat.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Samples closer together than this reuse the previous rates. */
+#define SAMPLE_MIN_MS 500
+
+typedef enum { BLOCK_SKIP, BLOCK_HEAD, BLOCK_OPS } BlockState;
+
+typedef struct {
+  MountStat *ms;
+  Mount *mount;
+  BlockState state;
+  size_t op;
+  uint64_t xprt;
+  size_t cursor;
+} Parser;
+
+MountStat *mountstat_new(void) {
+  int fd = open(MOUNT_STATS, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    debug("no mount statistics at %s", MOUNT_STATS);
+    return NULL;
+  }
+
+  MountStat *ms = (MountStat *)calloc(1, sizeof(MountStat));
+  if (ms == NULL) {
+    err("Failed to allocate mount statistics");
+    close(fd);
+    return NULL;
+  }
+
+  ms->fd = fd;
+
+  return ms;
+}
+
+static uint64_t delta(uint64_t cur, uint64_t prev) {
+  return cur >= prev ? cur - prev : 0;
+}
+
+static uint8_t bucket(double ms) {
+  uint8_t b = 0;
+  while (b < LAT_BUCKETS - 1 && ms >= (double)(1L << b))
+    b++;
+  return b;
+}
+
+static void mount_free(Mount *m) {
+  for (size_t i = 0; i < m->nops; ++i)
+    free(m->op[i].lat);
+  free(m);
+}
+
+/*
+ * Finds the mount at `path` not yet seen in this sample. Mounts usually
+ * come back in the same order, so the one after the previous match is tried
+ * first.
+ */
+static Mount *find(Parser *p, const char *path, size_t len) {
+  MountStat *ms = p->ms;
+
+  if (len >= PATH_MAX)
+    return NULL;
+
+  for (size_t k = 0; k < ms->n; ++k) {
+    size_t i = (p->cursor + k) % ms->n;
+    Mount *m = ms->mounts[i];
+
+    if (!m->seen && strncmp(m->path, path, len) == 0 && m->path[len] == '\0') {
+      p->cursor = i + 1;
+      m->seen = true;
+      return m;
+    }
+  }
+
+  if (ms->n == ms->cap) {
+    size_t cap = ms->cap ? ms->cap * 2 : 16;
+    Mount **mounts = (Mount **)realloc(ms->mounts, cap * sizeof(Mount *));
+    if (mounts == NULL)
+      return NULL;
+    ms->mounts = mounts;
+    ms->cap = cap;
+  }
+
+  Mount *m = (Mount *)calloc(1, sizeof(Mount));
+  if (m == NULL)
+    return NULL;
+
+  memcpy(m->path, path, len);
+  m->seen = true;
+  ms->mounts[ms->n++] = m;
+  p->cursor = ms->n;
+
+  return m;
+}
+
+/* "device SRC mounted on PATH with fstype TYPE statvers=..." */
+static void parse_device(Parser *p, const char *line) {
+  const char *on = strstr(line, " mounted on ");
+  const char *with = on != NULL ? strstr(on, " with fstype ") : NULL;
+
+  p->state = BLOCK_SKIP;
+  p->mount = NULL;
+  if (with == NULL)
+    return;
+
+  const char *type = with + strlen(" with fstype ");
+  if (strncmp(type, "nfs ", 4) != 0 && strncmp(type, "nfs4 ", 5) != 0)
+    return;
+
+  const char *path = on + strlen(" mounted on ");
+  p->mount = find(p, path, (size_t)(with - path));
+  if (p->mount == NULL)
+    return;
+
+  p->state = BLOCK_HEAD;
+  p->xprt = 0;
+}
+
+/*
+ * Adds the sends and receives of one transport. UDP lines carry them as
+ * the third and fourth counters, TCP and RDMA lines as the sixth and
+ * seventh.
+ */
+static void parse_xprt(Parser *p, const char *line) {
+  while (*line == ' ' || *line == '\t')
+    line++;
+
+  size_t first = strncmp(line, "udp", 3) == 0 ? 2 : 5;
+  const char *ptr = strpbrk(line, " \t");
+  uint64_t value[7] = {0};
+  char *end;
+
+  for (size_t i = 0; ptr != NULL && i < first + 2; ++i) {
+    value[i] = strtoull(ptr, &end, 10);
+    if (end == ptr)
+      break;
+    ptr = end;
+  }
+
+  p->xprt += value[first] + value[first + 1];
+}
+
+static void update(Parser *p, MountOp *op, const OpCounters *c) {
+  MountStat *ms = p->ms;
+  Mount *m = p->mount;
+  double elapsed = ms->elapsed;
+  uint64_t ops = delta(c->ops, op->total.ops);
+
+  if (m->sampled && ops > 0 && elapsed > 0) {
+    op->sample = ms->sample;
+    op->ops = ops / elapsed;
+    op->timeouts = delta(c->timeouts, op->total.timeouts) / elapsed;
+    op->queue = (double)delta(c->queue, op->total.queue) / ops;
+    op->rtt = (double)delta(c->rtt, op->total.rtt) / ops;
+    op->execute = (double)delta(c->execute, op->total.execute) / ops;
+
+    m->ops += op->ops;
+    m->timeouts += op->timeouts;
+    m->bytes_sent += delta(c->bytes_sent, op->total.bytes_sent) / elapsed;
+    m->bytes_recv += delta(c->bytes_recv, op->total.bytes_recv) / elapsed;
+
+    if (op->lat == NULL)
+      op->lat = (LatSlot *)calloc(LAT_SLOTS, sizeof(LatSlot));
+    if (op->lat != NULL) {
+      LatSlot *slot = &op->lat[ms->sample % LAT_SLOTS];
+      slot->sample = ms->sample;
+      slot->count = (uint32_t)ops;
+      slot->rtt = bucket(op->rtt);
+      slot->execute = bucket(op->execute);
+    }
+  }
+
+  op->total = *c;
+}
+
+/* "NAME: ops trans timeouts sent recv queue rtt execute [errors]" */
+static void parse_op(Parser *p, const char *line) {
+  Mount *m = p->mount;
+
+  if (p->op >= MOUNT_OPS)
+    return;
+
+  while (*line == ' ' || *line == '\t')
+    line++;
+
+  const char *colon = strchr(line, ':');
+  if (colon == NULL)
+    return;
+
+  uint64_t value[8];
+  const char *ptr = colon + 1;
+  char *end;
+
+  for (size_t i = 0; i < 8; ++i) {
+    value[i] = strtoull(ptr, &end, 10);
+    if (end == ptr)
+      return;
+    ptr = end;
+  }
+
+  size_t len = (size_t)(colon - line);
+  if (len >= sizeof(m->op[0].name))
+    return;
+
+  OpCounters c = {value[0], value[1], value[2], value[3],
+                  value[4], value[5], value[6], value[7]};
+  MountOp *op = &m->op[p->op++];
+
+  /* The op list only changes when the mount is replaced. */
+  if (strncmp(op->name, line, len) != 0 || op->name[len] != '\0') {
+    free(op->lat);
+    memset(op, 0, sizeof(*op));
+    memcpy(op->name, line, len);
+    op->total = c;
+    return;
+  }
+
+  update(p, op, &c);
+}
+
+static void finish(Parser *p) {
+  if (p->state == BLOCK_OPS) {
+    if (p->op > p->mount->nops)
+      p->mount->nops = p->op;
+    p->mount->sampled = true;
+  }
+
+  p->state = BLOCK_SKIP;
+  p->mount = NULL;
+}
+
+static void parse_line(Parser *p, const char *line) {
+  if (strncmp(line, "device ", 7) == 0) {
+    finish(p);
+    parse_device(p, line);
+    return;
+  }
+
+  switch (p->state) {
+  case BLOCK_SKIP:
+    return;
+  case BLOCK_HEAD:
+    if (strncmp(line, "\txprt:", 6) == 0) {
+      parse_xprt(p, line + 6);
+    } else if (strncmp(line, "\tper-op statistics", 18) == 0) {
+      Mount *m = p->mount;
+
+      /* Nothing went over the wire, so no op counter moved either. */
+      if (m->sampled && m->xprt == p->xprt) {
+        p->state = BLOCK_SKIP;
+        return;
+      }
+
+      m->xprt = p->xprt;
+      m->sample = p->ms->sample;
+      m->ops = m->timeouts = m->bytes_sent = m->bytes_recv = 0;
+      p->state = BLOCK_OPS;
+      p->op = 0;
+    }
+    return;
+  case BLOCK_OPS:
+    parse_op(p, line);
+    return;
+  }
+}
+
+/*
+ * Streams the file through the fixed buffer, handing each complete line to
+ * the parser. A line that does not fit in the buffer is dropped.
+ */
+static int parse(MountStat *ms) {
+  Parser p = {.ms = ms, .state = BLOCK_SKIP};
+  size_t have = 0;
+  bool overlong = false;
+
+  if (lseek(ms->fd, 0, SEEK_SET) < 0)
+    return 1;
+
+  while (true) {
+    ssize_t n = read(ms->fd, ms->buf + have, MOUNT_BUF - 1 - have);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return 1;
+    if (n == 0)
+      break;
+
+    char *line = ms->buf;
+    char *end = ms->buf + have + n;
+    char *nl;
+
+    while ((nl = (char *)memchr(line, '\n', end - line)) != NULL) {
+      *nl = '\0';
+      if (!overlong)
+        parse_line(&p, line);
+      overlong = false;
+      line = nl + 1;
+    }
+
+    have = (size_t)(end - line);
+    if (have == MOUNT_BUF - 1) {
+      overlong = true;
+      have = 0;
+    } else {
+      memmove(ms->buf, line, have);
+    }
+  }
+
+  if (have > 0 && !overlong) {
+    ms->buf[have] = '\0';
+    parse_line(&p, ms->buf);
+  }
+  finish(&p);
+
+  return 0;
+}
+
+/* Keeps the MOUNT_TOP busiest ops, in descending order. */
+static void rank(MountStat *ms, const Mount *m, const MountOp *op) {
+  size_t i = ms->ntop;
+  if (i == MOUNT_TOP) {
+    if (ms->top[MOUNT_TOP - 1].op->ops >= op->ops)
+      return;
+    i = MOUNT_TOP - 1;
+  } else {
+    ms->ntop++;
+  }
+
+  while (i > 0 && ms->top[i - 1].op->ops < op->ops) {
+    ms->top[i] = ms->top[i - 1];
+    i--;
+  }
+
+  ms->top[i].mount = m;
+  ms->top[i].op = op;
+}
+
+int mountstat_sample(MountStat *ms) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  double elapsed =
+      (now.tv_sec - ms->last.tv_sec) + (now.tv_nsec - ms->last.tv_nsec) / 1e9;
+  if (ms->sample > 0 && elapsed * 1000 < SAMPLE_MIN_MS)
+    return 0;
+
+  ms->sample++;
+  ms->elapsed = elapsed;
+  for (size_t i = 0; i < ms->n; ++i)
+    ms->mounts[i]->seen = false;
+
+  if (parse(ms) != 0) {
+    err("Failed to read %s, error code: %d", MOUNT_STATS, errno);
+    return 1;
+  }
+
+  ms->last = now;
+  ms->active = 0;
+  ms->ops = ms->bytes_sent = ms->bytes_recv = ms->timeouts = 0;
+  ms->ntop = 0;
+
+  size_t n = 0;
+  for (size_t i = 0; i < ms->n; ++i) {
+    Mount *m = ms->mounts[i];
+
+    /* Unmounted since the previous sample. */
+    if (!m->seen) {
+      mount_free(m);
+      continue;
+    }
+    ms->mounts[n++] = m;
+
+    if (m->sample != ms->sample || m->ops == 0)
+      continue;
+
+    ms->active++;
+    ms->ops += m->ops;
+    ms->bytes_sent += m->bytes_sent;
+    ms->bytes_recv += m->bytes_recv;
+    ms->timeouts += m->timeouts;
+
+    for (size_t j = 0; j < m->nops; ++j) {
+      if (m->op[j].sample == ms->sample)
+        rank(ms, m, &m->op[j]);
+    }
+  }
+  ms->n = n;
+
+  return 0;
+}
+
+/*
+ * Returns the upper bound in ms of the latency bucket holding quantile `q`
+ * of the calls over the last LAT_SLOTS samples, or -1 without calls.
+ */
+long mountstat_quantile(const MountOp *op, uint32_t sample, double q,
+                        bool execute) {
+  uint64_t hist[LAT_BUCKETS] = {0};
+  uint64_t total = 0;
+
+  if (op->lat == NULL)
+    return -1;
+
+  for (size_t i = 0; i < LAT_SLOTS; ++i) {
+    const LatSlot *slot = &op->lat[i];
+    if (slot->count == 0 || slot->sample + LAT_SLOTS <= sample)
+      continue;
+
+    hist[execute ? slot->execute : slot->rtt] += slot->count;
+    total += slot->count;
+  }
+
+  if (total == 0)
+    return -1;
+
+  uint64_t sum = 0;
+  for (size_t b = 0; b < LAT_BUCKETS; ++b) {
+    sum += hist[b];
+    if (sum >= q * total)
+      return 1L << b;
+  }
+
+  return 1L << (LAT_BUCKETS - 1);
+}
+
+void mountstat_show(const MountStat *ms, WINDOW *win, int y) {
+  char line[512];
+  int width = getmaxx(win) - 4;
+
+  snprintf(line, sizeof(line),
+           "NFS: %zu mounts, %zu active, %.0f ops/s, %.1f KiB/s sent, "
+           "%.1f KiB/s received, %.1f timeouts/s",
+           ms->n, ms->active, ms->ops, ms->bytes_sent / 1024,
+           ms->bytes_recv / 1024, ms->timeouts);
+  mvwprintw(win, y, 2, "%.*s", width, line);
+
+  size_t len = snprintf(line, sizeof(line), "ops/s:");
+  for (size_t i = 0; i < ms->ntop && len < sizeof(line); ++i) {
+    const MountTop *t = &ms->top[i];
+
+    len += snprintf(line + len, sizeof(line) - len,
+                    " %s %s %.0f rtt %.1f exec %.1f p90 <%ld ms,",
+                    t->mount->path, t->op->name, t->op->ops, t->op->rtt,
+                    t->op->execute,
+                    mountstat_quantile(t->op, ms->sample, 0.9, true));
+  }
+  if (len < sizeof(line) && line[len - 1] == ',')
+    line[len - 1] = '\0';
+
+  mvwprintw(win, y + 1, 2, "%.*s", width, line);
+}
+
+void mountstat_free(MountStat *ms) {
+  for (size_t i = 0; i < ms->n; ++i)
+    mount_free(ms->mounts[i]);
+  free(ms->mounts);
+  close(ms->fd);
+  free(ms);
+}
@@ -0,0 +1,125 @@
+#ifndef MOUNTSTAT_H
+#define MOUNTSTAT_H
+
+#include <limits.h>
+#include <ncurses.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define MOUNT_STATS "/proc/self/mountstats"
+
+/* Read chunk; longer lines are skipped. */
+#define MOUNT_BUF 65536
+
+#define MOUNT_OPS 96
+#define MOUNT_TOP 4
+
+/* Latency buckets are powers of two in ms: <1, <2, <4, ... */
+#define LAT_BUCKETS 16
+
+/* Number of samples a latency histogram covers. */
+#define LAT_SLOTS 60
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Cumulative per-op counters as printed by the kernel. */
+typedef struct {
+  uint64_t ops;
+  uint64_t trans;
+  uint64_t timeouts;
+  uint64_t bytes_sent;
+  uint64_t bytes_recv;
+  uint64_t queue;
+  uint64_t rtt;
+  uint64_t execute;
+} OpCounters;
+
+typedef struct {
+  uint32_t sample;
+  uint32_t count;
+  uint8_t rtt;
+  uint8_t execute;
+} LatSlot;
+
+/*
+ * One op of one mount. The interval fields hold the averages of the sample
+ * numbered `sample` and are stale for any other. `lat` is allocated the
+ * first time the op completes a call.
+ */
+typedef struct {
+  char name[24];
+  OpCounters total;
+
+  uint32_t sample;
+  double ops;
+  double timeouts;
+  double rtt;
+  double execute;
+  double queue;
+
+  LatSlot *lat;
+} MountOp;
+
+typedef struct {
+  char path[PATH_MAX];
+  uint64_t xprt;
+  bool sampled;
+  bool seen;
+  uint32_t sample;
+
+  double ops;
+  double bytes_sent;
+  double bytes_recv;
+  double timeouts;
+
+  size_t nops;
+  MountOp op[MOUNT_OPS];
+} Mount;
+
+typedef struct {
+  const Mount *mount;
+  const MountOp *op;
+} MountTop;
+
+/*
+ * NFS client statistics from /proc/self/mountstats, parsed a line at a time
+ * from a fixed buffer. A mount whose transports sent and received nothing
+ * since the previous sample keeps its counters and is not parsed further.
+ */
+typedef struct {
+  int fd;
+  char buf[MOUNT_BUF];
+
+  Mount **mounts;
+  size_t n;
+  size_t cap;
+
+  uint32_t sample;
+  struct timespec last;
+  double elapsed;
+
+  size_t active;
+  double ops;
+  double bytes_sent;
+  double bytes_recv;
+  double timeouts;
+  MountTop top[MOUNT_TOP];
+  size_t ntop;
+} MountStat;
+
+MountStat *mountstat_new(void);
+int mountstat_sample(MountStat *ms);
+long mountstat_quantile(const MountOp *op, uint32_t sample, double q,
+                        bool execute);
+void mountstat_show(const MountStat *ms, WINDOW *win, int y);
+void mountstat_free(MountStat *ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,636 @@
+#include "pipeline.h"
+#include "capture.h"
+#include "clients.h"
+#include "fhcache.h"
+#include "mounts.h"
+#include "proc.h"
+#include "strtab.h"
+#include "utils.h"
+
+#include <poll.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#define STATS_PATH                                                             \
+  (getenv("NFSTOP_STATS") ? getenv("NFSTOP_STATS") : "/var/run/nfstop.stats")
+
+#define COALESCE_MS                                                            \
+  (getenv("NFSTOP_COALESCE_MS") ? atol(getenv("NFSTOP_COALESCE_MS")) : 1000)
+
+#define COALESCE_MAX                                                           \
+  (getenv("NFSTOP_COALESCE_MAX") ? atol(getenv("NFSTOP_COALESCE_MAX")) : 65536)
+
+#define LIVE_MINUTES                                                           \
+  (getenv("NFSTOP_LIVE_MINUTES") ? atol(getenv("NFSTOP_LIVE_MINUTES")) : 60)
+
+#define LIVE_MAX                                                               \
+  (getenv("NFSTOP_LIVE_MAX") ? atol(getenv("NFSTOP_LIVE_MAX")) : 8192)
+
+#define STRTAB_MB                                                              \
+  (getenv("NFSTOP_STRTAB_MB") ? atol(getenv("NFSTOP_STRTAB_MB")) : 64)
+
+#define DEFAULT_DECODERS 4
+#define READ_POLL_MS 200
+
+static const char *stage_names[STAGE_MAX] = {"reader", "decoder", "writer"};
+
+static void backoff(unsigned *spins) {
+  if (*spins < 64) {
+    sched_yield();
+  } else {
+    struct timespec ts = {0, *spins < 256 ? 50 * 1000 : 1000 * 1000};
+    nanosleep(&ts, NULL);
+  }
+
+  (*spins)++;
+}
+
+static void count(uint64_t *counter, uint64_t n) {
+  __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static size_t decoder_count(void) {
+  const char *env = getenv("NFSTOP_DECODERS");
+  long n = env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (n < 1)
+    n = 1;
+  if (env == NULL && n > DEFAULT_DECODERS)
+    n = DEFAULT_DECODERS;
+  if (n > MAX_DECODERS)
+    n = MAX_DECODERS;
+
+  return (size_t)n;
+}
+
+/*
+ * Counts the events of a batch for the reader. The kernel queues a
+ * FAN_Q_OVERFLOW event once it drops events because the reader fell behind,
+ * which decoding discards, so it is counted here.
+ */
+static void count_events(StageStats *st, const void *buf, ssize_t len) {
+  const FanEventMetadata *data = (const FanEventMetadata *)buf;
+  size_t n = 0, overflows = 0;
+
+  while (FAN_EVENT_OK(data, len)) {
+    n++;
+    if (data->mask & FAN_Q_OVERFLOW)
+      overflows++;
+    data = FAN_EVENT_NEXT(data, len);
+  }
+
+  count(&st->batches, 1);
+  count(&st->events, n);
+  if (overflows > 0) {
+    count(&st->overflows, overflows);
+    warn("fanotify queue overflowed, events were lost");
+  }
+}
+
+static void *reader_main(void *arg) {
+  Pipeline *p = (Pipeline *)arg;
+  StageStats *st = &p->stats[STAGE_READER];
+  struct pollfd pfd = {.fd = p->fan_fd, .events = POLLIN};
+  unsigned spins = 0;
+
+  while (!__atomic_load_n(&p->stop, __ATOMIC_ACQUIRE)) {
+    int rc = poll(&pfd, 1, READ_POLL_MS);
+    if (rc < 0) {
+      if (errno == EINTR)
+        continue;
+      err("Failed to poll fanotify fd, error code: %d", errno);
+      exit(EXIT_FAILURE);
+    }
+
+    if (rc == 0)
+      continue;
+
+    Batch *batch = (Batch *)ring_pop(&p->free);
+    if (batch == NULL) {
+      count(&st->waits, 1);
+      backoff(&spins);
+      continue;
+    }
+    spins = 0;
+
+    ssize_t len = read(p->fan_fd, batch->buf, BUFSIZE);
+    if (len == 0) {
+      warn("No more fanotify event (EOF)\n");
+      ring_push(&p->free, batch);
+      break;
+    }
+
+    if (len < 0) {
+      ring_push(&p->free, batch);
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      err("Failed to read fanotify events, error code: %d", errno);
+      exit(EXIT_FAILURE);
+    }
+
+    batch->len = len;
+    batch->nevents = 0;
+    time(&batch->time);
+    capture_record(CAP_EVENTS, batch->buf, (size_t)len);
+
+    count_events(st, batch->buf, len);
+    ring_push(&p->decode, batch);
+  }
+
+  __atomic_store_n(&p->reader_done, true, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+/* Sleeps until `offset` seconds past `start`, waking to check for a stop. */
+static void pace(Pipeline *p, const struct timespec *start, double offset) {
+  while (!__atomic_load_n(&p->stop, __ATOMIC_ACQUIRE)) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    double left = offset - ((now.tv_sec - start->tv_sec) +
+                            (now.tv_nsec - start->tv_nsec) / 1e9);
+    if (left <= 0)
+      return;
+    if (left > READ_POLL_MS / 1e3)
+      left = READ_POLL_MS / 1e3;
+
+    struct timespec ts = {(time_t)left, (long)((left - (time_t)left) * 1e9)};
+    nanosleep(&ts, NULL);
+  }
+}
+
+/*
+ * Stands in for the reader when replaying: feeds the recorded buffers at the
+ * pace they were read, or back to back when `fast`, and stamps events with
+ * their recorded time.
+ */
+static void *replay_main(void *arg) {
+  Pipeline *p = (Pipeline *)arg;
+  StageStats *st = &p->stats[STAGE_READER];
+  struct timespec start;
+  int64_t first_sec = 0, first_nsec = 0;
+  bool first = true;
+  unsigned spins = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  while (!__atomic_load_n(&p->stop, __ATOMIC_ACQUIRE)) {
+    Batch *batch = (Batch *)ring_pop(&p->free);
+    if (batch == NULL) {
+      count(&st->waits, 1);
+      backoff(&spins);
+      continue;
+    }
+    spins = 0;
+
+    CaptureRecord rec;
+    ssize_t len;
+    do {
+      len = replay_next(p->replay, &rec, batch->buf, BUFSIZE);
+    } while (len >= 0 && rec.type != CAP_EVENTS);
+
+    if (len < 0) {
+      ring_push(&p->free, batch);
+      break;
+    }
+
+    if (first) {
+      first_sec = rec.sec;
+      first_nsec = rec.nsec;
+      first = false;
+    } else if (!p->fast) {
+      pace(p, &start, (rec.sec - first_sec) + (rec.nsec - first_nsec) / 1e9);
+    }
+
+    batch->len = len;
+    batch->nevents = 0;
+    batch->time = (time_t)rec.sec;
+
+    count_events(st, batch->buf, len);
+    ring_push(&p->decode, batch);
+  }
+
+  __atomic_store_n(&p->reader_done, true, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+static void decode_batch(Pipeline *p, Batch *batch) {
+  const FanEventMetadata *data = (const FanEventMetadata *)batch->buf;
+  ssize_t len = batch->len;
+
+  while (FAN_EVENT_OK(data, len)) {
+    if (data->vers != FANOTIFY_METADATA_VERSION) {
+      fatal("Found discrepancy between fanotify metadata version");
+      exit(EXIT_FAILURE);
+    }
+
+    Event *event = next(data, batch->time, p->client, &batch->arena);
+    if (event != NULL)
+      batch->events[batch->nevents++] = event;
+
+    data = FAN_EVENT_NEXT(data, len);
+  }
+}
+
+static void *decoder_main(void *arg) {
+  Pipeline *p = (Pipeline *)arg;
+  StageStats *st = &p->stats[STAGE_DECODER];
+  unsigned spins = 0;
+
+  while (true) {
+    if (__atomic_load_n(&p->parking, __ATOMIC_ACQUIRE)) {
+      __atomic_add_fetch(&p->parked, 1, __ATOMIC_ACQ_REL);
+      while (__atomic_load_n(&p->parking, __ATOMIC_ACQUIRE))
+        backoff(&spins);
+      __atomic_sub_fetch(&p->parked, 1, __ATOMIC_ACQ_REL);
+      spins = 0;
+    }
+
+    Batch *batch = (Batch *)ring_pop(&p->decode);
+    if (batch == NULL) {
+      if (__atomic_load_n(&p->reader_done, __ATOMIC_ACQUIRE) &&
+          ring_depth(&p->decode) == 0)
+        break;
+      count(&st->waits, 1);
+      backoff(&spins);
+      continue;
+    }
+    spins = 0;
+
+    decode_batch(p, batch);
+
+    count(&st->batches, 1);
+    count(&st->events, batch->nevents);
+    ring_push(&p->write, batch);
+  }
+
+  __atomic_sub_fetch(&p->decoders_live, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+#ifndef DEBUG
+static void writer_check(Pipeline *p, int rc) {
+  if (rc != 0) {
+    p->rc = rc;
+    __atomic_store_n(&p->stop, true, __ATOMIC_RELEASE);
+  }
+}
+
+static int writer_store(void *ctx, const Event *event, uint32_t count,
+                        time_t last_time) {
+  return store_insert((store)ctx, event, count, last_time);
+}
+
+static void writer_put(Pipeline *p, const Event *event) {
+  if (p->live != NULL)
+    live_add(p->live, event);
+
+  if (p->coalesce != NULL)
+    writer_check(p, coalesce_add(p->coalesce, event));
+  else
+    writer_check(p, store_insert(p->db, event, 1, event->time));
+}
+
+static void writer_tick(Pipeline *p) {
+  if (p->live != NULL)
+    live_tick(p->live);
+  if (p->coalesce != NULL)
+    writer_check(p, coalesce_tick(p->coalesce));
+  if (p->rc == 0)
+    writer_check(p, store_tick(p->db));
+}
+#endif
+
+static void writer_batch(Pipeline *p, Batch *batch) {
+  StageStats *st = &p->stats[STAGE_WRITER];
+
+  for (size_t i = 0; i < batch->nevents; ++i) {
+    Event *event = batch->events[i];
+
+    if (p->rc == 0) {
+#ifndef DEBUG
+      writer_put(p, event);
+#else
+      printEvent(event);
+#endif
+    }
+  }
+
+#ifndef DEBUG
+  if (p->rc == 0)
+    writer_tick(p);
+#endif
+
+  count(&st->batches, 1);
+  count(&st->events, batch->nevents);
+
+  batch->nevents = 0;
+  arena_reset(&batch->arena);
+  ring_push(&p->free, batch);
+}
+
+/*
+ * Reclaims the string table once it outgrows NFSTOP_STRTAB_MB. The decoders
+ * are parked and every batch they decoded is written out first, so the only
+ * ids left are the coalescer's, which is flushed, and the live tables',
+ * which are kept. Freed ids get reused, so the store's id cache goes too.
+ */
+static void writer_reclaim(Pipeline *p) {
+  if (strtab_bytes() <= p->strtab_limit)
+    return;
+
+  unsigned spins = 0;
+  __atomic_store_n(&p->parking, true, __ATOMIC_RELEASE);
+  while (__atomic_load_n(&p->parked, __ATOMIC_ACQUIRE) <
+         __atomic_load_n(&p->decoders_live, __ATOMIC_ACQUIRE))
+    backoff(&spins);
+
+  Batch *batch;
+  while ((batch = (Batch *)ring_pop(&p->write)) != NULL)
+    writer_batch(p, batch);
+
+#ifndef DEBUG
+  if (p->coalesce != NULL && p->rc == 0)
+    writer_check(p, coalesce_flush(p->coalesce));
+  if (p->live != NULL)
+    live_keep(p->live);
+#endif
+
+  strtab_sweep();
+
+#ifndef DEBUG
+  if (p->db != NULL)
+    store_forget(p->db);
+#endif
+
+  __atomic_store_n(&p->parking, false, __ATOMIC_RELEASE);
+
+  /* Whatever is still referenced must not trigger a sweep per batch. */
+  size_t left = strtab_bytes();
+  size_t limit = (size_t)STRTAB_MB << 20;
+  p->strtab_limit = left * 2 > limit ? left * 2 : limit;
+}
+
+static void *writer_main(void *arg) {
+  Pipeline *p = (Pipeline *)arg;
+  StageStats *st = &p->stats[STAGE_WRITER];
+  unsigned spins = 0;
+
+  while (true) {
+    Batch *batch = (Batch *)ring_pop(&p->write);
+    if (batch == NULL) {
+      if (__atomic_load_n(&p->decoders_live, __ATOMIC_ACQUIRE) == 0 &&
+          ring_depth(&p->write) == 0)
+        break;
+#ifndef DEBUG
+      if (p->rc == 0)
+        writer_tick(p);
+#endif
+      count(&st->waits, 1);
+      backoff(&spins);
+      continue;
+    }
+    spins = 0;
+
+    writer_batch(p, batch);
+    writer_reclaim(p);
+  }
+
+#ifndef DEBUG
+  if (p->coalesce != NULL && p->rc == 0)
+    writer_check(p, coalesce_flush(p->coalesce));
+#endif
+
+  __atomic_store_n(&p->writer_done, true, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+static Pipeline *start(int fan_fd, Replay *replay, bool fast, store db,
+                       bool client) {
+  Pipeline *p = (Pipeline *)calloc(1, sizeof(Pipeline));
+  if (p == NULL) {
+    fatal("Failed to allocate pipeline");
+    return NULL;
+  }
+
+  p->fan_fd = fan_fd;
+  p->replay = replay;
+  p->fast = fast;
+  p->db = db;
+  p->client = client;
+  p->ndecoders = decoder_count();
+  p->decoders_live = p->ndecoders;
+  p->strtab_limit = (size_t)STRTAB_MB << 20;
+
+#ifndef DEBUG
+  long window = COALESCE_MS;
+  if (window > 0) {
+    p->coalesce =
+        coalesce_new(window, (size_t)COALESCE_MAX, writer_store, p->db);
+    if (p->coalesce == NULL)
+      exit(EXIT_FAILURE);
+  }
+
+  long live = LIVE_MINUTES;
+  if (live > 0) {
+    p->live = live_new(live * 60, (size_t)LIVE_MAX);
+    if (p->live == NULL)
+      warn("Live snapshot disabled, the TUI will read from the store");
+  }
+#endif
+
+  if (ring_init(&p->free, PIPELINE_BATCHES) != 0 ||
+      ring_init(&p->decode, PIPELINE_BATCHES) != 0 ||
+      ring_init(&p->write, PIPELINE_BATCHES) != 0) {
+    fatal("Failed to allocate pipeline queues");
+    exit(EXIT_FAILURE);
+  }
+
+  for (size_t i = 0; i < PIPELINE_BATCHES; ++i) {
+    Batch *batch = &p->batches[i];
+
+    int res = posix_memalign(&batch->buf, 4096, BUFSIZE);
+    batch->events = (Event **)malloc(BUFSIZE / sizeof(FanEventMetadata) *
+                                     sizeof(Event *));
+
+    if (res != 0 || batch->buf == NULL || batch->events == NULL) {
+      fatal("Failed to allocate buffer");
+      exit(EXIT_FAILURE);
+    }
+
+    ring_push(&p->free, batch);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &p->last_report);
+
+  if (pthread_create(&p->writer, NULL, writer_main, p) != 0) {
+    fatal("Failed to start writer thread");
+    exit(EXIT_FAILURE);
+  }
+
+  for (size_t i = 0; i < p->ndecoders; ++i) {
+    if (pthread_create(&p->decoders[i], NULL, decoder_main, p) != 0) {
+      fatal("Failed to start decoder thread");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (pthread_create(&p->reader, NULL, replay ? replay_main : reader_main,
+                     p) != 0) {
+    fatal("Failed to start reader thread");
+    exit(EXIT_FAILURE);
+  }
+
+  debug("pipeline started with %zu decoders", p->ndecoders);
+
+  return p;
+}
+
+Pipeline *pipeline_start(int fan_fd, store db, bool client) {
+  return start(fan_fd, NULL, false, db, client);
+}
+
+/* Runs the pipeline on a capture instead of a fanotify group. */
+Pipeline *pipeline_replay(Replay *replay, bool fast, store db) {
+  return start(-1, replay, fast, db, replay->client);
+}
+
+void pipeline_stats(Pipeline *p, StageStats stats[STAGE_MAX]) {
+  for (int i = 0; i < STAGE_MAX; ++i) {
+    stats[i].batches = __atomic_load_n(&p->stats[i].batches, __ATOMIC_RELAXED);
+    stats[i].events = __atomic_load_n(&p->stats[i].events, __ATOMIC_RELAXED);
+    stats[i].waits = __atomic_load_n(&p->stats[i].waits, __ATOMIC_RELAXED);
+    stats[i].overflows =
+        __atomic_load_n(&p->stats[i].overflows, __ATOMIC_RELAXED);
+  }
+
+  int pending = 0;
+  if (p->fan_fd < 0 || ioctl(p->fan_fd, FIONREAD, &pending) < 0)
+    pending = 0;
+
+  stats[STAGE_READER].depth = (size_t)pending;
+  stats[STAGE_DECODER].depth = ring_depth(&p->decode);
+  stats[STAGE_WRITER].depth = ring_depth(&p->write);
+}
+
+/*
+ * Rewrites the stats file with per-stage queue depth and rates since the
+ * previous report. Reader depth is bytes pending in the fanotify queue, the
+ * other stages count queued batches.
+ */
+void pipeline_report(Pipeline *p) {
+  StageStats now[STAGE_MAX];
+  pipeline_stats(p, now);
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  double elapsed = (ts.tv_sec - p->last_report.tv_sec) +
+                   (ts.tv_nsec - p->last_report.tv_nsec) / 1e9;
+  if (elapsed <= 0)
+    elapsed = 1;
+
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", STATS_PATH);
+
+  FILE *out = fopen(tmp, "w");
+  if (out != NULL) {
+    fprintf(out, "%-8s %10s %12s %12s %10s\n", "STAGE", "DEPTH", "BATCHES/s",
+            "EVENTS/s", "WAITS/s");
+    for (int i = 0; i < STAGE_MAX; ++i) {
+      fprintf(out, "%-8s %10zu %12.1f %12.1f %10.1f\n", stage_names[i],
+              now[i].depth, (now[i].batches - p->last[i].batches) / elapsed,
+              (now[i].events - p->last[i].events) / elapsed,
+              (now[i].waits - p->last[i].waits) / elapsed);
+    }
+    fprintf(out, "free buffers: %zu/%d, decoders: %zu\n",
+            ring_depth(&p->free), PIPELINE_BATCHES, p->ndecoders);
+    fprintf(out, "queue overflows: %lu\n", now[STAGE_READER].overflows);
+
+    FhCacheStats cache;
+    fhcache_stats(&cache);
+    fprintf(out,
+            "handle cache: %zu entries, %zu/%zu bytes, %lu hits, %lu misses, "
+            "%lu evictions, %lu invalidations\n",
+            cache.entries, cache.bytes, cache.limit, cache.hits, cache.misses,
+            cache.evictions, cache.invalidations);
+
+    if (p->coalesce != NULL) {
+      CoalesceStats co;
+      coalesce_stats(p->coalesce, &co);
+      fprintf(out, "coalesce: %zu pending, %lu events in, %lu rows out\n",
+              co.entries, co.in, co.out);
+    }
+
+    if (p->live != NULL)
+      fprintf(out, "live: %zu files, %lu dropped\n", p->live->files.n,
+              p->live->dropped);
+
+    PidFilterStats filter;
+    proc_stats(&filter);
+    fprintf(out,
+            "pid filter: %zu matched, %zu rejected, %lu hits, %lu rejects, "
+            "%lu misses, %lu refreshes, %lu reaped\n",
+            filter.matched, filter.rejected, filter.hits, filter.rejects,
+            filter.misses, filter.refreshes, filter.reaped);
+
+    ClientStats clients;
+    clients_stats(&clients);
+    fprintf(out,
+            "clients: %zu clients, %zu open files, %lu hits, %lu misses, "
+            "%lu refreshes\n",
+            clients.clients, clients.files, clients.hits, clients.misses,
+            clients.refreshes);
+
+    MountStats mounts;
+    mounts_stats(&mounts);
+    fprintf(out,
+            "mounts: %zu entries, %zu filesystems, %zu marks, %zu fds, "
+            "startup %.1f ms, %lu scans, %lu added, %lu removed\n",
+            mounts.entries, mounts.filesystems, mounts.marks, mounts.fds,
+            mounts.startup_ms, mounts.scans, mounts.added, mounts.removed);
+    fclose(out);
+
+    if (rename(tmp, STATS_PATH) < 0)
+      debug("failed to publish stats to %s: %m", STATS_PATH);
+  } else {
+    debug("failed to open stats file %s: %m", tmp);
+  }
+
+  memcpy(p->last, now, sizeof(now));
+  p->last_report = ts;
+}
+
+bool pipeline_done(Pipeline *p) {
+  return __atomic_load_n(&p->writer_done, __ATOMIC_ACQUIRE) ||
+         __atomic_load_n(&p->stop, __ATOMIC_ACQUIRE);
+}
+
+int pipeline_stop(Pipeline *p) {
+  __atomic_store_n(&p->stop, true, __ATOMIC_RELEASE);
+
+  pthread_join(p->reader, NULL);
+  for (size_t i = 0; i < p->ndecoders; ++i)
+    pthread_join(p->decoders[i], NULL);
+  pthread_join(p->writer, NULL);
+
+  for (size_t i = 0; i < PIPELINE_BATCHES; ++i) {
+    free(p->batches[i].buf);
+    free(p->batches[i].events);
+    arena_free(&p->batches[i].arena);
+  }
+
+  ring_free(&p->free);
+  ring_free(&p->decode);
+  ring_free(&p->write);
+
+  if (p->coalesce != NULL)
+    coalesce_free(p->coalesce);
+  if (p->live != NULL)
+    live_free(p->live);
+
+  int rc = p->rc;
+  free(p);
+
+  return rc;
+}
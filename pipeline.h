@@ -0,0 +1,92 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "capture.h"
+#include "coalesce.h"
+#include "event.h"
+#include "live.h"
+#include "ring.h"
+#include "store.h"
+
+#include <pthread.h>
+
+#define PIPELINE_BATCHES 32
+#define MAX_DECODERS 16
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * One fanotify read buffer travelling reader -> decoder -> writer and back to
+ * the free list. The decoder fills `events` from `buf`, allocating records
+ * from `arena`, which is reset once the writer is done with the batch.
+ */
+typedef struct {
+  void *buf;
+  ssize_t len;
+  time_t time;
+  Event **events;
+  size_t nevents;
+  Arena arena;
+} Batch;
+
+typedef enum { STAGE_READER, STAGE_DECODER, STAGE_WRITER, STAGE_MAX } StageId;
+
+/* Only the reader counts `overflows`, the FAN_Q_OVERFLOW events it read. */
+typedef struct {
+  uint64_t batches;
+  uint64_t events;
+  uint64_t waits;
+  uint64_t overflows;
+  size_t depth;
+} StageStats;
+
+/* `fan_fd` is -1 when replaying a capture. */
+typedef struct {
+  int fan_fd;
+  Replay *replay;
+  bool fast;
+  bool client;
+  store db;
+  Coalescer *coalesce;
+  Live *live;
+  int rc;
+
+  size_t ndecoders;
+  pthread_t reader;
+  pthread_t decoders[MAX_DECODERS];
+  pthread_t writer;
+
+  Ring free;
+  Ring decode;
+  Ring write;
+  Batch batches[PIPELINE_BATCHES];
+
+  bool stop;
+  bool reader_done;
+  size_t decoders_live;
+  bool writer_done;
+
+  /* Set by the writer to hold the decoders while it sweeps the strings. */
+  bool parking;
+  size_t parked;
+  size_t strtab_limit;
+
+  StageStats stats[STAGE_MAX];
+  StageStats last[STAGE_MAX];
+  struct timespec last_report;
+} Pipeline;
+
+Pipeline *pipeline_start(int fan_fd, store db, bool client);
+Pipeline *pipeline_replay(Replay *replay, bool fast, store db);
+void pipeline_stats(Pipeline *p, StageStats stats[STAGE_MAX]);
+void pipeline_report(Pipeline *p);
+bool pipeline_done(Pipeline *p);
+int pipeline_stop(Pipeline *p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,605 @@
+#include "proc.h"
+#include "capture.h"
+#include "stat.h"
+#include "utils.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/* A quarter goes to matched identities, the rest to rejected pids. */
+#define PROC_KB                                                                \
+  (getenv("NFSTOP_PROC_KB") ? atol(getenv("NFSTOP_PROC_KB")) : 512)
+
+#define CHECK_INTERVAL 1
+#define REJECT_TTL 10
+
+typedef struct {
+  pid_t pid;
+  int pidfd;
+  uid_t uid;
+  gid_t gid;
+  unsigned long long start_time;
+} Ident;
+
+/* A verdict recorded in a capture; `seq` keeps them in recorded order. */
+typedef struct {
+  pid_t pid;
+  uint32_t seq;
+  uid_t uid;
+  gid_t gid;
+  bool matched;
+  bool used;
+} Seed;
+
+static struct {
+  bool client;
+  const char *comm;
+
+  /* Replaying a capture: verdicts are seeded, /proc is never read. */
+  bool offline;
+  Seed *seeds;
+  size_t nseeds;
+  size_t seeds_cap;
+  bool sorted;
+
+  Ident *match;
+  size_t match_slots;
+  pid_t *reject;
+  size_t reject_slots;
+
+  /* Reaper scratch, only touched under the write lock. */
+  struct pollfd *polls;
+  pid_t *exited;
+
+  long pool_size;
+  time_t checked;
+  time_t reject_since;
+  PidFilterStats stats;
+} pids;
+
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static size_t slot_of(pid_t pid, size_t slots) {
+  return ((uint32_t)pid * 2654435761u) & (slots - 1);
+}
+
+/* Largest power of two no greater than `bytes / size`. */
+static size_t slots_for(size_t bytes, size_t size) {
+  size_t slots = PROC_MIN_SLOTS;
+  while (slots * 2 * size <= bytes)
+    slots *= 2;
+  return slots;
+}
+
+static Ident *find_match(pid_t pid) {
+  for (size_t i = slot_of(pid, pids.match_slots);;
+       i = (i + 1) & (pids.match_slots - 1)) {
+    if (pids.match[i].pid == pid)
+      return &pids.match[i];
+    if (pids.match[i].pid == 0)
+      return NULL;
+  }
+}
+
+static bool find_reject(pid_t pid) {
+  for (size_t i = slot_of(pid, pids.reject_slots);;
+       i = (i + 1) & (pids.reject_slots - 1)) {
+    if (pids.reject[i] == pid)
+      return true;
+    if (pids.reject[i] == 0)
+      return false;
+  }
+}
+
+static void clear_match(void) {
+  for (size_t i = 0; i < pids.match_slots; ++i) {
+    if (pids.match[i].pid != 0 && pids.match[i].pidfd >= 0)
+      close(pids.match[i].pidfd);
+  }
+
+  memset(pids.match, 0, pids.match_slots * sizeof(Ident));
+  pids.stats.matched = 0;
+}
+
+static void clear_reject(void) {
+  memset(pids.reject, 0, pids.reject_slots * sizeof(pid_t));
+  pids.stats.rejected = 0;
+}
+
+static void add_match(const Ident *id) {
+  Ident *old = find_match(id->pid);
+  if (old != NULL) {
+    if (old->pidfd >= 0)
+      close(old->pidfd);
+    *old = *id;
+    return;
+  }
+
+  if (pids.stats.matched >= pids.match_slots / 2)
+    clear_match();
+
+  size_t i = slot_of(id->pid, pids.match_slots);
+  while (pids.match[i].pid != 0)
+    i = (i + 1) & (pids.match_slots - 1);
+
+  pids.match[i] = *id;
+  pids.stats.matched++;
+}
+
+static void add_reject(pid_t pid) {
+  if (find_reject(pid))
+    return;
+
+  if (pids.stats.rejected >= pids.reject_slots / 2)
+    clear_reject();
+
+  size_t i = slot_of(pid, pids.reject_slots);
+  while (pids.reject[i] != 0)
+    i = (i + 1) & (pids.reject_slots - 1);
+
+  pids.reject[i] = pid;
+  pids.stats.rejected++;
+}
+
+/* Linear probing needs the displaced followers of a removed slot shifted. */
+static bool stays(size_t home, size_t hole, size_t pos) {
+  return hole <= pos ? (hole < home && home <= pos)
+                     : (hole < home || home <= pos);
+}
+
+static void remove_match(pid_t pid) {
+  const size_t mask = pids.match_slots - 1;
+  Ident *slot = find_match(pid);
+  if (slot == NULL)
+    return;
+
+  if (slot->pidfd >= 0)
+    close(slot->pidfd);
+
+  size_t hole = (size_t)(slot - pids.match);
+  for (size_t j = (hole + 1) & mask; pids.match[j].pid != 0;
+       j = (j + 1) & mask) {
+    if (stays(slot_of(pids.match[j].pid, pids.match_slots), hole, j))
+      continue;
+    pids.match[hole] = pids.match[j];
+    hole = j;
+  }
+
+  pids.match[hole].pid = 0;
+  pids.stats.matched--;
+}
+
+static void remove_reject(pid_t pid) {
+  const size_t mask = pids.reject_slots - 1;
+  size_t hole = slot_of(pid, pids.reject_slots);
+
+  while (pids.reject[hole] != pid) {
+    if (pids.reject[hole] == 0)
+      return;
+    hole = (hole + 1) & mask;
+  }
+
+  for (size_t j = (hole + 1) & mask; pids.reject[j] != 0;
+       j = (j + 1) & mask) {
+    if (stays(slot_of(pids.reject[j], pids.reject_slots), hole, j))
+      continue;
+    pids.reject[hole] = pids.reject[j];
+    hole = j;
+  }
+
+  pids.reject[hole] = 0;
+  pids.stats.rejected--;
+}
+
+static long pool_size(void) {
+  char buf[32];
+
+  int fd = open(NFSD_THREADS, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+
+  if (len <= 0)
+    return -1;
+
+  buf[len] = '\0';
+  return atol(buf);
+}
+
+/* A zombie still holds its pid; signal 0 fails once the pid is released. */
+static bool released(int pidfd) {
+  return syscall(SYS_pidfd_send_signal, pidfd, 0, NULL, 0) < 0;
+}
+
+/* Reads comm and start time from /proc/<pid>/stat, uid and gid from the dir. */
+static bool read_stat(pid_t pid, StatLine *line, char *buf, size_t len,
+                      uid_t *uid, gid_t *gid) {
+  char path[64];
+
+  snprintf(path, sizeof(path), "/proc/%i", pid);
+  int proc_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (proc_fd < 0) {
+    debug("failed to open /proc/%i: %m", pid);
+    return false;
+  }
+
+  int stat_fd = openat(proc_fd, "stat", O_RDONLY | O_CLOEXEC);
+  ssize_t n = stat_fd >= 0 ? read(stat_fd, buf, len) : -1;
+  if (stat_fd >= 0)
+    close(stat_fd);
+
+  struct stat st;
+  int rc = fstat(proc_fd, &st);
+  close(proc_fd);
+
+  if (n <= 0 || rc < 0 || stat_parse(buf, (size_t)n, line) != 0) {
+    debug("failed to read identity of pid %i", pid);
+    return false;
+  }
+
+  *uid = st.st_uid;
+  *gid = st.st_gid;
+  return true;
+}
+
+/*
+ * Drops matched processes that exited: those holding a pidfd are polled in
+ * one call, the rest have their start time compared, for kernels without
+ * pidfd_open. Called under the write lock.
+ */
+static void reap(void) {
+  size_t npolls = 0;
+  size_t nexited = 0;
+  char buf[1024];
+
+  for (size_t i = 0; i < pids.match_slots; ++i) {
+    const Ident *id = &pids.match[i];
+    if (id->pid == 0)
+      continue;
+
+    if (id->pidfd >= 0) {
+      pids.polls[npolls++] = (struct pollfd){id->pidfd, POLLIN, 0};
+      continue;
+    }
+
+    StatLine line;
+    uid_t uid;
+    gid_t gid;
+    if (!read_stat(id->pid, &line, buf, sizeof(buf), &uid, &gid) ||
+        line.field[STAT_STARTTIME] != id->start_time)
+      pids.exited[nexited++] = id->pid;
+  }
+
+  /* The slots are walked in the same order the pidfds were collected. */
+  if (npolls > 0 && poll(pids.polls, npolls, 0) > 0) {
+    size_t j = 0;
+    for (size_t i = 0; i < pids.match_slots; ++i) {
+      const Ident *id = &pids.match[i];
+      if (id->pid == 0 || id->pidfd < 0)
+        continue;
+
+      if (pids.polls[j++].revents & (POLLIN | POLLHUP | POLLERR))
+        pids.exited[nexited++] = id->pid;
+    }
+  }
+
+  for (size_t i = 0; i < nexited; ++i) {
+    debug("pid %i exited", pids.exited[i]);
+    remove_match(pids.exited[i]);
+  }
+  pids.stats.reaped += nexited;
+}
+
+/*
+ * Matched processes are reaped when they exit. Rejected pids carry no
+ * identity, so they are aged out on a timer and dropped whenever the nfsd
+ * pool size moves, which is when a reused pid may turn into an nfsd thread.
+ */
+static void maybe_refresh(void) {
+  time_t now = time(NULL);
+
+  if (pids.offline ||
+      now - __atomic_load_n(&pids.checked, __ATOMIC_RELAXED) < CHECK_INTERVAL)
+    return;
+
+  pthread_rwlock_wrlock(&lock);
+
+  if (now - pids.checked >= CHECK_INTERVAL) {
+    __atomic_store_n(&pids.checked, now, __ATOMIC_RELAXED);
+
+    reap();
+
+    if (!pids.client) {
+      long size = pool_size();
+      if (size != pids.pool_size) {
+        debug("nfsd pool size changed %ld -> %ld", pids.pool_size, size);
+        pids.pool_size = size;
+        clear_reject();
+        pids.stats.refreshes++;
+      }
+    }
+
+    if (now - pids.reject_since >= REJECT_TTL) {
+      clear_reject();
+      pids.reject_since = now;
+    }
+  }
+
+  pthread_rwlock_unlock(&lock);
+}
+
+/*
+ * Reads the identity of `pid` and whether its comm matches. A pidfd taken
+ * before reading, the event's own or a fresh one, pins the process: if its
+ * pid is still held afterwards, /proc described that process and not a
+ * later one that reused the pid. The returned identity owns its pidfd.
+ */
+static bool read_identity(pid_t pid, int pidfd, bool *matched, Ident *id) {
+  char buf[1024];
+  StatLine line;
+
+  int fd = pidfd >= 0 ? fcntl(pidfd, F_DUPFD_CLOEXEC, 0)
+                      : (int)syscall(SYS_pidfd_open, pid, 0);
+  if (fd < 0 && errno == ESRCH)
+    return false;
+
+  if (!read_stat(pid, &line, buf, sizeof(buf), &id->uid, &id->gid) ||
+      (fd >= 0 && released(fd))) {
+    if (fd >= 0)
+      close(fd);
+    return false;
+  }
+
+  *matched = line.comm_len == strlen(pids.comm) &&
+             memcmp(line.comm, pids.comm, line.comm_len) == 0;
+
+  id->pid = pid;
+  id->start_time = line.field[STAT_STARTTIME];
+  id->pidfd = *matched ? fd : -1;
+  if (!*matched && fd >= 0)
+    close(fd);
+
+  return true;
+}
+
+static int seed_cmp(const void *a, const void *b) {
+  const Seed *x = (const Seed *)a;
+  const Seed *y = (const Seed *)b;
+  if (x->pid != y->pid)
+    return x->pid < y->pid ? -1 : 1;
+  return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/*
+ * Groups the seeds by pid, keeping their order, and collapses repeats: the
+ * recorder sees a pid again whenever its verdict aged out, but a verdict only
+ * changes on exec or pid reuse.
+ */
+static void sort_seeds(void) {
+  qsort(pids.seeds, pids.nseeds, sizeof(Seed), seed_cmp);
+
+  size_t n = 0;
+  for (size_t i = 0; i < pids.nseeds; ++i) {
+    if (n > 0 && pids.seeds[n - 1].pid == pids.seeds[i].pid &&
+        pids.seeds[n - 1].matched == pids.seeds[i].matched)
+      continue;
+    pids.seeds[n++] = pids.seeds[i];
+  }
+
+  pids.nseeds = n;
+  pids.sorted = true;
+}
+
+/*
+ * The first verdict of `pid` not yet applied, or its last one once all have
+ * been. Called under the write lock.
+ */
+static const Seed *next_seed(pid_t pid) {
+  if (!pids.sorted)
+    sort_seeds();
+
+  size_t lo = 0, hi = pids.nseeds;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (pids.seeds[mid].pid < pid)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  const Seed *last = NULL;
+  for (size_t i = lo; i < pids.nseeds && pids.seeds[i].pid == pid; ++i) {
+    last = &pids.seeds[i];
+    if (!pids.seeds[i].used) {
+      pids.seeds[i].used = true;
+      return last;
+    }
+  }
+
+  return last;
+}
+
+/*
+ * Replays the verdicts of `pid` in the order they were recorded, stepping to
+ * the next one each time an exec makes the filter forget the pid.
+ */
+static bool replay_match(pid_t pid, uid_t *uid, gid_t *gid) {
+  pthread_rwlock_wrlock(&lock);
+
+  /* Another decoder may have applied a verdict since the lookup. */
+  const Ident *slot = find_match(pid);
+  bool matched = slot != NULL;
+  if (slot == NULL && !find_reject(pid)) {
+    const Seed *seed = next_seed(pid);
+    matched = seed != NULL && seed->matched;
+    if (matched)
+      add_match(&(Ident){
+          .pid = pid, .pidfd = -1, .uid = seed->uid, .gid = seed->gid});
+    else
+      add_reject(pid);
+    slot = find_match(pid);
+  }
+
+  if (matched) {
+    *uid = slot->uid;
+    *gid = slot->gid;
+  }
+
+  pthread_rwlock_unlock(&lock);
+  return matched;
+}
+
+void proc_init(bool client) {
+  size_t budget = (size_t)PROC_KB * 1024;
+
+  pthread_rwlock_wrlock(&lock);
+
+  pids.client = client;
+  pids.comm = client ? "nfs" : "nfsd";
+  pids.pool_size = client ? -1 : pool_size();
+  pids.checked = pids.reject_since = time(NULL);
+
+  pids.match_slots = slots_for(budget / 4, sizeof(Ident));
+  pids.reject_slots = slots_for(budget - budget / 4, sizeof(pid_t));
+  pids.match = (Ident *)calloc(pids.match_slots, sizeof(Ident));
+  pids.reject = (pid_t *)calloc(pids.reject_slots, sizeof(pid_t));
+  pids.polls = (struct pollfd *)calloc(pids.match_slots / 2,
+                                       sizeof(struct pollfd));
+  pids.exited = (pid_t *)calloc(pids.match_slots / 2, sizeof(pid_t));
+
+  if (pids.match == NULL || pids.reject == NULL || pids.polls == NULL ||
+      pids.exited == NULL) {
+    fatal("Failed to allocate the pid filter");
+    exit(EXIT_FAILURE);
+  }
+
+  debug("pid filter: %zu identity slots, %zu reject slots", pids.match_slots,
+        pids.reject_slots);
+
+  pthread_rwlock_unlock(&lock);
+}
+
+/*
+ * `pidfd` is the event's pidfd, or -1 when the kernel did not report one;
+ * the caller keeps ownership of it. fanotify reports pid 0 for processes
+ * outside our pid namespace, which can never be our nfsd; 0 is also the
+ * empty slot of both tables.
+ */
+bool proc_match(pid_t pid, int pidfd, uid_t *uid, gid_t *gid) {
+  if (pid <= 0) {
+    __atomic_fetch_add(&pids.stats.rejects, 1, __ATOMIC_RELAXED);
+    return false;
+  }
+
+  maybe_refresh();
+
+  pthread_rwlock_rdlock(&lock);
+
+  Ident *slot = find_match(pid);
+  if (slot != NULL) {
+    *uid = slot->uid;
+    *gid = slot->gid;
+    pthread_rwlock_unlock(&lock);
+    __atomic_fetch_add(&pids.stats.hits, 1, __ATOMIC_RELAXED);
+    return true;
+  }
+
+  bool rejected = find_reject(pid);
+  pthread_rwlock_unlock(&lock);
+
+  if (rejected) {
+    __atomic_fetch_add(&pids.stats.rejects, 1, __ATOMIC_RELAXED);
+    return false;
+  }
+
+  __atomic_fetch_add(&pids.stats.misses, 1, __ATOMIC_RELAXED);
+
+  if (pids.offline)
+    return replay_match(pid, uid, gid);
+
+  bool matched;
+  Ident id;
+  if (!read_identity(pid, pidfd, &matched, &id))
+    return false;
+
+  *uid = id.uid;
+  *gid = id.gid;
+  capture_record(CAP_PROC,
+                 &(CapProc){.pid = pid,
+                            .uid = id.uid,
+                            .gid = id.gid,
+                            .matched = matched},
+                 sizeof(CapProc));
+
+  pthread_rwlock_wrlock(&lock);
+  if (matched)
+    add_match(&id);
+  else
+    add_reject(pid);
+  pthread_rwlock_unlock(&lock);
+
+  return matched;
+}
+
+/* A pid changes comm on exec, so its cached verdict is dropped then. */
+void proc_forget(pid_t pid) {
+  if (pid <= 0)
+    return;
+
+  pthread_rwlock_wrlock(&lock);
+  remove_match(pid);
+  remove_reject(pid);
+  pthread_rwlock_unlock(&lock);
+}
+
+/*
+ * For replay: verdicts come from the capture through `proc_seed`, nothing is
+ * reaped or aged out, and a pid the capture never saw is rejected.
+ */
+void proc_offline(void) {
+  pthread_rwlock_wrlock(&lock);
+  pids.offline = true;
+  pthread_rwlock_unlock(&lock);
+}
+
+void proc_seed(pid_t pid, uid_t uid, gid_t gid, bool matched) {
+  pthread_rwlock_wrlock(&lock);
+
+  if (pids.nseeds == pids.seeds_cap) {
+    size_t cap = pids.seeds_cap ? pids.seeds_cap * 2 : PROC_MIN_SLOTS;
+    Seed *seeds = (Seed *)realloc(pids.seeds, cap * sizeof(Seed));
+    if (seeds == NULL) {
+      pthread_rwlock_unlock(&lock);
+      err("Failed to grow the replayed pid verdicts");
+      return;
+    }
+    pids.seeds = seeds;
+    pids.seeds_cap = cap;
+  }
+
+  pids.seeds[pids.nseeds] = (Seed){.pid = pid,
+                                   .seq = (uint32_t)pids.nseeds,
+                                   .uid = uid,
+                                   .gid = gid,
+                                   .matched = matched};
+  pids.nseeds++;
+  pids.sorted = false;
+
+  pthread_rwlock_unlock(&lock);
+}
+
+void proc_stats(PidFilterStats *stats) {
+  pthread_rwlock_rdlock(&lock);
+  *stats = pids.stats;
+  pthread_rwlock_unlock(&lock);
+}
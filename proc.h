@@ -0,0 +1,43 @@
+#ifndef PROC_H
+#define PROC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define PROC_MIN_SLOTS 64
+
+#define NFSD_THREADS "/proc/fs/nfsd/threads"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  uint64_t hits;
+  uint64_t rejects;
+  uint64_t misses;
+  uint64_t refreshes;
+  uint64_t reaped;
+  size_t matched;
+  size_t rejected;
+} PidFilterStats;
+
+/*
+ * Decides whether an event's pid is an nfsd thread (or an NFS client
+ * process) and caches its uid and gid. A matched process is known by its
+ * (pid, start time) identity and a pidfd; exited processes are reaped once
+ * a second, so a reused pid never inherits a stale verdict.
+ */
+void proc_init(bool client);
+bool proc_match(pid_t pid, int pidfd, uid_t *uid, gid_t *gid);
+void proc_forget(pid_t pid);
+void proc_offline(void);
+void proc_seed(pid_t pid, uid_t uid, gid_t gid, bool matched);
+void proc_stats(PidFilterStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,85 @@
+#include "ring.h"
+#include "utils.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+int ring_init(Ring *ring, size_t capacity) {
+  size_t cap = 1;
+  while (cap < capacity)
+    cap <<= 1;
+
+  ring->slots = calloc(cap, sizeof(RingSlot));
+  if (ring->slots == NULL) {
+    err("Failed to allocate ring of %zu slots", cap);
+    return 1;
+  }
+
+  for (size_t i = 0; i < cap; ++i)
+    ring->slots[i].seq = i;
+
+  ring->mask = cap - 1;
+  ring->head = 0;
+  ring->tail = 0;
+
+  return 0;
+}
+
+bool ring_push(Ring *ring, void *data) {
+  size_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+  while (true) {
+    RingSlot *slot = &ring->slots[pos & ring->mask];
+    size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        slot->data = data;
+        __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+        return true;
+      }
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+void *ring_pop(Ring *ring) {
+  size_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+  while (true) {
+    RingSlot *slot = &ring->slots[pos & ring->mask];
+    size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        void *data = slot->data;
+        __atomic_store_n(&slot->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+        return data;
+      }
+    } else if (diff < 0) {
+      return NULL;
+    } else {
+      pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+size_t ring_depth(const Ring *ring) {
+  size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+  size_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+  return head > tail ? head - tail : 0;
+}
+
+void ring_free(Ring *ring) {
+  free(ring->slots);
+  ring->slots = NULL;
+}
@@ -0,0 +1,34 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  size_t seq;
+  void *data;
+} RingSlot;
+
+/* Bounded lock-free multi-producer/multi-consumer queue of pointers. */
+typedef struct {
+  RingSlot *slots;
+  size_t mask;
+  size_t head __attribute__((aligned(64)));
+  size_t tail __attribute__((aligned(64)));
+} Ring;
+
+int ring_init(Ring *ring, size_t capacity);
+bool ring_push(Ring *ring, void *data);
+void *ring_pop(Ring *ring);
+size_t ring_depth(const Ring *ring);
+void ring_free(Ring *ring);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,242 @@
+#include "rpcstat.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Samples closer together than this reuse the previous rates. */
+#define SAMPLE_MIN_MS 500
+
+static const char *v3_names[RPC_V3_OPS] = {
+    "NULL",   "GETATTR", "SETATTR", "LOOKUP",      "ACCESS", "READLINK",
+    "READ",   "WRITE",   "CREATE",  "MKDIR",       "SYMLINK", "MKNOD",
+    "REMOVE", "RMDIR",   "RENAME",  "LINK",        "READDIR", "READDIRPLUS",
+    "FSSTAT", "FSINFO",  "PATHCONF", "COMMIT"};
+
+/* NFSv4 operation numbers from RFC 7530, 8881 and 7862; 0-2 are unused. */
+static const char *v4_names[RPC_V4_OPS] = {
+    NULL, NULL, NULL, "ACCESS", "CLOSE", "COMMIT", "CREATE", "DELEGPURGE",
+    "DELEGRETURN", "GETATTR", "GETFH", "LINK", "LOCK", "LOCKT", "LOCKU",
+    "LOOKUP", "LOOKUPP", "NVERIFY", "OPEN", "OPENATTR", "OPEN_CONFIRM",
+    "OPEN_DOWNGRADE", "PUTFH", "PUTPUBFH", "PUTROOTFH", "READ", "READDIR",
+    "READLINK", "REMOVE", "RENAME", "RENEW", "RESTOREFH", "SAVEFH", "SECINFO",
+    "SETATTR", "SETCLIENTID", "SETCLIENTID_CONFIRM", "VERIFY", "WRITE",
+    "RELEASE_LOCKOWNER", "BACKCHANNEL_CTL", "BIND_CONN_TO_SESSION",
+    "EXCHANGE_ID", "CREATE_SESSION", "DESTROY_SESSION", "FREE_STATEID",
+    "GET_DIR_DELEGATION", "GETDEVICEINFO", "GETDEVICELIST", "LAYOUTCOMMIT",
+    "LAYOUTGET", "LAYOUTRETURN", "SECINFO_NO_NAME", "SEQUENCE", "SET_SSV",
+    "TEST_STATEID", "WANT_DELEGATION", "DESTROY_CLIENTID", "RECLAIM_COMPLETE",
+    "ALLOCATE", "COPY", "COPY_NOTIFY", "DEALLOCATE", "IO_ADVISE", "LAYOUTERROR",
+    "LAYOUTSTATS", "OFFLOAD_CANCEL", "OFFLOAD_STATUS", "READ_PLUS", "SEEK",
+    "WRITE_SAME", "CLONE", "GETXATTR", "SETXATTR", "LISTXATTRS", "REMOVEXATTR"};
+
+RpcStat *rpcstat_new(void) {
+  int fd = open(RPC_STATS, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    debug("no nfsd rpc statistics at %s", RPC_STATS);
+    return NULL;
+  }
+
+  RpcStat *rpc = (RpcStat *)calloc(1, sizeof(RpcStat));
+  if (rpc == NULL) {
+    err("Failed to allocate rpc statistics");
+    close(fd);
+    return NULL;
+  }
+
+  rpc->fd = fd;
+  rpc->cap = 4096;
+  rpc->buf = (char *)malloc(rpc->cap);
+  if (rpc->buf == NULL) {
+    err("Failed to allocate rpc statistics");
+    rpcstat_free(rpc);
+    return NULL;
+  }
+
+  return rpc;
+}
+
+/* Reads the whole file, growing the buffer only when it came back full. */
+static ssize_t reread(RpcStat *rpc) {
+  while (true) {
+    ssize_t n = pread(rpc->fd, rpc->buf, rpc->cap - 1, 0);
+    if (n < 0)
+      return -1;
+
+    if ((size_t)n < rpc->cap - 1) {
+      rpc->buf[n] = '\0';
+      return n;
+    }
+
+    char *buf = (char *)realloc(rpc->buf, rpc->cap * 2);
+    if (buf == NULL)
+      return -1;
+    rpc->buf = buf;
+    rpc->cap *= 2;
+  }
+}
+
+/* Reads up to `max` counters following the count that leads the line. */
+static void parse_ops(const char *p, uint64_t *ops, size_t max) {
+  char *end;
+  size_t n = strtoul(p, &end, 10);
+
+  for (size_t i = 0; i < n && i < max && end != p; ++i) {
+    p = end;
+    ops[i] = strtoull(p, &end, 10);
+  }
+}
+
+static void parse(const char *buf, RpcCounters *c) {
+  memset(c, 0, sizeof(*c));
+
+  for (const char *line = buf; *line != '\0';) {
+    const char *next = strchr(line, '\n');
+    const char *p = strchr(line, ' ');
+    char *end;
+
+    if (p != NULL && (next == NULL || p < next)) {
+      size_t len = (size_t)(p - line);
+
+      if (len == 2 && strncmp(line, "rc", 2) == 0) {
+        c->rc_hits = strtoull(p, &end, 10);
+        c->rc_misses = strtoull(end, &end, 10);
+      } else if (len == 2 && strncmp(line, "io", 2) == 0) {
+        c->io_read = strtoull(p, &end, 10);
+        c->io_write = strtoull(end, &end, 10);
+      } else if (len == 2 && strncmp(line, "th", 2) == 0) {
+        c->threads = strtoull(p, &end, 10);
+      } else if (len == 3 && strncmp(line, "net", 3) == 0) {
+        c->packets = strtoull(p, &end, 10);
+      } else if (len == 3 && strncmp(line, "rpc", 3) == 0) {
+        c->calls = strtoull(p, &end, 10);
+      } else if (len == 5 && strncmp(line, "proc3", 5) == 0) {
+        parse_ops(p, c->v3, RPC_V3_OPS);
+      } else if (len == 5 && strncmp(line, "proc4", 5) == 0) {
+        parse_ops(p, c->v4_procs, RPC_V4_PROCS);
+      } else if (len == 8 && strncmp(line, "proc4ops", 8) == 0) {
+        parse_ops(p, c->v4, RPC_V4_OPS);
+      }
+    }
+
+    if (next == NULL)
+      break;
+    line = next + 1;
+  }
+}
+
+static double rate(uint64_t cur, uint64_t prev, double elapsed) {
+  return cur >= prev ? (cur - prev) / elapsed : 0;
+}
+
+/* Keeps the RPC_TOP highest op rates, in descending order. */
+static void rank(RpcStat *rpc, const char *name, int version, double r) {
+  if (name == NULL || r <= 0)
+    return;
+
+  size_t i = rpc->ntop;
+  if (i == RPC_TOP) {
+    if (rpc->top[RPC_TOP - 1].rate >= r)
+      return;
+    i = RPC_TOP - 1;
+  } else {
+    rpc->ntop++;
+  }
+
+  while (i > 0 && rpc->top[i - 1].rate < r) {
+    rpc->top[i] = rpc->top[i - 1];
+    i--;
+  }
+
+  rpc->top[i].name = name;
+  rpc->top[i].version = version;
+  rpc->top[i].rate = r;
+}
+
+int rpcstat_sample(RpcStat *rpc) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  double elapsed = (now.tv_sec - rpc->last.tv_sec) +
+                   (now.tv_nsec - rpc->last.tv_nsec) / 1e9;
+  if (rpc->sampled && elapsed * 1000 < SAMPLE_MIN_MS)
+    return 0;
+
+  if (reread(rpc) < 0) {
+    err("Failed to read %s, error code: %d", RPC_STATS, errno);
+    return 1;
+  }
+
+  rpc->prev = rpc->cur;
+  parse(rpc->buf, &rpc->cur);
+
+  const RpcCounters *c = &rpc->cur;
+  const RpcCounters *p = &rpc->prev;
+
+  rpc->threads = c->threads;
+  rpc->ntop = 0;
+
+  if (!rpc->sampled) {
+    rpc->calls = rpc->compounds = rpc->packets = 0;
+    rpc->read_bps = rpc->write_bps = 0;
+    rpc->hit_ratio = -1;
+  } else {
+    rpc->calls = rate(c->calls, p->calls, elapsed);
+    /* proc4 counts the NULL and COMPOUND procedures, in that order. */
+    rpc->compounds = rate(c->v4_procs[1], p->v4_procs[1], elapsed);
+    rpc->packets = rate(c->packets, p->packets, elapsed);
+    rpc->read_bps = rate(c->io_read, p->io_read, elapsed);
+    rpc->write_bps = rate(c->io_write, p->io_write, elapsed);
+
+    double hits = rate(c->rc_hits, p->rc_hits, elapsed);
+    double misses = rate(c->rc_misses, p->rc_misses, elapsed);
+    rpc->hit_ratio = hits + misses > 0 ? hits / (hits + misses) * 100 : -1;
+
+    /* NULL and COMPOUND say nothing about the load, skip them. */
+    for (size_t i = 1; i < RPC_V3_OPS; ++i)
+      rank(rpc, v3_names[i], 3, rate(c->v3[i], p->v3[i], elapsed));
+    for (size_t i = 0; i < RPC_V4_OPS; ++i)
+      rank(rpc, v4_names[i], 4, rate(c->v4[i], p->v4[i], elapsed));
+  }
+
+  rpc->last = now;
+  rpc->sampled = true;
+
+  return 0;
+}
+
+void rpcstat_show(const RpcStat *rpc, WINDOW *win, int y) {
+  char hits[16];
+  char line[512];
+  int width = getmaxx(win) - 4;
+
+  if (rpc->hit_ratio >= 0)
+    snprintf(hits, sizeof(hits), "%.1f%%", rpc->hit_ratio);
+  else
+    snprintf(hits, sizeof(hits), "-");
+
+  snprintf(line, sizeof(line),
+           "RPC: %.0f calls/s, %.0f v4 compounds/s, %.0f packets/s, %lu "
+           "threads, reply cache hits %s, io: %.1f KiB/s read, %.1f KiB/s "
+           "write",
+           rpc->calls, rpc->compounds, rpc->packets, rpc->threads, hits,
+           rpc->read_bps / 1024, rpc->write_bps / 1024);
+  mvwprintw(win, y, 2, "%.*s", width, line);
+
+  size_t len = snprintf(line, sizeof(line), "ops/s:");
+  for (size_t i = 0; i < rpc->ntop && len < sizeof(line); ++i)
+    len += snprintf(line + len, sizeof(line) - len, " v%d %s %.0f",
+                    rpc->top[i].version, rpc->top[i].name, rpc->top[i].rate);
+
+  mvwprintw(win, y + 1, 2, "%.*s", width, line);
+}
+
+void rpcstat_free(RpcStat *rpc) {
+  close(rpc->fd);
+  free(rpc->buf);
+  free(rpc);
+}
@@ -0,0 +1,74 @@
+#ifndef RPCSTAT_H
+#define RPCSTAT_H
+
+#include <ncurses.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define RPC_STATS "/proc/net/rpc/nfsd"
+
+#define RPC_V3_OPS 22
+#define RPC_V4_PROCS 2
+#define RPC_V4_OPS 76
+#define RPC_TOP 8
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  uint64_t rc_hits;
+  uint64_t rc_misses;
+  uint64_t io_read;
+  uint64_t io_write;
+  uint64_t threads;
+  uint64_t packets;
+  uint64_t calls;
+  uint64_t v3[RPC_V3_OPS];
+  uint64_t v4_procs[RPC_V4_PROCS];
+  uint64_t v4[RPC_V4_OPS];
+} RpcCounters;
+
+typedef struct {
+  const char *name;
+  int version;
+  double rate;
+} RpcOpRate;
+
+/*
+ * NFS server RPC statistics from /proc/net/rpc/nfsd. Each sample re-reads
+ * the file into the same buffer and turns the counters into per-second
+ * rates since the previous sample.
+ */
+typedef struct {
+  int fd;
+  char *buf;
+  size_t cap;
+  RpcCounters prev;
+  RpcCounters cur;
+  struct timespec last;
+  bool sampled;
+
+  double calls;
+  double compounds;
+  double packets;
+  double hit_ratio;
+  double read_bps;
+  double write_bps;
+  uint64_t threads;
+  RpcOpRate top[RPC_TOP];
+  size_t ntop;
+} RpcStat;
+
+RpcStat *rpcstat_new(void);
+int rpcstat_sample(RpcStat *rpc);
+void rpcstat_show(const RpcStat *rpc, WINDOW *win, int y);
+void rpcstat_free(RpcStat *rpc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
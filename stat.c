@@ -4,115 +4,456 @@
 #include <ncurses.h>
 #include <sys/sysinfo.h>
 
-pid_t pidof(bool client) {
-  const char *comm = client ? "nfs" : "nfsd";
+/* Samples closer together than this reuse the previous result. */
+#define SAMPLE_MIN_MS 500
 
-  char path[PATH_MAX];
-  char cmd[256];
+/* Client helper kworkers come and go, so their set is rescanned sooner. */
+#define RESCAN_MS 60000
+#define CLIENT_RESCAN_MS 5000
 
-  DIR *dir = opendir("/proc");
-  if (dir == NULL) {
-    err("Failed to open /proc");
+#define KTHREADD_CHILDREN "/proc/2/task/2/children"
+#define NFSD_THREADS "/proc/fs/nfsd/threads"
+
+static const double cpu_bounds[CPU_BUCKETS - 1] = {1.0, 10.0, 50.0};
+
+/*
+ * NFS client work runs in the rpciod/nfsiod/xprtiod workqueues, whose
+ * kworkers carry the workqueue name after the '-' or '+' in their comm.
+ */
+static bool match(const char *comm, bool client) {
+  static const char *helpers[] = {"nfs",     "rpciod",      "nfsiod",
+                                  "xprtiod", "nfsv4.0-svc", "nfsv4.1-svc"};
+
+  if (!client)
+    return strcmp(comm, "nfsd") == 0;
+
+  for (size_t i = 0; i < sizeof(helpers) / sizeof(helpers[0]); ++i) {
+    if (strcmp(comm, helpers[i]) == 0)
+      return true;
+  }
+
+  if (strncmp(comm, "kworker/", 8) == 0) {
+    const char *wq = strpbrk(comm + 8, "-+");
+    return wq != NULL && (strncmp(wq + 1, "rpciod", 6) == 0 ||
+                          strncmp(wq + 1, "nfsiod", 6) == 0 ||
+                          strncmp(wq + 1, "xprtiod", 7) == 0);
+  }
+
+  return false;
+}
+
+static long elapsed_ms(const struct timespec *from, const struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) * 1000 +
+         (to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+/* Re-reads an open procfs file from the start. */
+static ssize_t reread(int fd, char *buf, size_t len) {
+  ssize_t n = pread(fd, buf, len - 1, 0);
+  if (n < 0)
     return -1;
+
+  while (n > 0 && buf[n - 1] == '\n')
+    n--;
+
+  buf[n] = '\0';
+  return n;
+}
+
+static ssize_t read_file(const char *path, char *buf, size_t len) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return -1;
+
+  ssize_t n = reread(fd, buf, len);
+  close(fd);
+
+  return n;
+}
+
+/*
+ * Parses a /proc/<pid>/stat line in one pass without copying. comm may hold
+ * spaces and parentheses, so it spans from the first '(' to the last ')'
+ * and the numeric fields are scanned from there.
+ */
+int stat_parse(const char *buf, size_t len, StatLine *line) {
+  const char *end = buf + len;
+  const char *open = (const char *)memchr(buf, '(', len);
+  const char *close = (const char *)memrchr(buf, ')', len);
+
+  memset(line, 0, sizeof(*line));
+
+  if (open == NULL || close == NULL || close < open || close + 2 >= end)
+    return 1;
+
+  for (const char *p = buf; p < open && *p >= '0' && *p <= '9'; ++p)
+    line->field[STAT_PID] = line->field[STAT_PID] * 10 + (*p - '0');
+
+  line->comm = open + 1;
+  line->comm_len = (size_t)(close - open - 1);
+  line->state = close[2];
+  line->nfields = STAT_STATE;
+
+  const char *p = close + 3;
+  for (int f = STAT_PPID; f < STAT_FIELDS; ++f) {
+    while (p < end && *p == ' ')
+      p++;
+    if (p >= end || *p == '\n')
+      break;
+
+    bool negative = *p == '-';
+    if (negative)
+      p++;
+
+    unsigned long long v = 0;
+    const char *digits = p;
+    while (p < end && *p >= '0' && *p <= '9')
+      v = v * 10 + (unsigned long long)(*p++ - '0');
+    if (p == digits)
+      return 1;
+
+    line->field[f] = negative ? -v : v;
+    line->nfields = f;
   }
 
-  struct dirent *ent;
-  while ((ent = readdir(dir)) != NULL) {
-    if (atoi(ent->d_name) != 0) {
-      snprintf(path, sizeof(path), "/proc/%s/comm", ent->d_name);
+  return 0;
+}
 
-      int fd = open(path, O_RDONLY);
-      if (fd == -1) {
-        err("Error opening comm file: %d", errno);
-        continue;
-      }
+/*
+ * Reads a field proc(5) lists as signed, such as priority, nice, cutime or
+ * cstime, which stat_parse stores in two's complement.
+ */
+long long stat_signed(const StatLine *line, int field) {
+  return (long long)line->field[field];
+}
 
-      ssize_t len = read(fd, cmd, sizeof(cmd) - 1);
-      if (len == -1) {
-        err("Error reading comm file: %d", errno);
-        continue;
-      }
+/* Fills `ps` from a stat line, returning the total CPU ticks. */
+static void fill_stat(const StatLine *line, ProcStat *ps,
+                      unsigned long long *ticks, long int *rss) {
+  const unsigned long long *f = line->field;
 
-      close(fd);
+  ps->state = line->state;
+  ps->min_flt = (unsigned long int)f[STAT_MINFLT];
+  ps->maj_flt = (unsigned long int)f[STAT_MAJFLT];
+  ps->priority = (long int)stat_signed(line, STAT_PRIORITY);
+  ps->nice = (long int)stat_signed(line, STAT_NICE);
+  ps->num_threads = (long int)stat_signed(line, STAT_NUM_THREADS);
+  ps->start_time = f[STAT_STARTTIME];
+  *rss = (long int)stat_signed(line, STAT_RSS);
+
+  *ticks = f[STAT_UTIME] + f[STAT_STIME] +
+           (unsigned long long)(stat_signed(line, STAT_CUTIME) +
+                                stat_signed(line, STAT_CSTIME));
+}
 
-      while (len > 0 && cmd[len - 1] == '\n')
-        len--;
+static void parse_io(const char *buffer, unsigned long long *read_bytes,
+                     unsigned long long *write_bytes) {
+  const char *p;
 
-      cmd[len] = '\0';
+  if ((p = strstr(buffer, "\nread_bytes: ")) != NULL)
+    *read_bytes = strtoull(p + 13, NULL, 10);
+  if ((p = strstr(buffer, "\nwrite_bytes: ")) != NULL)
+    *write_bytes = strtoull(p + 14, NULL, 10);
+}
+
+static void close_thread(CpuSample *t) {
+  close(t->stat_fd);
+  if (t->io_fd >= 0)
+    close(t->io_fd);
+}
+
+static int by_pid(const void *a, const void *b) {
+  pid_t x = ((const CpuSample *)a)->pid;
+  pid_t y = ((const CpuSample *)b)->pid;
+
+  return x < y ? -1 : x > y;
+}
+
+static CpuSample *find(CpuSampler *s, pid_t pid) {
+  CpuSample key = {.pid = pid};
+  return (CpuSample *)bsearch(&key, s->threads, s->n, sizeof(CpuSample),
+                              by_pid);
+}
+
+/* Starts tracking `pid` if its comm matches, unless it already is. */
+static void consider(CpuSampler *s, CpuSample *found, size_t *n, pid_t pid) {
+  char path[64];
+  char comm[64];
+
+  CpuSample *old = find(s, pid);
+  if (old != NULL && old->stat_fd >= 0) {
+    found[(*n)++] = *old;
+    old->stat_fd = -1;
+    return;
+  }
+
+  snprintf(path, sizeof(path), "/proc/%d/comm", pid);
+  if (read_file(path, comm, sizeof(comm)) < 0 || !match(comm, s->client))
+    return;
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+
+  CpuSample *t = &found[(*n)++];
+  memset(t, 0, sizeof(*t));
+  t->pid = pid;
+  t->stat_fd = fd;
+
+  /* Kernel threads' io is only readable by root. */
+  snprintf(path, sizeof(path), "/proc/%d/io", pid);
+  t->io_fd = open(path, O_RDONLY | O_CLOEXEC);
+}
 
-      if (strcmp(cmd, comm) == 0) {
-        closedir(dir);
-        return atoi(ent->d_name);
+/*
+ * Rebuilds the tracked thread set. NFS threads are kernel threads, so the
+ * children of kthreadd are checked first; a full /proc walk is the
+ * fallback. Threads already tracked keep their fds and previous sample.
+ */
+static int rescan(CpuSampler *s) {
+  size_t cap = s->n + 64;
+  size_t n = 0;
+  CpuSample *found = (CpuSample *)malloc(cap * sizeof(CpuSample));
+  if (found == NULL) {
+    err("Failed to allocate cpu sampler threads");
+    return 1;
+  }
+
+  char *children = (char *)malloc(64 * 1024);
+  ssize_t len = children != NULL
+                    ? read_file(KTHREADD_CHILDREN, children, 64 * 1024)
+                    : -1;
+
+  for (char *p = children; len > 0 && *p != '\0';) {
+    char *end;
+    pid_t pid = (pid_t)strtol(p, &end, 10);
+    if (end == p)
+      break;
+    p = end;
+
+    if (n == cap) {
+      CpuSample *grown =
+          (CpuSample *)realloc(found, cap * 2 * sizeof(CpuSample));
+      if (grown == NULL)
+        break;
+      found = grown;
+      cap *= 2;
+    }
+
+    consider(s, found, &n, pid);
+  }
+
+  free(children);
+
+  if (n == 0) {
+    DIR *dir = opendir("/proc");
+    if (dir == NULL) {
+      err("Failed to open /proc");
+      free(found);
+      return 1;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+      pid_t pid = atoi(ent->d_name);
+      if (pid == 0)
+        continue;
+
+      if (n == cap) {
+        CpuSample *grown =
+            (CpuSample *)realloc(found, cap * 2 * sizeof(CpuSample));
+        if (grown == NULL)
+          break;
+        found = grown;
+        cap *= 2;
       }
+
+      consider(s, found, &n, pid);
     }
+
+    closedir(dir);
+  }
+
+  /* Whatever was not carried over has exited or stopped matching. */
+  for (size_t i = 0; i < s->n; ++i) {
+    if (s->threads[i].stat_fd >= 0)
+      close_thread(&s->threads[i]);
   }
 
-  closedir(dir);
-  return -1;
+  qsort(found, n, sizeof(CpuSample), by_pid);
+
+  free(s->threads);
+  s->threads = found;
+  s->n = n;
+  s->cap = cap;
+  s->rescan = false;
+  clock_gettime(CLOCK_MONOTONIC, &s->scanned);
+
+  debug("cpu sampler tracking %zu threads", n);
+  return 0;
 }
 
-ProcStat *procstat(bool client) {
-  pid_t pid = pidof(client);
+/* The nfsd pool size changes when threads are started or stopped. */
+static bool pool_changed(CpuSampler *s) {
+  char buf[32];
+
+  if (s->pool_fd < 0 || reread(s->pool_fd, buf, sizeof(buf)) <= 0)
+    return false;
+
+  long pool = atol(buf);
+  if (pool == s->pool)
+    return false;
 
-  if (pid == -1) {
-    fatal("Process: %s doesn't exist", client ? "nfs" : "nfsd");
+  s->pool = pool;
+  return true;
+}
+
+CpuSampler *sampler_new(bool client) {
+  CpuSampler *s = (CpuSampler *)calloc(1, sizeof(CpuSampler));
+  if (s == NULL) {
+    err("Failed to allocate cpu sampler");
     return NULL;
   }
 
-  ProcStat *ps = malloc(sizeof(ProcStat));
-  ps->pid = pid;
+  s->client = client;
+  s->rescan = true;
+  s->rescan_ms = client ? CLIENT_RESCAN_MS : RESCAN_MS;
+  s->pool_fd = client ? -1 : open(NFSD_THREADS, O_RDONLY | O_CLOEXEC);
+  s->pool = -1;
+
+  return s;
+}
+
+/*
+ * Samples every tracked thread and returns CPU% and I/O rates over the
+ * interval since the previous sample, summed over all threads along with
+ * the per-thread CPU distribution. Threads without a previous sample, e.g.
+ * on the first call, report their lifetime average. The other fields
+ * describe the lowest-pid thread.
+ */
+const ProcStat *procstat(CpuSampler *s) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
 
-  char filename[256];
-  snprintf(filename, sizeof(filename), "/proc/%d/stat", pid);
+  if (s->sampled && elapsed_ms(&s->last, &now) < SAMPLE_MIN_MS)
+    return &s->stat;
 
-  int fd = open(filename, O_RDONLY);
-  if (fd == -1) {
-    err("Failed to open stat file with error code: %d", errno);
+  if ((pool_changed(s) || s->rescan || s->n == 0 ||
+       elapsed_ms(&s->scanned, &now) >= s->rescan_ms) &&
+      rescan(s) != 0)
     return NULL;
-  }
 
-  char buffer[256];
-  ssize_t len = read(fd, buffer, sizeof(buffer) - 1);
-  if (len == -1) {
-    err("Failed to read stat file with error code: %d", errno);
+  if (s->n == 0) {
+    fatal("Process: %s doesn't exist", s->client ? "nfs" : "nfsd");
     return NULL;
   }
 
-  close(fd);
+  double elapsed = elapsed_ms(&s->last, &now) / 1000.0;
+  long hz = sysconf(_SC_CLK_TCK);
 
-  while (len > 0 && buffer[len - 1] == '\n')
-    len--;
+  struct sysinfo info;
+  sysinfo(&info);
 
-  buffer[len] = '\0';
+  ProcStat *ps = &s->stat;
+  memset(ps, 0, sizeof(*ps));
 
-  unsigned long int utime = 0;
-  unsigned long int stime = 0;
-  unsigned long int cutime = 0;
-  unsigned long int cstime = 0;
+  long int first_rss = 0;
+  size_t live = 0;
 
-  unsigned long int vsize = 0;
-  long int rss = 0;
+  for (size_t i = 0; i < s->n; ++i) {
+    CpuSample *t = &s->threads[i];
+    char buffer[1024];
+    StatLine line;
 
-  sscanf(buffer,
-         "%*d %*s %c %*d %*d %*d %*d %*d %*u %lu %*u %lu %*u %lu %lu %lu %lu "
-         "%ld %ld %ld %*d %llu %lu %ld",
-         &ps->state, &ps->min_flt, &ps->maj_flt, &utime, &stime, &cutime,
-         &cstime, &ps->priority, &ps->nice, &ps->num_threads, &ps->start_time,
-         &vsize, &rss);
+    /* An exited thread's stat fails with ESRCH. */
+    ssize_t len = reread(t->stat_fd, buffer, sizeof(buffer));
+    if (len <= 0 || stat_parse(buffer, (size_t)len, &line) != 0) {
+      close_thread(t);
+      s->rescan = true;
+      continue;
+    }
 
-  struct sysinfo info;
-  sysinfo(&info);
-  ps->mem = ((double)rss * getpagesize()) / info.totalram * 100.0;
+    ProcStat cur = {0};
+    unsigned long long ticks;
+    long int rss = 0;
+
+    fill_stat(&line, &cur, &ticks, &rss);
+    cur.pid = t->pid;
+
+    double cpu = 0;
+    if (t->sampled && t->start_time == cur.start_time) {
+      if (elapsed > 0 && ticks >= t->ticks)
+        cpu = (double)(ticks - t->ticks) / hz / elapsed * 100;
+    } else {
+      double up = (double)info.uptime - (double)cur.start_time / hz;
+      if (up > 0)
+        cpu = (double)ticks / hz / up * 100;
+    }
+
+    if (live == 0) {
+      *ps = cur;
+      first_rss = rss;
+    }
+
+    unsigned long long read_bytes = t->read_bytes;
+    unsigned long long write_bytes = t->write_bytes;
+    if (t->io_fd >= 0 && reread(t->io_fd, buffer, sizeof(buffer)) > 0)
+      parse_io(buffer, &read_bytes, &write_bytes);
+
+    if (t->sampled && elapsed > 0) {
+      if (read_bytes >= t->read_bytes)
+        ps->io_read += (read_bytes - t->read_bytes) / elapsed;
+      if (write_bytes >= t->write_bytes)
+        ps->io_write += (write_bytes - t->write_bytes) / elapsed;
+    }
+
+    ps->cpu += cpu;
+    if (cpu > ps->cpu_max || ps->cpu_max_pid == 0) {
+      ps->cpu_max = cpu;
+      ps->cpu_max_pid = t->pid;
+    }
 
-  unsigned long total_time = utime + stime + cutime + cstime;
+    size_t b = 0;
+    while (b < CPU_BUCKETS - 1 && cpu >= cpu_bounds[b])
+      b++;
+    ps->cpu_dist[b]++;
 
-  unsigned long sec = info.uptime - (ps->start_time / sysconf(_SC_CLK_TCK));
+    t->ticks = ticks;
+    t->start_time = cur.start_time;
+    t->read_bytes = read_bytes;
+    t->write_bytes = write_bytes;
+    t->sampled = true;
 
-  ps->cpu = ((double)total_time / sysconf(_SC_CLK_TCK)) / sec * 100;
+    s->threads[live++] = *t;
+  }
+
+  s->n = live;
+  ps->threads = live;
+
+  if (live == 0) {
+    fatal("Process: %s doesn't exist", s->client ? "nfs" : "nfsd");
+    return NULL;
+  }
+
+  ps->mem = ((double)first_rss * getpagesize()) / info.totalram * 100.0;
+
+  s->last = now;
+  s->sampled = true;
 
   return ps;
 }
 
+void sampler_free(CpuSampler *s) {
+  for (size_t i = 0; i < s->n; ++i)
+    close_thread(&s->threads[i]);
+  if (s->pool_fd >= 0)
+    close(s->pool_fd);
+
+  free(s->threads);
+  free(s);
+}
+
 void showStat(const ProcStat *info, WINDOW *win) {
   struct sysinfo sys_info;
   sysinfo(&sys_info);
@@ -121,9 +462,17 @@ void showStat(const ProcStat *info, WINDOW *win) {
 
   mvwprintw(win, 1, 2, "PID: %d, start time - %llu, up - %llu", info->pid, sec,
             up_sec);
-  mvwprintw(win, 2, 2, "state: %c", info->state);
-  mvwprintw(win, 3, 2, "%%Cpu(s):  %.2f%%, %ld nice, %ld priority, %ld thread",
-            info->cpu, info->nice, info->priority, info->num_threads);
-  mvwprintw(win, 4, 2, "%%Mem :  %.2f%%, %lu min_flt, %lu maj_flt", info->mem,
-            info->min_flt, info->maj_flt);
+  mvwprintw(win, 2, 2, "state: %c, %ld nice, %ld priority", info->state,
+            info->nice, info->priority);
+  mvwprintw(win, 3, 2,
+            "%%Cpu(s):  %.2f%% over %zu threads, max %.2f%% (pid %d), "
+            "<1%%: %zu, <10%%: %zu, <50%%: %zu, >=50%%: %zu",
+            info->cpu, info->threads, info->cpu_max, info->cpu_max_pid,
+            info->cpu_dist[0], info->cpu_dist[1], info->cpu_dist[2],
+            info->cpu_dist[3]);
+  mvwprintw(win, 4, 2,
+            "%%Mem :  %.2f%%, %lu min_flt, %lu maj_flt, io: %.1f KiB/s read, "
+            "%.1f KiB/s write",
+            info->mem, info->min_flt, info->maj_flt, info->io_read / 1024,
+            info->io_write / 1024);
 }
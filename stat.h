@@ -12,10 +12,85 @@
 #include <time.h>
 #include <unistd.h>
 
+/* Per-thread CPU% buckets: below 1%, 10%, 50% and the rest. */
+#define CPU_BUCKETS 4
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* Field numbers of /proc/<pid>/stat, as listed in proc(5). */
+enum {
+  STAT_PID = 1,
+  STAT_COMM,
+  STAT_STATE,
+  STAT_PPID,
+  STAT_PGRP,
+  STAT_SESSION,
+  STAT_TTY_NR,
+  STAT_TPGID,
+  STAT_FLAGS,
+  STAT_MINFLT,
+  STAT_CMINFLT,
+  STAT_MAJFLT,
+  STAT_CMAJFLT,
+  STAT_UTIME,
+  STAT_STIME,
+  STAT_CUTIME,
+  STAT_CSTIME,
+  STAT_PRIORITY,
+  STAT_NICE,
+  STAT_NUM_THREADS,
+  STAT_ITREALVALUE,
+  STAT_STARTTIME,
+  STAT_VSIZE,
+  STAT_RSS,
+  STAT_RSSLIM,
+  STAT_STARTCODE,
+  STAT_ENDCODE,
+  STAT_STARTSTACK,
+  STAT_KSTKESP,
+  STAT_KSTKEIP,
+  STAT_SIGNAL,
+  STAT_BLOCKED,
+  STAT_SIGIGNORE,
+  STAT_SIGCATCH,
+  STAT_WCHAN,
+  STAT_NSWAP,
+  STAT_CNSWAP,
+  STAT_EXIT_SIGNAL,
+  STAT_PROCESSOR,
+  STAT_RT_PRIORITY,
+  STAT_POLICY,
+  STAT_DELAYACCT_BLKIO_TICKS,
+  STAT_GUEST_TIME,
+  STAT_CGUEST_TIME,
+  STAT_START_DATA,
+  STAT_END_DATA,
+  STAT_START_BRK,
+  STAT_ARG_START,
+  STAT_ARG_END,
+  STAT_ENV_START,
+  STAT_ENV_END,
+  STAT_EXIT_CODE,
+  STAT_FIELDS
+};
+
+/*
+ * One parsed stat line. `comm` points into the parsed buffer, numeric
+ * fields are indexed by their STAT_* number; fields the kernel did not
+ * report are 0 and `nfields` is the last one present. Most fields are
+ * unsigned and may use all 64 bits, the few signed ones are read with
+ * `stat_signed`.
+ */
+typedef struct {
+  const char *comm;
+  size_t comm_len;
+  char state;
+  int nfields;
+  unsigned long long field[STAT_FIELDS];
+} StatLine;
+
 typedef struct {
   pid_t pid;
   char state;
@@ -32,9 +107,54 @@ typedef struct {
   long int nice;
 
   unsigned long long start_time;
+
+  /* Aggregated over every matching thread for the last sampling interval. */
+  size_t threads;
+  double cpu_max;
+  pid_t cpu_max_pid;
+  size_t cpu_dist[CPU_BUCKETS];
+  double io_read;
+  double io_write;
 } ProcStat;
 
-ProcStat *procstat(bool client);
+typedef struct {
+  pid_t pid;
+  int stat_fd;
+  int io_fd;
+  unsigned long long start_time;
+  unsigned long long ticks;
+  unsigned long long read_bytes;
+  unsigned long long write_bytes;
+  bool sampled;
+} CpuSample;
+
+/*
+ * Keeps the /proc stat and io files of every nfsd thread (or NFS client
+ * helper thread) open, along with their previous CPU time and I/O, so that
+ * each sample reports rates over the interval since the last one. Threads
+ * are discovered by a rescan, which only runs when a thread exited, the
+ * nfsd pool size changed or `rescan_ms` elapsed.
+ */
+typedef struct {
+  bool client;
+  CpuSample *threads;
+  size_t n;
+  size_t cap;
+  int pool_fd;
+  long pool;
+  long rescan_ms;
+  bool rescan;
+  struct timespec scanned;
+  struct timespec last;
+  bool sampled;
+  ProcStat stat;
+} CpuSampler;
+
+int stat_parse(const char *buf, size_t len, StatLine *line);
+long long stat_signed(const StatLine *line, int field);
+CpuSampler *sampler_new(bool client);
+const ProcStat *procstat(CpuSampler *sampler);
+void sampler_free(CpuSampler *sampler);
 void showStat(const ProcStat *info, WINDOW *win);
 
 #ifdef __cplusplus
@@ -4,24 +4,826 @@
 #include <ncurses.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/inotify.h>
+#include <unistd.h>
 
 #define DB_PATH                                                                \
   (getenv("NFSTOP_STORE") ? getenv("NFSTOP_STORE") : "/var/log/nfstop.db")
 
+/*
+ * Schema v5: paths, process names and NFS client labels live in dictionary
+ * tables and events reference them by id, client_id 0 meaning unattributed;
+ * op is the raw fanotify mask. Events and rollups are split into one database
+ * file per UTC day next to the store, e.g. nfstop.db_20240131, attached as
+ * Day_20240131 and listed in Partitions, so retention deletes whole files.
+ * Settings records the daemon's configuration that readers depend on.
+ * user_version 0 is the original all-TEXT Events table, 2 the unpartitioned
+ * dictionary schema, 3 the partitioned schema without clients and 4 the one
+ * with each day's tables in the store itself.
+ */
+#define STORE_VERSION 5
+
+#define PARTITION_SECONDS (24 * 60 * 60)
+
 #define TABLE_STMT                                                             \
-  "CREATE TABLE IF NOT EXISTS Events(proc_name TEXT, pid INTEGER, uid "        \
-  "INTEGER, gid INTEGER, size INTEGER, op TEXT, path TEXT, time INTEGER);"
+  "CREATE TABLE IF NOT EXISTS Paths(id INTEGER PRIMARY KEY, path TEXT "        \
+  "UNIQUE NOT NULL);"                                                          \
+  "CREATE TABLE IF NOT EXISTS Procs(id INTEGER PRIMARY KEY, name TEXT "        \
+  "UNIQUE NOT NULL);"                                                          \
+  "CREATE TABLE IF NOT EXISTS Clients(id INTEGER PRIMARY KEY, address TEXT "   \
+  "UNIQUE NOT NULL);"                                                          \
+  "CREATE TABLE IF NOT EXISTS Partitions(day INTEGER PRIMARY KEY);"
+
+/* `size_mode` is the daemon's NFSTOP_SIZE, a SizeMode. */
+#define SETTINGS_STMT                                                          \
+  "CREATE TABLE IF NOT EXISTS Settings(name TEXT PRIMARY KEY, value "          \
+  "INTEGER);"                                                                  \
+  "INSERT OR REPLACE INTO Settings VALUES('size_mode', %d);"
+
+#define EVENTS_TABLE_STMT                                                      \
+  "CREATE TABLE IF NOT EXISTS %s(proc_id INTEGER, pid INTEGER, uid INTEGER, "  \
+  "gid INTEGER, size INTEGER, op INTEGER, path_id INTEGER, time INTEGER, "     \
+  "count INTEGER NOT NULL DEFAULT 1, last_time INTEGER, client_id INTEGER "    \
+  "NOT NULL DEFAULT 0);"
 
 #define INSERT_STMT                                                            \
-  "INSERT INTO Events (proc_name, pid, uid, gid, size, op, path, time) "       \
-  "VALUES (?, ?, ?, ?, ?, ?, ?, ?);"
+  "INSERT INTO %s (proc_id, pid, uid, gid, size, op, path_id, time, count, "   \
+  "last_time, client_id) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?);"
+
+#define DICT_INSERT_STMT "INSERT OR IGNORE INTO %s(%s) VALUES (?);"
+
+#define DICT_SELECT_STMT "SELECT id FROM %s WHERE %s = ?;"
+
+#define MIGRATE_V1_STMT                                                        \
+  "ALTER TABLE Events RENAME TO EventsV1;"                                     \
+  "DROP TABLE IF EXISTS RollupMinute;"                                         \
+  "DROP TABLE IF EXISTS RollupHour;"
+
+#define MIGRATE_COUNT_STMT                                                     \
+  "ALTER TABLE EventsV1 ADD COLUMN count INTEGER NOT NULL DEFAULT 1;"          \
+  "ALTER TABLE EventsV1 ADD COLUMN last_time INTEGER;"
+
+#define MIGRATE_COPY_STMT                                                      \
+  "INSERT OR IGNORE INTO Paths(path) SELECT DISTINCT path FROM EventsV1 "      \
+  "WHERE path IS NOT NULL;"                                                    \
+  "INSERT OR IGNORE INTO Procs(name) SELECT DISTINCT proc_name FROM EventsV1 " \
+  "WHERE proc_name IS NOT NULL;"                                               \
+  "INSERT INTO Events SELECT Procs.id, pid, uid, gid, size, op_mask(op), "     \
+  "Paths.id, time, count, last_time, 0 FROM EventsV1 JOIN Paths ON "           \
+  "Paths.path = EventsV1.path JOIN Procs ON Procs.name = EventsV1.proc_name;"  \
+  "DROP TABLE EventsV1;"
+
+#define ROLLUP_TABLE_STMT                                                      \
+  "CREATE TABLE IF NOT EXISTS %s(bucket INTEGER, op INTEGER, path_id "         \
+  "INTEGER, proc_id INTEGER, client_id INTEGER, count INTEGER NOT NULL, pid "  \
+  "INTEGER, uid INTEGER, gid INTEGER, size INTEGER, PRIMARY KEY (bucket, op, " \
+  "path_id, proc_id, client_id)) WITHOUT ROWID;"
+
+#define ROLLUP_BACKFILL_STMT                                                   \
+  "INSERT INTO %s SELECT time / %d * %d, op, path_id, proc_id, client_id, "    \
+  "SUM(count), MAX(pid), MAX(uid), MAX(gid), MAX(size) FROM %s GROUP BY 1, "   \
+  "2, 3, 4, 5;"
+
+#define MIGRATE_CLIENT_EVENTS_STMT                                             \
+  "ALTER TABLE %s ADD COLUMN client_id INTEGER NOT NULL DEFAULT 0;"
+
+#define MIGRATE_CLIENT_ROLLUP_STMT                                             \
+  "ALTER TABLE %s RENAME TO RollupV3;" ROLLUP_TABLE_STMT                       \
+  "INSERT INTO %s SELECT bucket, op, path_id, proc_id, 0, count, pid, uid, "   \
+  "gid, size FROM RollupV3;"                                                   \
+  "DROP TABLE RollupV3;"
+
+#define PARTITION_DAYS_STMT                                                    \
+  "SELECT DISTINCT time / %d AS day FROM Events WHERE time IS NOT NULL AND "   \
+  "day > ? ORDER BY day LIMIT %zu;"
+
+#define PARTITION_SPLIT_STMT                                                   \
+  "INSERT INTO %s (proc_id, pid, uid, gid, size, op, path_id, time, count, "   \
+  "last_time, client_id) SELECT proc_id, pid, uid, gid, size, op, path_id, "   \
+  "time, count, last_time, 0 FROM Events WHERE time >= %ld AND time < %ld;"
+
+#define PARTITION_MOVE_STMT                                                    \
+  "DELETE FROM %s.%s; INSERT INTO %s.%s SELECT * FROM main.%s;"
+
+#define PARTITION_DROP_STMT                                                    \
+  "DROP TABLE main.%s; DROP TABLE main.%s; DROP TABLE main.%s;"
+
+#define ROLLUP_UPSERT_STMT                                                     \
+  "INSERT INTO %s (bucket, op, path_id, proc_id, client_id, count, pid, uid, " \
+  "gid, size) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?) ON CONFLICT (bucket, op, " \
+  "path_id, proc_id, client_id) DO UPDATE SET count = count + "                \
+  "excluded.count, pid = excluded.pid, uid = excluded.uid, gid = "             \
+  "excluded.gid, size = COALESCE(excluded.size, size);"
 
 #define FETCH_STMT                                                             \
-  "SELECT COUNT(*) as count, proc_name, pid, uid, gid, size, op, path, time "  \
-  "FROM Events GROUP BY op, path HAVING COUNT(*) > 1 ORDER BY count DESC;"
+  "SELECT t.count, Procs.name, t.pid, t.uid, t.gid, t.size, t.op, "            \
+  "Paths.path, t.bucket, Clients.address FROM (SELECT SUM(count) AS count, "   \
+  "proc_id, pid, uid, gid, size, op, path_id, client_id, MAX(bucket) AS "      \
+  "bucket FROM (%s) GROUP BY op, path_id, client_id HAVING SUM(count) > 1 "    \
+  "ORDER BY count DESC LIMIT ?2) t JOIN Paths ON Paths.id = t.path_id JOIN "   \
+  "Procs ON Procs.id = t.proc_id LEFT JOIN Clients ON Clients.id = "           \
+  "t.client_id ORDER BY t.count DESC;"
+
+#define FETCH_PARTITION_STMT "%sSELECT * FROM %s WHERE bucket >= ?1"
+
+#define FETCH_PARTITIONS_STMT                                                  \
+  "SELECT day FROM Partitions WHERE day >= ? ORDER BY day DESC;"
+
+/* SQLite attaches at most 125 databases, and 10 unless built for more. */
+#define FETCH_DAYS 125
+
+/* Windows up to 6 hours read minute buckets, longer ones hour buckets. */
+#define ROLLUP_MINUTE_SPAN (6 * 60 * 60)
+
+static const struct {
+  const char *table;
+  int width;
+} rollups[ROLLUPS] = {{"RollupMinute", 60}, {"RollupHour", 60 * 60}};
+
+#define RETENTION_DAYS                                                         \
+  (getenv("NFSTOP_RETENTION_DAYS") ? atol(getenv("NFSTOP_RETENTION_DAYS"))     \
+                                   : 30)
 
 #define FETCH_THRESHOLD 100
 
+#define BATCH_SIZE                                                             \
+  (getenv("NFSTOP_BATCH_SIZE") ? atol(getenv("NFSTOP_BATCH_SIZE")) : 5000)
+
+#define BATCH_MS                                                               \
+  (getenv("NFSTOP_BATCH_MS") ? atol(getenv("NFSTOP_BATCH_MS")) : 250)
+
+#define SYNCHRONOUS                                                            \
+  (getenv("NFSTOP_SYNCHRONOUS") ? getenv("NFSTOP_SYNCHRONOUS") : "NORMAL")
+
+#define WAL_AUTOCHECKPOINT                                                     \
+  (getenv("NFSTOP_WAL_AUTOCHECKPOINT")                                         \
+       ? atol(getenv("NFSTOP_WAL_AUTOCHECKPOINT"))                             \
+       : 10000)
+
+static bool table_exists(sqlite3 *db, const char *table) {
+  sqlite3_stmt *stmt;
+  bool exists = false;
+
+  if (sqlite3_prepare_v2(db,
+                         "SELECT 1 FROM sqlite_master WHERE type = 'table' "
+                         "AND name = ?;",
+                         -1, &stmt, NULL) != SQLITE_OK)
+    return false;
+
+  sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC);
+  exists = sqlite3_step(stmt) == SQLITE_ROW;
+  sqlite3_finalize(stmt);
+
+  return exists;
+}
+
+static bool column_exists(sqlite3 *db, const char *table, const char *column) {
+  char sql[128];
+  sqlite3_stmt *stmt;
+
+  snprintf(sql, sizeof(sql), "SELECT %s FROM %s LIMIT 0;", column, table);
+  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+    return false;
+
+  sqlite3_finalize(stmt);
+  return true;
+}
+
+static int user_version(sqlite3 *db) {
+  sqlite3_stmt *stmt;
+  int version = -1;
+
+  if (sqlite3_prepare_v2(db, "PRAGMA user_version;", -1, &stmt, NULL) !=
+      SQLITE_OK)
+    return -1;
+
+  if (sqlite3_step(stmt) == SQLITE_ROW)
+    version = sqlite3_column_int(stmt, 0);
+  sqlite3_finalize(stmt);
+
+  return version;
+}
+
+/*
+ * The size mode the daemon records with, SIZE_ALWAYS for a store written
+ * before Settings existed: those record every size they can.
+ */
+static SizeMode store_size_mode(sqlite3 *db) {
+  sqlite3_stmt *stmt;
+  SizeMode mode = SIZE_ALWAYS;
+
+  if (sqlite3_prepare_v2(db,
+                         "SELECT value FROM Settings WHERE name = "
+                         "'size_mode';",
+                         -1, &stmt, NULL) != SQLITE_OK)
+    return mode;
+
+  if (sqlite3_step(stmt) == SQLITE_ROW)
+    mode = (SizeMode)sqlite3_column_int(stmt, 0);
+  sqlite3_finalize(stmt);
+
+  return mode;
+}
+
+static void sql_op_mask(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+  (void)argc;
+  const char *text = (const char *)sqlite3_value_text(argv[0]);
+  sqlite3_result_int64(ctx, text ? (sqlite3_int64)op_mask(text) : 0);
+}
+
+static int exec(sqlite3 *db, const char *sql, const char *what) {
+  if (sqlite3_exec(db, sql, 0, 0, NULL) != SQLITE_OK) {
+    err("Failed to %s in store: %s, error: %s", what, DB_PATH,
+        sqlite3_errmsg(db));
+    return 1;
+  }
+
+  return 0;
+}
+
+/*
+ * Formats the name of a day partition, e.g. Events_20240131, Day_20240131 for
+ * its schema or, with the store's path as prefix, its file.
+ */
+static void partition_table(char *buf, size_t len, const char *prefix,
+                            long day) {
+  time_t t = (time_t)day * PARTITION_SECONDS;
+  struct tm tm;
+
+  gmtime_r(&t, &tm);
+  snprintf(buf, len, "%s_%04d%02d%02d", prefix, tm.tm_year + 1900,
+           tm.tm_mon + 1, tm.tm_mday);
+}
+
+/* Creates the v4 tables of a day in the store, for the v2 migration. */
+static int partition_create_v4(sqlite3 *db, long day) {
+  char table[64];
+  char sql[512];
+
+  partition_table(table, sizeof(table), "Events", day);
+  snprintf(sql, sizeof(sql), EVENTS_TABLE_STMT, table);
+  if (exec(db, sql, "create events partition") != 0)
+    return 1;
+
+  for (int i = 0; i < ROLLUPS; ++i) {
+    partition_table(table, sizeof(table), rollups[i].table, day);
+    snprintf(sql, sizeof(sql), ROLLUP_TABLE_STMT, table);
+    if (exec(db, sql, "create rollup partition") != 0)
+      return 1;
+  }
+
+  snprintf(sql, sizeof(sql), "INSERT OR IGNORE INTO Partitions VALUES (%ld);",
+           day);
+  return exec(db, sql, "record partition");
+}
+
+static void partition_detach(sqlite3 *db, long day) {
+  char schema[64];
+  char sql[128];
+
+  partition_table(schema, sizeof(schema), "Day", day);
+  snprintf(sql, sizeof(sql), "DETACH %s;", schema);
+  sqlite3_exec(db, sql, 0, 0, NULL);
+}
+
+/*
+ * Attaches the file of `day`. The daemon creates it and its tables on first
+ * use and records it in Partitions; a reader only attaches files that exist.
+ * Must not run inside a transaction.
+ */
+static int partition_attach(sqlite3 *db, long day, bool daemon) {
+  char schema[64], file[PATH_MAX], table[96];
+  char sql[512];
+  sqlite3_stmt *stmt;
+
+  partition_table(schema, sizeof(schema), "Day", day);
+  partition_table(file, sizeof(file), DB_PATH, day);
+
+  snprintf(sql, sizeof(sql), "ATTACH ? AS %s;", schema);
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  if (rc == SQLITE_OK) {
+    sqlite3_bind_text(stmt, 1, file, -1, SQLITE_STATIC);
+    rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+  }
+
+  if (rc != SQLITE_DONE && rc != SQLITE_OK) {
+    if (daemon)
+      err("Failed to attach partition %s to store: %s, error: %s", file,
+          DB_PATH, sqlite3_errmsg(db));
+    else
+      debug("failed to attach partition %s: %s", file, sqlite3_errmsg(db));
+    return 1;
+  }
+
+  if (!daemon)
+    return 0;
+
+  snprintf(sql, sizeof(sql),
+           "PRAGMA %s.journal_mode = WAL; PRAGMA %s.synchronous = %s;",
+           schema, schema, SYNCHRONOUS);
+  if (exec(db, sql, "set up partition") != 0)
+    goto fail;
+
+  snprintf(table, sizeof(table), "%s.Events", schema);
+  snprintf(sql, sizeof(sql), EVENTS_TABLE_STMT, table);
+  if (exec(db, sql, "create events partition") != 0)
+    goto fail;
+
+  for (int i = 0; i < ROLLUPS; ++i) {
+    snprintf(table, sizeof(table), "%s.%s", schema, rollups[i].table);
+    snprintf(sql, sizeof(sql), ROLLUP_TABLE_STMT, table);
+    if (exec(db, sql, "create rollup partition") != 0)
+      goto fail;
+  }
+
+  snprintf(sql, sizeof(sql), "INSERT OR IGNORE INTO Partitions VALUES (%ld);",
+           day);
+  if (exec(db, sql, "record partition") != 0)
+    goto fail;
+
+  return 0;
+
+fail:
+  partition_detach(db, day);
+  return 1;
+}
+
+/*
+ * Forgets `day` and deletes its file. A reader that has it attached keeps
+ * reading the unlinked file until it detaches it.
+ */
+static int partition_drop(sqlite3 *db, long day) {
+  static const char *const suffixes[] = {"", "-wal", "-shm"};
+  char file[PATH_MAX];
+  char sql[128];
+
+  snprintf(sql, sizeof(sql), "DELETE FROM Partitions WHERE day = %ld;", day);
+  if (exec(db, sql, "forget partition") != 0)
+    return 1;
+
+  partition_table(file, sizeof(file), DB_PATH, day);
+  debug("deleting partition %s", file);
+
+  for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); ++i) {
+    char path[PATH_MAX + 8];
+
+    snprintf(path, sizeof(path), "%s%s", file, suffixes[i]);
+    if (unlink(path) < 0 && errno != ENOENT)
+      warn("Failed to delete partition file %s, error code: %d", path, errno);
+  }
+
+  return 0;
+}
+
+static void partition_close(store st, Partition *part) {
+  if (part->day < 0)
+    return;
+
+  sqlite3_finalize(part->insert);
+  part->insert = NULL;
+  for (int i = 0; i < ROLLUPS; ++i) {
+    sqlite3_finalize(part->rollup[i]);
+    part->rollup[i] = NULL;
+  }
+
+  partition_detach(st->db, part->day);
+  part->day = -1;
+}
+
+/*
+ * Deletes every partition that fell out of the retention window ending at
+ * the newest day. Each day is a file of its own, so expiring one costs a
+ * detach and an unlink however much it holds, and writes nothing to the WAL
+ * but its row in Partitions. Must not run inside a transaction.
+ */
+static int partition_prune(store st) {
+  sqlite3_stmt *stmt;
+  long days[64];
+  size_t n;
+
+  if (st->retention <= 0)
+    return 0;
+
+  if (sqlite3_prepare_v2(st->db, "SELECT day FROM Partitions WHERE day <= ?;",
+                         -1, &stmt, NULL) != SQLITE_OK) {
+    err("Failed to list partitions in store: %s, error: %s", DB_PATH,
+        sqlite3_errmsg(st->db));
+    return 1;
+  }
+
+  do {
+    /* Partitions cannot be changed while the listing statement is running. */
+    sqlite3_bind_int64(stmt, 1, st->newest - st->retention);
+    for (n = 0; n < sizeof(days) / sizeof(days[0]) &&
+                sqlite3_step(stmt) == SQLITE_ROW;
+         ++n)
+      days[n] = (long)sqlite3_column_int64(stmt, 0);
+    sqlite3_reset(stmt);
+
+    for (size_t i = 0; i < n; ++i) {
+      for (int j = 0; j < PARTITIONS_OPEN; ++j) {
+        if (st->parts[j].day == days[i])
+          partition_close(st, &st->parts[j]);
+      }
+
+      if (partition_drop(st->db, days[i]) != 0) {
+        sqlite3_finalize(stmt);
+        return 1;
+      }
+    }
+  } while (n == sizeof(days) / sizeof(days[0]));
+
+  sqlite3_finalize(stmt);
+  return 0;
+}
+
+/*
+ * Moves the v2 Events table into day partitions and rebuilds each day's
+ * rollups from its events; the unpartitioned tables are dropped afterwards.
+ */
+static int migrate_partitions(sqlite3 *db) {
+  sqlite3_stmt *stmt;
+  long days[64];
+  size_t n = 0;
+  long after = -1;
+  char list[256];
+
+  snprintf(list, sizeof(list), PARTITION_DAYS_STMT, PARTITION_SECONDS,
+           sizeof(days) / sizeof(days[0]));
+  if (sqlite3_prepare_v2(db, list, -1, &stmt, NULL) != SQLITE_OK) {
+    err("Failed to list days in store: %s, error: %s", DB_PATH,
+        sqlite3_errmsg(db));
+    return 1;
+  }
+
+  do {
+    sqlite3_bind_int64(stmt, 1, after);
+    for (n = 0; sqlite3_step(stmt) == SQLITE_ROW; ++n)
+      days[n] = (long)sqlite3_column_int64(stmt, 0);
+    sqlite3_reset(stmt);
+
+    for (size_t i = 0; i < n; ++i) {
+      char events[64], table[64];
+      char sql[512];
+
+      if (partition_create_v4(db, days[i]) != 0)
+        goto fail;
+
+      partition_table(events, sizeof(events), "Events", days[i]);
+      debug("migrating events into %s", events);
+
+      snprintf(sql, sizeof(sql), PARTITION_SPLIT_STMT, events,
+               days[i] * PARTITION_SECONDS,
+               (days[i] + 1) * PARTITION_SECONDS);
+      if (exec(db, sql, "split events") != 0)
+        goto fail;
+
+      for (int j = 0; j < ROLLUPS; ++j) {
+        partition_table(table, sizeof(table), rollups[j].table, days[i]);
+        snprintf(sql, sizeof(sql), ROLLUP_BACKFILL_STMT, table,
+                 rollups[j].width, rollups[j].width, events);
+        if (exec(db, sql, "backfill rollup partition") != 0)
+          goto fail;
+      }
+
+      after = days[i];
+    }
+  } while (n == sizeof(days) / sizeof(days[0]));
+
+  sqlite3_finalize(stmt);
+
+  return exec(db,
+              "DROP TABLE Events; DROP TABLE IF EXISTS RollupMinute; DROP "
+              "TABLE IF EXISTS RollupHour;",
+              "drop unpartitioned tables");
+
+fail:
+  sqlite3_finalize(stmt);
+  return 1;
+}
+
+/*
+ * Adds the client dimension to every v3 partition: events gain a client_id
+ * column, and rollups, which key on it, are rebuilt with all rows charged to
+ * client 0.
+ */
+static int migrate_clients(sqlite3 *db) {
+  sqlite3_stmt *stmt;
+  long days[64];
+  size_t n = 0;
+
+  if (sqlite3_prepare_v2(db,
+                         "SELECT day FROM Partitions WHERE day > ? ORDER BY "
+                         "day LIMIT 64;",
+                         -1, &stmt, NULL) != SQLITE_OK) {
+    err("Failed to list partitions in store: %s, error: %s", DB_PATH,
+        sqlite3_errmsg(db));
+    return 1;
+  }
+
+  long after = -1;
+  do {
+    sqlite3_bind_int64(stmt, 1, after);
+    for (n = 0; sqlite3_step(stmt) == SQLITE_ROW; ++n)
+      days[n] = (long)sqlite3_column_int64(stmt, 0);
+    sqlite3_reset(stmt);
+
+    for (size_t i = 0; i < n; ++i) {
+      char table[64];
+      char sql[1024];
+
+      partition_table(table, sizeof(table), "Events", days[i]);
+      debug("adding clients to %s", table);
+
+      snprintf(sql, sizeof(sql), MIGRATE_CLIENT_EVENTS_STMT, table);
+      if (table_exists(db, table) && exec(db, sql, "add client column") != 0)
+        goto fail;
+
+      for (int j = 0; j < ROLLUPS; ++j) {
+        partition_table(table, sizeof(table), rollups[j].table, days[i]);
+        snprintf(sql, sizeof(sql), MIGRATE_CLIENT_ROLLUP_STMT, table, table,
+                 table);
+        if (table_exists(db, table) &&
+            exec(db, sql, "rebuild rollup partition") != 0)
+          goto fail;
+      }
+
+      after = days[i];
+    }
+  } while (n == sizeof(days) / sizeof(days[0]));
+
+  sqlite3_finalize(stmt);
+  return 0;
+
+fail:
+  sqlite3_finalize(stmt);
+  return 1;
+}
+
+/*
+ * Moves each v4 day partition out of the store into a file of its own. ATTACH
+ * cannot run inside a transaction, so every day is copied in a transaction
+ * and its tables are dropped from the store in the next one. A day still in
+ * the store is copied over from scratch, so an interrupted migration resumes
+ * where it stopped.
+ */
+static int migrate_files(sqlite3 *db) {
+  sqlite3_stmt *stmt;
+  long *days = NULL;
+  size_t n = 0, cap = 0;
+  long attached = -1;
+
+  if (sqlite3_prepare_v2(db, "SELECT day FROM Partitions ORDER BY day;", -1,
+                         &stmt, NULL) != SQLITE_OK) {
+    err("Failed to list partitions in store: %s, error: %s", DB_PATH,
+        sqlite3_errmsg(db));
+    return 1;
+  }
+
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    if (n == cap) {
+      cap = cap ? cap * 2 : 64;
+      long *grown = (long *)realloc(days, cap * sizeof(long));
+      if (grown == NULL) {
+        err("Failed to allocate partition list");
+        goto fail;
+      }
+      days = grown;
+    }
+    days[n++] = (long)sqlite3_column_int64(stmt, 0);
+  }
+
+  sqlite3_finalize(stmt);
+  stmt = NULL;
+
+  for (size_t i = 0; i < n; ++i) {
+    char schema[64], events[64], minute[64], hour[64];
+    char sql[512];
+
+    partition_table(events, sizeof(events), "Events", days[i]);
+    if (!table_exists(db, events))
+      continue;
+
+    debug("moving %s into its own file", events);
+
+    partition_table(schema, sizeof(schema), "Day", days[i]);
+    partition_table(minute, sizeof(minute), rollups[0].table, days[i]);
+    partition_table(hour, sizeof(hour), rollups[1].table, days[i]);
+
+    if (partition_attach(db, days[i], true) != 0)
+      goto fail;
+    attached = days[i];
+
+    if (exec(db, "BEGIN", "begin migration") != 0)
+      goto fail;
+
+    snprintf(sql, sizeof(sql), PARTITION_MOVE_STMT, schema, "Events", schema,
+             "Events", events);
+    if (exec(db, sql, "move events partition") != 0)
+      goto rollback;
+
+    for (int j = 0; j < ROLLUPS; ++j) {
+      snprintf(sql, sizeof(sql), PARTITION_MOVE_STMT, schema,
+               rollups[j].table, schema, rollups[j].table,
+               j == 0 ? minute : hour);
+      if (exec(db, sql, "move rollup partition") != 0)
+        goto rollback;
+    }
+
+    if (exec(db, "COMMIT", "commit migration") != 0 ||
+        exec(db, "BEGIN", "begin migration") != 0)
+      goto rollback;
+
+    snprintf(sql, sizeof(sql), PARTITION_DROP_STMT, events, minute, hour);
+    if (exec(db, sql, "drop partition") != 0 ||
+        exec(db, "COMMIT", "commit migration") != 0)
+      goto rollback;
+
+    partition_detach(db, days[i]);
+    attached = -1;
+  }
+
+  free(days);
+
+  char sql[64];
+  snprintf(sql, sizeof(sql), "PRAGMA user_version = %d;", STORE_VERSION);
+  return exec(db, sql, "set schema version");
+
+rollback:
+  sqlite3_exec(db, "ROLLBACK", 0, 0, NULL);
+fail:
+  if (attached >= 0)
+    partition_detach(db, attached);
+  sqlite3_finalize(stmt);
+  free(days);
+  return 1;
+}
+
+/*
+ * Brings a store older than v4 to v4 in one transaction. A v1 Events table is
+ * renamed aside, its strings are moved into the dictionaries and its op
+ * strings are turned back into masks, which leaves a v2 store. A v2 Events
+ * table is then split into day partitions, and v3 partitions gain clients.
+ */
+static int migrate_tables(sqlite3 *db, int version) {
+  if (exec(db, "BEGIN", "begin migration") != 0)
+    return 1;
+
+  bool v1 = version < 2 && table_exists(db, "Events");
+  if (v1) {
+    debug("migrating %s from v1 schema", DB_PATH);
+
+    if (exec(db, MIGRATE_V1_STMT, "rename v1 tables") != 0 ||
+        (!column_exists(db, "EventsV1", "count") &&
+         exec(db, MIGRATE_COUNT_STMT, "add count columns") != 0))
+      goto rollback;
+  }
+
+  if (exec(db, TABLE_STMT, "create tables") != 0)
+    goto rollback;
+
+  if (version == 3 && migrate_clients(db) != 0)
+    goto rollback;
+
+  if (v1) {
+    char sql[512];
+
+    sqlite3_create_function(db, "op_mask", 1,
+                            SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                            sql_op_mask, NULL, NULL);
+
+    snprintf(sql, sizeof(sql), EVENTS_TABLE_STMT, "Events");
+    if (exec(db, sql, "create events table") != 0 ||
+        exec(db, MIGRATE_COPY_STMT, "copy v1 events") != 0)
+      goto rollback;
+  }
+
+  if (table_exists(db, "Events")) {
+    debug("migrating %s to day partitions", DB_PATH);
+
+    if (migrate_partitions(db) != 0)
+      goto rollback;
+  }
+
+  if (exec(db, "PRAGMA user_version = 4;", "set schema version") != 0 ||
+      exec(db, "COMMIT", "commit migration") != 0)
+    goto rollback;
+
+  return 0;
+
+rollback:
+  sqlite3_exec(db, "ROLLBACK", 0, 0, NULL);
+  return 1;
+}
+
+/*
+ * Brings the store to STORE_VERSION: a store older than v4 is first migrated
+ * to v4 in place, and its day partitions are then moved into files.
+ */
+static int store_migrate(sqlite3 *db) {
+  int version = user_version(db);
+
+  if (version == STORE_VERSION)
+    return exec(db, TABLE_STMT, "create tables");
+
+  if (version > STORE_VERSION) {
+    err("Store %s has schema version %d, newer than supported %d", DB_PATH,
+        version, STORE_VERSION);
+    return 1;
+  }
+
+  if (version < 4 && migrate_tables(db, version) != 0)
+    return 1;
+
+  return migrate_files(db);
+}
+
+static int dict_prepare(sqlite3 *db, Dict *dict, const char *table,
+                        const char *column) {
+  char sql[128];
+
+  snprintf(sql, sizeof(sql), DICT_INSERT_STMT, table, column);
+  if (sqlite3_prepare_v2(db, sql, -1, &dict->insert, NULL) != SQLITE_OK)
+    return 1;
+
+  snprintf(sql, sizeof(sql), DICT_SELECT_STMT, table, column);
+  if (sqlite3_prepare_v2(db, sql, -1, &dict->select, NULL) != SQLITE_OK)
+    return 1;
+
+  return 0;
+}
+
+static void dict_free(Dict *dict) {
+  sqlite3_finalize(dict->insert);
+  sqlite3_finalize(dict->select);
+  free(dict->ids);
+}
+
+/*
+ * Maps a string table id to its row id in a dictionary table. Ids are cached
+ * by string table id, so only the first sighting of a string touches SQLite.
+ */
+static sqlite3_int64 dict_id(sqlite3 *db, Dict *dict, uint32_t id) {
+  if (id < dict->len && dict->ids[id] != 0)
+    return dict->ids[id];
+
+  if (id >= dict->len) {
+    size_t len = dict->len ? dict->len : 1024;
+    while (len <= id)
+      len *= 2;
+
+    sqlite3_int64 *ids =
+        (sqlite3_int64 *)realloc(dict->ids, len * sizeof(sqlite3_int64));
+    if (ids == NULL)
+      return 0;
+
+    memset(ids + dict->len, 0, (len - dict->len) * sizeof(sqlite3_int64));
+    dict->ids = ids;
+    dict->len = len;
+  }
+
+  const char *str = strtab_get(id);
+  sqlite3_int64 rowid = 0;
+
+  sqlite3_bind_text(dict->insert, 1, str, -1, SQLITE_STATIC);
+  int rc = sqlite3_step(dict->insert);
+  sqlite3_reset(dict->insert);
+
+  if (rc == SQLITE_DONE && sqlite3_changes(db) > 0) {
+    rowid = sqlite3_last_insert_rowid(db);
+  } else {
+    sqlite3_bind_text(dict->select, 1, str, -1, SQLITE_STATIC);
+    if (sqlite3_step(dict->select) == SQLITE_ROW)
+      rowid = sqlite3_column_int64(dict->select, 0);
+    sqlite3_reset(dict->select);
+  }
+
+  dict->ids[id] = rowid;
+  return rowid;
+}
+
+static int store_pragmas(sqlite3 *db) {
+  char sql[128];
+
+  snprintf(sql, sizeof(sql), "PRAGMA synchronous = %s", SYNCHRONOUS);
+  if (sqlite3_exec(db, sql, 0, 0, NULL) != SQLITE_OK) {
+    err("Failed to set synchronous for store: %s, error: %s", DB_PATH,
+        sqlite3_errmsg(db));
+    return 1;
+  }
+
+  snprintf(sql, sizeof(sql), "PRAGMA wal_autocheckpoint = %ld",
+           WAL_AUTOCHECKPOINT);
+  if (sqlite3_exec(db, sql, 0, 0, NULL) != SQLITE_OK) {
+    err("Failed to set wal_autocheckpoint for store: %s, error: %s", DB_PATH,
+        sqlite3_errmsg(db));
+    return 1;
+  }
+
+  return 0;
+}
+
 store store_open(bool daemon) {
   sqlite3 *db;
 
@@ -44,56 +846,409 @@ store store_open(bool daemon) {
     return NULL;
   }
 
-  rc = sqlite3_exec(db, TABLE_STMT, 0, 0, NULL);
+  if (!daemon && user_version(db) != STORE_VERSION) {
+    err("Store %s has an old schema, start the daemon once to migrate it",
+        DB_PATH);
+    sqlite3_close(db);
+    return NULL;
+  }
 
-  if (rc != SQLITE_OK) {
-    err("Failed to create table in store: %s, error code: %d", DB_PATH,
-        sqlite3_errcode(db));
-    store_close(db);
+  Store *st = (Store *)calloc(1, sizeof(Store));
+  if (st == NULL) {
+    err("Failed to allocate store");
+    sqlite3_close(db);
+    return NULL;
+  }
+
+  st->db = db;
+  st->wd = -1;
+  for (int i = 0; i < PARTITIONS_OPEN; ++i)
+    st->parts[i].day = -1;
+
+  if (!daemon)
+    return st;
+
+  st->batch_size = BATCH_SIZE > 0 ? BATCH_SIZE : 1;
+  st->batch_ms = BATCH_MS;
+
+  if (store_migrate(db) != 0 || store_pragmas(db) != 0) {
+    store_close(st);
+    return NULL;
+  }
+
+  char sql[256];
+  snprintf(sql, sizeof(sql), SETTINGS_STMT, size_mode());
+  if (exec(db, sql, "record settings") != 0) {
+    store_close(st);
+    return NULL;
+  }
+
+  if (dict_prepare(db, &st->paths, "Paths", "path") != 0 ||
+      dict_prepare(db, &st->procs, "Procs", "name") != 0 ||
+      dict_prepare(db, &st->clients, "Clients", "address") != 0) {
+    err("Failed to create dictionary statements in store: %s, error: %s",
+        DB_PATH, sqlite3_errmsg(db));
+    store_close(st);
+    return NULL;
+  }
+
+  st->newest = time(NULL) / PARTITION_SECONDS;
+  st->retention = RETENTION_DAYS;
+
+  if (partition_prune(st) != 0) {
+    store_close(st);
     return NULL;
   }
 
-  return db;
+  return st;
 }
 
-int store_insert(store db, Event *event) {
-  sqlite3_stmt *stmt;
+/*
+ * Returns the partition of `day`, attaching it in place of the oldest one
+ * attached if needed. Attaching commits the batch in progress first, and
+ * moving to a new day then expires the partitions past retention.
+ */
+static Partition *store_partition(store st, long day) {
+  Partition *part = &st->parts[0];
+  char schema[64], table[96];
+  char sql[512];
 
-  int rc = sqlite3_prepare_v2(db, INSERT_STMT, -1, &stmt, 0);
+  for (int i = 0; i < PARTITIONS_OPEN; ++i) {
+    if (st->parts[i].day == day)
+      return &st->parts[i];
+    if (st->parts[i].day < part->day)
+      part = &st->parts[i];
+  }
 
-  if (rc != SQLITE_OK) {
-    err("Failed to create statement in store: %s, error code: %d", DB_PATH,
-        sqlite3_errcode(db));
-    store_close(db);
+  if (store_flush(st) != 0)
+    return NULL;
+
+  partition_close(st, part);
+  if (partition_attach(st->db, day, true) != 0)
+    return NULL;
+  part->day = day;
+
+  partition_table(schema, sizeof(schema), "Day", day);
+  snprintf(table, sizeof(table), "%s.Events", schema);
+  snprintf(sql, sizeof(sql), INSERT_STMT, table);
+  if (sqlite3_prepare_v2(st->db, sql, -1, &part->insert, 0) != SQLITE_OK)
+    goto fail;
+
+  for (int i = 0; i < ROLLUPS; ++i) {
+    snprintf(table, sizeof(table), "%s.%s", schema, rollups[i].table);
+    snprintf(sql, sizeof(sql), ROLLUP_UPSERT_STMT, table);
+    if (sqlite3_prepare_v2(st->db, sql, -1, &part->rollup[i], 0) != SQLITE_OK)
+      goto fail;
+  }
+
+  if (day > st->newest) {
+    st->newest = day;
+    if (partition_prune(st) != 0)
+      return NULL;
+  }
+
+  return part;
+
+fail:
+  err("Failed to create statement in store: %s, error: %s", DB_PATH,
+      sqlite3_errmsg(st->db));
+  partition_close(st, part);
+  return NULL;
+}
+
+static int store_begin(store st) {
+  if (sqlite3_exec(st->db, "BEGIN", 0, 0, NULL) != SQLITE_OK) {
+    err("Failed to begin transaction in store: %s, error: %s", DB_PATH,
+        sqlite3_errmsg(st->db));
+    return 1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &st->deadline);
+  st->deadline.tv_sec += st->batch_ms / 1000;
+  st->deadline.tv_nsec += (st->batch_ms % 1000) * 1000000;
+  if (st->deadline.tv_nsec >= 1000000000) {
+    st->deadline.tv_sec++;
+    st->deadline.tv_nsec -= 1000000000;
+  }
+
+  return 0;
+}
+
+int store_insert(store st, const Event *event, uint32_t count,
+                 time_t last_time) {
+  Partition *part = store_partition(st, event->time / PARTITION_SECONDS);
+  if (part == NULL)
+    return 1;
+
+  if (st->pending == 0 && store_begin(st) != 0)
+    return 1;
+
+  sqlite3_int64 path_id = dict_id(st->db, &st->paths, event->path);
+  sqlite3_int64 proc_id = dict_id(st->db, &st->procs, event->proc);
+  sqlite3_int64 client_id =
+      event->client ? dict_id(st->db, &st->clients, event->client) : 0;
+
+  if (path_id == 0 || proc_id == 0 || (event->client && client_id == 0)) {
+    err("Failed to resolve dictionary ids in store: %s, error: %s", DB_PATH,
+        sqlite3_errmsg(st->db));
     return 1;
   }
 
-  sqlite3_bind_text(stmt, 1, event->proc_name, -1, SQLITE_STATIC);
+  sqlite3_stmt *stmt = part->insert;
+
+  sqlite3_bind_int64(stmt, 1, proc_id);
   sqlite3_bind_int(stmt, 2, event->pid);
   sqlite3_bind_int(stmt, 3, event->uid);
   sqlite3_bind_int(stmt, 4, event->gid);
-  sqlite3_bind_int64(stmt, 5, (event->size / 1024));
-  sqlite3_bind_text(stmt, 6, event->op, -1, SQLITE_STATIC);
-  sqlite3_bind_text(stmt, 7, event->path, -1, SQLITE_STATIC);
-  sqlite3_bind_int64(stmt, 8, (long int)*(event->time));
+  if (event->size >= 0)
+    sqlite3_bind_int64(stmt, 5, (event->size / 1024));
+  else
+    sqlite3_bind_null(stmt, 5);
+  sqlite3_bind_int64(stmt, 6, (sqlite3_int64)event->mask);
+  sqlite3_bind_int64(stmt, 7, path_id);
+  sqlite3_bind_int64(stmt, 8, (long int)event->time);
+  sqlite3_bind_int64(stmt, 9, count);
+  sqlite3_bind_int64(stmt, 10, (long int)last_time);
+  sqlite3_bind_int64(stmt, 11, client_id);
+
+  int rc = sqlite3_step(stmt);
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
 
-  rc = sqlite3_step(stmt);
   if (rc != SQLITE_DONE) {
     err("Failed to insert event in store: %s, error code: %d", DB_PATH,
-        sqlite3_errcode(db));
+        sqlite3_errcode(st->db));
+    return 1;
+  }
+
+  for (int i = 0; i < ROLLUPS; ++i) {
+    stmt = part->rollup[i];
+
+    sqlite3_bind_int64(stmt, 1, event->time / rollups[i].width *
+                                    rollups[i].width);
+    sqlite3_bind_int64(stmt, 2, (sqlite3_int64)event->mask);
+    sqlite3_bind_int64(stmt, 3, path_id);
+    sqlite3_bind_int64(stmt, 4, proc_id);
+    sqlite3_bind_int64(stmt, 5, client_id);
+    sqlite3_bind_int64(stmt, 6, count);
+    sqlite3_bind_int(stmt, 7, event->pid);
+    sqlite3_bind_int(stmt, 8, event->uid);
+    sqlite3_bind_int(stmt, 9, event->gid);
+    if (event->size >= 0)
+      sqlite3_bind_int64(stmt, 10, (event->size / 1024));
+    else
+      sqlite3_bind_null(stmt, 10);
+
+    rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+
+    if (rc != SQLITE_DONE) {
+      err("Failed to update %s in store: %s, error code: %d",
+          rollups[i].table, DB_PATH, sqlite3_errcode(st->db));
+      return 1;
+    }
+  }
+
+  if (++st->pending >= st->batch_size)
+    return store_flush(st);
+
+  return 0;
+}
+
+int store_tick(store st) {
+  if (st->pending == 0)
+    return 0;
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  if (now.tv_sec > st->deadline.tv_sec ||
+      (now.tv_sec == st->deadline.tv_sec &&
+       now.tv_nsec >= st->deadline.tv_nsec))
+    return store_flush(st);
+
+  return 0;
+}
+
+int store_flush(store st) {
+  if (st->pending == 0)
+    return 0;
+
+  st->pending = 0;
+
+  if (sqlite3_exec(st->db, "COMMIT", 0, 0, NULL) != SQLITE_OK) {
+    err("Failed to commit transaction in store: %s, error: %s", DB_PATH,
+        sqlite3_errmsg(st->db));
+    sqlite3_exec(st->db, "ROLLBACK", 0, 0, NULL);
+    return 1;
+  }
+
+  return 0;
+}
+
+static void dict_forget(Dict *dict) {
+  free(dict->ids);
+  dict->ids = NULL;
+  dict->len = 0;
+}
+
+/*
+ * Drops the cached dictionary row ids. Called after a string table sweep,
+ * which hands freed string ids out again for other strings.
+ */
+void store_forget(store st) {
+  dict_forget(&st->paths);
+  dict_forget(&st->procs);
+  dict_forget(&st->clients);
+}
+
+/*
+ * Attaches the partitions that overlap the window, newest first and as many as
+ * the connection may attach, and detaches those that left it or expired.
+ * Fills `days` with the days attached.
+ */
+static int fetch_attach(sqlite3 *db, time_t since, long *days, size_t *n) {
+  char stale[FETCH_DAYS][64];
+  bool attached[FETCH_DAYS] = {false};
+  size_t max = FETCH_DAYS, nstale = 0;
+  sqlite3_stmt *stmt;
+
+  int limit = sqlite3_limit(db, SQLITE_LIMIT_ATTACHED, -1);
+  if (limit >= 0 && (size_t)limit < max)
+    max = (size_t)limit;
+
+  *n = 0;
+
+  if (sqlite3_prepare_v2(db, FETCH_PARTITIONS_STMT, -1, &stmt, NULL) !=
+      SQLITE_OK) {
+    err("Failed to list partitions in store: %s, error: %s", DB_PATH,
+        sqlite3_errmsg(db));
+    return 1;
+  }
+
+  sqlite3_bind_int64(stmt, 1, since / PARTITION_SECONDS);
+  while (*n < max && sqlite3_step(stmt) == SQLITE_ROW)
+    days[(*n)++] = (long)sqlite3_column_int64(stmt, 0);
+  if (*n == max && sqlite3_step(stmt) == SQLITE_ROW)
+    debug("window spans more than %zu partitions, reading the newest", max);
+  sqlite3_finalize(stmt);
 
-    store_close(db);
+  if (sqlite3_prepare_v2(db, "PRAGMA database_list;", -1, &stmt, NULL) !=
+      SQLITE_OK) {
+    err("Failed to list attached partitions in store: %s, error: %s", DB_PATH,
+        sqlite3_errmsg(db));
     return 1;
   }
 
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    const char *name = (const char *)sqlite3_column_text(stmt, 1);
+    if (name == NULL || strncmp(name, "Day_", 4) != 0)
+      continue;
+
+    char schema[64];
+    size_t i = 0;
+    for (; i < *n; ++i) {
+      partition_table(schema, sizeof(schema), "Day", days[i]);
+      if (strcmp(schema, name) == 0)
+        break;
+    }
+
+    if (i < *n)
+      attached[i] = true;
+    else if (nstale < FETCH_DAYS)
+      snprintf(stale[nstale++], sizeof(stale[0]), "%s", name);
+  }
+
   sqlite3_finalize(stmt);
 
+  for (size_t i = 0; i < nstale; ++i) {
+    char sql[128];
+
+    snprintf(sql, sizeof(sql), "DETACH %s;", stale[i]);
+    sqlite3_exec(db, sql, 0, 0, NULL);
+  }
+
+  /* A partition expired since it was listed is left out. */
+  size_t kept = 0;
+  for (size_t i = 0; i < *n; ++i) {
+    if (attached[i] || partition_attach(db, days[i], false) == 0)
+      days[kept++] = days[i];
+  }
+  *n = kept;
+
   return 0;
 }
 
-int store_show(store db, WINDOW *win) {
-  sqlite3_stmt *stmt;
-  int rc = sqlite3_prepare_v2(db, FETCH_STMT, -1, &stmt, NULL);
+/*
+ * Builds the fetch query over the rollup partitions that overlap the window.
+ * `*out` is left NULL when no partition does.
+ */
+static int fetch_sql(sqlite3 *db, int level, time_t since, char **out) {
+  long days[FETCH_DAYS];
+  size_t n;
+
+  *out = NULL;
+
+  if (fetch_attach(db, since, days, &n) != 0)
+    return 1;
+
+  if (n == 0)
+    return 0;
+
+  size_t cap = n * 128, len = 0;
+  char *parts = (char *)malloc(cap);
+  if (parts == NULL) {
+    err("Failed to allocate fetch statement");
+    return 1;
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    char schema[64], table[96];
+
+    partition_table(schema, sizeof(schema), "Day", days[i]);
+    snprintf(table, sizeof(table), "%s.%s", schema, rollups[level].table);
+    len += snprintf(parts + len, cap - len, FETCH_PARTITION_STMT,
+                    i > 0 ? " UNION ALL " : "", table);
+  }
+
+  size_t size = len + sizeof(FETCH_STMT);
+  *out = (char *)malloc(size);
+  if (*out != NULL)
+    snprintf(*out, size, FETCH_STMT, parts);
+
+  free(parts);
+
+  if (*out == NULL) {
+    err("Failed to allocate fetch statement");
+    return 1;
+  }
+
+  return 0;
+}
+
+int store_show(store st, WINDOW *win, long window, int top) {
+  sqlite3 *db = st->db;
+  sqlite3_stmt *stmt = NULL;
+  int level = window > 0 && window <= ROLLUP_MINUTE_SPAN ? 0 : 1;
+  time_t since = window > 0 ? time(NULL) - window : 0;
+  SizeMode mode = store_size_mode(db);
+  int rc = SQLITE_OK;
+
+  /* A partition the daemon has just created may not hold its tables yet. */
+  for (int attempt = 0; attempt < 2; ++attempt) {
+    char *sql;
+
+    if (fetch_sql(db, level, since, &sql) != 0)
+      return 1;
+    if (sql == NULL)
+      return 0;
+
+    rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    free(sql);
+
+    if (rc == SQLITE_OK)
+      break;
+  }
 
   if (rc != SQLITE_OK) {
     err("Failed to prepare statment for store: %s, error code: %s", DB_PATH,
@@ -101,10 +1256,14 @@ int store_show(store db, WINDOW *win) {
     return 1;
   }
 
-  int x, y;
-  getmaxyx(win, y, x);
-  int i = 7;
-  Event event;
+  int y = getmaxy(win);
+  int i = top;
+
+  sqlite3_bind_int64(stmt, 1, since / rollups[level].width *
+                                  rollups[level].width);
+  sqlite3_bind_int(stmt, 2, y - 1 - i > 0 ? y - 1 - i : 0);
+
+  Row row;
   while (true) {
     if (i == y - 1)
       break;
@@ -113,25 +1272,33 @@ int store_show(store db, WINDOW *win) {
 
     if (rc == SQLITE_ROW) {
 
-      unsigned long int count = sqlite3_column_int(stmt, 0);
+      row.count = sqlite3_column_int(stmt, 0);
 
-      snprintf(event.proc_name, sizeof(event.proc_name), "%s",
+      snprintf(row.proc_name, sizeof(row.proc_name), "%s",
                sqlite3_column_text(stmt, 1));
 
-      event.pid = sqlite3_column_int(stmt, 2);
-      event.uid = sqlite3_column_int(stmt, 3);
-      event.gid = sqlite3_column_int(stmt, 4);
-      event.size = sqlite3_column_int(stmt, 5);
+      row.pid = sqlite3_column_int(stmt, 2);
+      row.uid = sqlite3_column_int(stmt, 3);
+      row.gid = sqlite3_column_int(stmt, 4);
+      row.size = sqlite3_column_type(stmt, 5) == SQLITE_NULL
+                     ? -1
+                     : sqlite3_column_int(stmt, 5);
 
-      snprintf(event.op, sizeof(event.op), "%s", sqlite3_column_text(stmt, 6));
-      snprintf(event.path, sizeof(event.path), "%s",
-               sqlite3_column_text(stmt, 7));
-      time_t time = sqlite3_column_int(stmt, 8);
-      event.time = &time;
+      snprintf(row.op, sizeof(row.op), "%s",
+               op((uint64_t)sqlite3_column_int64(stmt, 6)));
+      snprintf(row.path, sizeof(row.path), "%s", sqlite3_column_text(stmt, 7));
+      row.time = sqlite3_column_int(stmt, 8);
+      snprintf(row.client, sizeof(row.client), "%s",
+               sqlite3_column_type(stmt, 9) == SQLITE_NULL
+                   ? "-"
+                   : (const char *)sqlite3_column_text(stmt, 9));
 
-      mvwprintw(win, i, 2, "%-9lu %-15s %-10d %-10d %-10d %-10ld %-10s %-10s",
-                count, event.proc_name, event.pid, event.uid, event.gid,
-                event.size, event.op, event.path);
+      char size[24];
+      mvwprintw(win, i, 2,
+                "%-9lu %-15s %-10d %-10d %-10d %-10s %-10s %-20.20s %s",
+                row.count, row.proc_name, row.pid, row.uid, row.gid,
+                size_str(row.size, row.path, mode, size, sizeof(size)), row.op,
+                row.client, row.path);
       i++;
 
     } else if (rc == SQLITE_DONE) {
@@ -139,6 +1306,7 @@ int store_show(store db, WINDOW *win) {
     } else {
       err("Failed to fetch data from store: %s, error code: %d", DB_PATH,
           sqlite3_errcode(db));
+      sqlite3_finalize(stmt);
       return 1;
     }
   }
@@ -148,14 +1316,41 @@ int store_show(store db, WINDOW *win) {
   return 0;
 }
 
-int store_close(store db) {
-  int rc = sqlite3_close(db);
+/*
+ * Watches the WAL of today's partition, which the daemon appends to on every
+ * commit, in place of the one watched before. Called again as time passes to
+ * follow the day rollover. Returns the watch descriptor, or -1 while there is
+ * no WAL.
+ */
+int store_watch(store st, int inotify_fd) {
+  char file[PATH_MAX], wal[PATH_MAX + 8];
 
-  if (rc != SQLITE_OK) {
+  partition_table(file, sizeof(file), DB_PATH, time(NULL) / PARTITION_SECONDS);
+  snprintf(wal, sizeof(wal), "%s-wal", file);
+
+  int wd = inotify_add_watch(inotify_fd, wal, IN_MODIFY);
+  if (st->wd >= 0 && st->wd != wd)
+    inotify_rm_watch(inotify_fd, st->wd);
+  st->wd = wd;
+
+  return wd;
+}
+
+int store_close(store st) {
+  int rc = store_flush(st);
+
+  for (int i = 0; i < PARTITIONS_OPEN; ++i)
+    partition_close(st, &st->parts[i]);
+  dict_free(&st->paths);
+  dict_free(&st->procs);
+  dict_free(&st->clients);
+
+  if (sqlite3_close(st->db) != SQLITE_OK) {
     err("Failed to close store %s, error code: %d", DB_PATH,
-        sqlite3_errcode(db));
-    return 1;
+        sqlite3_errcode(st->db));
+    rc = 1;
   }
 
-  return 0;
+  free(st);
+  return rc;
 }
@@ -9,16 +9,63 @@
 extern "C" {
 #endif
 
-typedef sqlite3 *store;
+#define ROLLUPS 2
+
+typedef struct {
+  sqlite3_int64 *ids;
+  size_t len;
+  sqlite3_stmt *insert;
+  sqlite3_stmt *select;
+} Dict;
+
+/* Days the daemon keeps attached, so that late events need no reattach. */
+#define PARTITIONS_OPEN 2
+
+/* A day partition attached to the daemon's connection, `day` -1 if none. */
+typedef struct {
+  long day;
+  sqlite3_stmt *insert;
+  sqlite3_stmt *rollup[ROLLUPS];
+} Partition;
+
+typedef struct {
+  sqlite3 *db;
+  Partition parts[PARTITIONS_OPEN];
+  Dict paths;
+  Dict procs;
+  Dict clients;
+  long newest;
+  long retention;
+  int wd;
+  size_t pending;
+  size_t batch_size;
+  long batch_ms;
+  struct timespec deadline;
+} Store;
+
+typedef Store *store;
 
 typedef struct {
   unsigned long int count;
-  Event ev;
+  char proc_name[200];
+  pid_t pid;
+  uid_t uid;
+  gid_t gid;
+  off_t size;
+  char op[10];
+  char client[64];
+  char path[PATH_MAX];
+  time_t time;
 } Row;
 
 store store_open(bool daemon);
-int store_insert(store db, Event *event);
-int store_show(store db, WINDOW *win);
+int store_insert(store db, const Event *event, uint32_t count,
+                 time_t last_time);
+int store_tick(store db);
+int store_flush(store db);
+void store_forget(store db);
+int store_show(store db, WINDOW *win, long window, int top);
+int store_watch(store db, int inotify_fd);
 int store_close(store db);
 
 #ifdef __cplusplus
@@ -0,0 +1,327 @@
+#include "strtab.h"
+#include "utils.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHUNK_SIZE (1u << STRTAB_CHUNK_BITS)
+
+#define ENTRY_KEEP 1
+#define ENTRY_PIN 2
+
+typedef struct {
+  const char *str;
+  uint32_t hash;
+  uint32_t flags;
+} Entry;
+
+static struct {
+  Entry *chunks[STRTAB_CHUNKS];
+  uint32_t count;
+  uint32_t *index;
+  size_t index_size;
+  char *slab;
+  size_t slab_used;
+  size_t bytes;
+  size_t live;
+
+  /* Ids freed by a sweep, handed out again before new ones. */
+  uint32_t *free;
+  size_t nfree;
+  size_t free_cap;
+
+  char **slabs;
+  size_t nslabs;
+  size_t slabs_cap;
+} tab;
+
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static uint32_t hash(const char *str, size_t *len) {
+  uint32_t h = 2166136261u;
+  const char *p = str;
+
+  for (; *p != '\0'; ++p)
+    h = (h ^ (unsigned char)*p) * 16777619u;
+
+  *len = (size_t)(p - str);
+  return h;
+}
+
+static Entry *entry(uint32_t id) {
+  return &tab.chunks[id >> STRTAB_CHUNK_BITS][id & (CHUNK_SIZE - 1)];
+}
+
+static uint32_t find(const char *str, uint32_t h) {
+  if (tab.index == NULL)
+    return 0;
+
+  for (size_t i = h & (tab.index_size - 1);; i = (i + 1) & (tab.index_size - 1)) {
+    uint32_t id = tab.index[i];
+    if (id == 0)
+      return 0;
+
+    Entry *e = entry(id);
+    if (e->hash == h && strcmp(e->str, str) == 0)
+      return id;
+  }
+}
+
+static void fill(uint32_t *index, size_t size) {
+  for (uint32_t id = 1; id <= tab.count; ++id) {
+    if (entry(id)->str == NULL)
+      continue;
+
+    size_t i = entry(id)->hash & (size - 1);
+    while (index[i] != 0)
+      i = (i + 1) & (size - 1);
+    index[i] = id;
+  }
+}
+
+static bool grow(void) {
+  size_t size = tab.index_size ? tab.index_size * 2 : 4096;
+  uint32_t *index = (uint32_t *)calloc(size, sizeof(uint32_t));
+  if (index == NULL)
+    return false;
+
+  fill(index, size);
+
+  free(tab.index);
+  tab.index = index;
+  tab.index_size = size;
+
+  return true;
+}
+
+static bool big(size_t len) { return len + 1 > STRTAB_SLAB; }
+
+static const char *copy(const char *str, size_t len) {
+  if (big(len)) {
+    char *dst = (char *)malloc(len + 1);
+    if (dst != NULL)
+      memcpy(dst, str, len + 1);
+    return dst;
+  }
+
+  if (tab.slab == NULL || tab.slab_used + len + 1 > STRTAB_SLAB) {
+    if (tab.nslabs == tab.slabs_cap) {
+      size_t cap = tab.slabs_cap ? tab.slabs_cap * 2 : 16;
+      char **slabs = (char **)realloc(tab.slabs, cap * sizeof(char *));
+      if (slabs == NULL)
+        return NULL;
+      tab.slabs = slabs;
+      tab.slabs_cap = cap;
+    }
+
+    tab.slab = (char *)malloc(STRTAB_SLAB);
+    tab.slab_used = 0;
+    if (tab.slab == NULL)
+      return NULL;
+    tab.slabs[tab.nslabs++] = tab.slab;
+  }
+
+  char *dst = tab.slab + tab.slab_used;
+  memcpy(dst, str, len + 1);
+  tab.slab_used += len + 1;
+
+  return dst;
+}
+
+static uint32_t insert(const char *str, size_t len, uint32_t h) {
+  uint32_t id = tab.nfree > 0 ? tab.free[tab.nfree - 1] : tab.count + 1;
+
+  if ((id >> STRTAB_CHUNK_BITS) >= STRTAB_CHUNKS) {
+    err("String table full, not interning %s", str);
+    return 0;
+  }
+
+  if ((tab.live + 1) * 2 > tab.index_size && !grow())
+    return 0;
+
+  Entry **chunk = &tab.chunks[id >> STRTAB_CHUNK_BITS];
+  if (*chunk == NULL) {
+    *chunk = (Entry *)calloc(CHUNK_SIZE, sizeof(Entry));
+    if (*chunk == NULL)
+      return 0;
+  }
+
+  const char *dst = copy(str, len);
+  if (dst == NULL)
+    return 0;
+
+  Entry *e = entry(id);
+  e->str = dst;
+  e->hash = h;
+  e->flags = 0;
+
+  size_t i = h & (tab.index_size - 1);
+  while (tab.index[i] != 0)
+    i = (i + 1) & (tab.index_size - 1);
+  tab.index[i] = id;
+
+  tab.bytes += len + 1;
+  tab.live++;
+  if (tab.nfree > 0)
+    tab.nfree--;
+  else
+    __atomic_store_n(&tab.count, id, __ATOMIC_RELEASE);
+
+  return id;
+}
+
+static uint32_t intern(const char *str, uint32_t flags) {
+  size_t len;
+  uint32_t h = hash(str, &len);
+
+  pthread_rwlock_rdlock(&lock);
+  uint32_t id = find(str, h);
+  uint32_t has = id != 0 ? __atomic_load_n(&entry(id)->flags, __ATOMIC_RELAXED)
+                         : 0;
+  bool done = id != 0 && (has & flags) == flags;
+  pthread_rwlock_unlock(&lock);
+
+  if (done)
+    return id;
+
+  pthread_rwlock_wrlock(&lock);
+  id = find(str, h);
+  if (id == 0)
+    id = insert(str, len, h);
+  if (id != 0)
+    entry(id)->flags |= flags;
+  pthread_rwlock_unlock(&lock);
+
+  return id;
+}
+
+uint32_t strtab_intern(const char *str) { return intern(str, 0); }
+
+/* Interns a string that no sweep will reclaim, for long-lived labels. */
+uint32_t strtab_pin(const char *str) { return intern(str, ENTRY_PIN); }
+
+/* Lets the next sweep reclaim a pinned string unless it is kept. */
+void strtab_unpin(uint32_t id) {
+  pthread_rwlock_rdlock(&lock);
+  if (id != 0 && id <= tab.count && entry(id)->str != NULL)
+    __atomic_fetch_and(&entry(id)->flags, ~ENTRY_PIN, __ATOMIC_RELAXED);
+  pthread_rwlock_unlock(&lock);
+}
+
+const char *strtab_get(uint32_t id) {
+  if (id == 0 || id > __atomic_load_n(&tab.count, __ATOMIC_ACQUIRE))
+    return "";
+
+  const char *str = entry(id)->str;
+  return str != NULL ? str : "";
+}
+
+/*
+ * Marks `id` as still referenced, so that the next sweep keeps it. Callers
+ * share the read lock, so the flag is set atomically.
+ */
+void strtab_keep(uint32_t id) {
+  pthread_rwlock_rdlock(&lock);
+  if (id != 0 && id <= tab.count && entry(id)->str != NULL)
+    __atomic_fetch_or(&entry(id)->flags, ENTRY_KEEP, __ATOMIC_RELAXED);
+  pthread_rwlock_unlock(&lock);
+}
+
+/*
+ * Frees every string neither pinned nor kept since the last sweep, and
+ * copies the survivors into fresh slabs so that the old ones can be
+ * released. The caller must make sure no other thread holds an unkept id
+ * or a pointer from `strtab_get`. Returns the number of strings freed.
+ */
+size_t strtab_sweep(void) {
+  pthread_rwlock_wrlock(&lock);
+
+  char **slabs = tab.slabs;
+  size_t nslabs = tab.nslabs;
+  bool release = true;
+  size_t freed = 0;
+
+  tab.slabs = NULL;
+  tab.nslabs = 0;
+  tab.slabs_cap = 0;
+  tab.slab = NULL;
+  tab.slab_used = 0;
+  tab.bytes = 0;
+  tab.live = 0;
+  tab.nfree = 0;
+
+  for (uint32_t id = tab.count; id >= 1; --id) {
+    Entry *e = entry(id);
+    size_t len = e->str != NULL ? strlen(e->str) : 0;
+
+    if (e->str != NULL && e->flags != 0) {
+      if (!big(len)) {
+        const char *dst = copy(e->str, len);
+        if (dst != NULL)
+          e->str = dst;
+        else
+          release = false;
+      }
+
+      e->flags &= ~ENTRY_KEEP;
+      tab.bytes += len + 1;
+      tab.live++;
+      continue;
+    }
+
+    if (e->str != NULL) {
+      if (big(len))
+        free((char *)e->str);
+      e->str = NULL;
+      freed++;
+    }
+
+    if (tab.nfree == tab.free_cap) {
+      size_t cap = tab.free_cap ? tab.free_cap * 2 : 1024;
+      uint32_t *ids = (uint32_t *)realloc(tab.free, cap * sizeof(uint32_t));
+      if (ids == NULL)
+        continue;
+      tab.free = ids;
+      tab.free_cap = cap;
+    }
+    tab.free[tab.nfree++] = id;
+  }
+
+  if (tab.index != NULL) {
+    memset(tab.index, 0, tab.index_size * sizeof(uint32_t));
+    fill(tab.index, tab.index_size);
+  }
+
+  /* Survivors that could not be copied still point into the old slabs. */
+  if (release) {
+    for (size_t i = 0; i < nslabs; ++i)
+      free(slabs[i]);
+    free(slabs);
+  }
+
+  debug("string table swept %zu strings, %zu left in %zu bytes", freed,
+        tab.live, tab.bytes);
+
+  pthread_rwlock_unlock(&lock);
+
+  return freed;
+}
+
+size_t strtab_count(void) {
+  pthread_rwlock_rdlock(&lock);
+  size_t live = tab.live;
+  pthread_rwlock_unlock(&lock);
+
+  return live;
+}
+
+size_t strtab_bytes(void) {
+  pthread_rwlock_rdlock(&lock);
+  size_t bytes = tab.bytes;
+  pthread_rwlock_unlock(&lock);
+
+  return bytes;
+}
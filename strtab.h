@@ -0,0 +1,34 @@
+#ifndef STRTAB_H
+#define STRTAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define STRTAB_CHUNK_BITS 12
+#define STRTAB_CHUNKS 65536
+#define STRTAB_SLAB (1024 * 1024)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Process-wide table of interned strings. Ids start at 1. An id stays valid
+ * until a `strtab_sweep` that it was not kept for; pinned strings are not
+ * swept until unpinned. Pointers from `strtab_get` are only good until the
+ * next sweep.
+ */
+uint32_t strtab_intern(const char *str);
+uint32_t strtab_pin(const char *str);
+void strtab_unpin(uint32_t id);
+const char *strtab_get(uint32_t id);
+void strtab_keep(uint32_t id);
+size_t strtab_sweep(void);
+size_t strtab_count(void);
+size_t strtab_bytes(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
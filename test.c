@@ -0,0 +1,115 @@
+#include "stat.h"
+#include "utils.h"
+
+static int checks;
+static int failures;
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    checks++;                                                                  \
+    if (!(cond)) {                                                             \
+      fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond);        \
+      failures++;                                                              \
+    }                                                                          \
+  } while (0)
+
+/* A line of a 5.x nfsd thread, with all 52 fields. */
+#define NFSD_LINE                                                              \
+  "811 (nfsd) I 2 0 0 0 -1 2129984 0 0 0 0 0 15 0 0 20 0 1 0 300 0 0 "         \
+  "18446744073709551615 0 0 0 0 0 0 0 2147483647 0 0 0 0 17 3 0 0 0 0 0 0 0 " \
+  "0 0 0 0 0 0\n"
+
+/* A comm may hold spaces and parentheses, ")" included. */
+#define COMM_LINE                                                              \
+  "1234 (a b) c)) S 1 2 3 0 -1 4194560 10 20 30 40 500 600 -7 -8 20 0 1 0 "    \
+  "9999 123456 77 18446744073709551615 1 2 3 4 5 0 0 0 0 0 0 0 17 3 0 0 42 "   \
+  "43 44 0 0 0 0 0 0 0 0"
+
+/* Kernels before 3.3 stop at cguest_time, field 44. */
+#define SHORT_LINE                                                             \
+  "42 (nfsd) S 2 0 0 0 -1 2216722496 0 0 0 0 7 9 0 0 15 -5 1 0 12 0 0 "       \
+  "18446744073709551615 0 0 0 0 0 0 0 2147483647 0 0 0 0 17 1 0 0 0 0 0"
+
+static int parse(const char *buf, StatLine *line) {
+  return stat_parse(buf, strlen(buf), line);
+}
+
+static void test_stat_parse(void) {
+  StatLine line;
+
+  CHECK(parse(NFSD_LINE, &line) == 0);
+  CHECK(line.field[STAT_PID] == 811);
+  CHECK(line.comm_len == 4 && memcmp(line.comm, "nfsd", 4) == 0);
+  CHECK(line.state == 'I');
+  CHECK(line.field[STAT_PPID] == 2);
+  CHECK(line.field[STAT_TTY_NR] == 0 && stat_signed(&line, STAT_TPGID) == -1);
+  CHECK(line.field[STAT_STIME] == 15);
+  CHECK(line.field[STAT_STARTTIME] == 300);
+  CHECK(line.field[STAT_RSSLIM] == 18446744073709551615ULL);
+  CHECK(line.field[STAT_PROCESSOR] == 3);
+  CHECK(line.nfields == STAT_EXIT_CODE);
+
+  CHECK(parse(COMM_LINE, &line) == 0);
+  CHECK(line.field[STAT_PID] == 1234);
+  CHECK(line.comm_len == 7 && memcmp(line.comm, "a b) c)", 7) == 0);
+  CHECK(line.state == 'S');
+  CHECK(line.field[STAT_MINFLT] == 10 && line.field[STAT_MAJFLT] == 30);
+  CHECK(line.field[STAT_UTIME] == 500 && line.field[STAT_STIME] == 600);
+  CHECK(stat_signed(&line, STAT_CUTIME) == -7 &&
+        stat_signed(&line, STAT_CSTIME) == -8);
+  CHECK(line.field[STAT_NUM_THREADS] == 1);
+  CHECK(line.field[STAT_STARTTIME] == 9999);
+  CHECK(line.field[STAT_VSIZE] == 123456 && line.field[STAT_RSS] == 77);
+  CHECK(line.field[STAT_DELAYACCT_BLKIO_TICKS] == 42);
+  CHECK(line.field[STAT_CGUEST_TIME] == 44);
+  CHECK(line.nfields == STAT_EXIT_CODE);
+
+  CHECK(parse("7 () R 1", &line) == 0);
+  CHECK(line.comm_len == 0 && line.state == 'R');
+  CHECK(line.field[STAT_PPID] == 1 && line.nfields == STAT_PPID);
+
+  /* Fields an older kernel does not report read as 0. */
+  CHECK(parse(SHORT_LINE, &line) == 0);
+  CHECK(line.nfields == STAT_CGUEST_TIME);
+  CHECK(line.field[STAT_PRIORITY] == 15 && stat_signed(&line, STAT_NICE) == -5);
+  CHECK(line.field[STAT_STARTTIME] == 12);
+  CHECK(line.field[STAT_START_DATA] == 0 && line.field[STAT_EXIT_CODE] == 0);
+
+  /* A line cut short after a complete field keeps what it has. */
+  CHECK(parse("12 (nfsd) S", &line) == 0);
+  CHECK(line.state == 'S' && line.nfields == STAT_STATE);
+  CHECK(parse("12 (nfsd) S 1 2 3", &line) == 0);
+  CHECK(line.nfields == STAT_SESSION && line.field[STAT_SESSION] == 3);
+
+  /* Truncated inside comm, the state or a number, it is rejected. */
+  CHECK(parse("", &line) != 0);
+  CHECK(parse("12 (nfs", &line) != 0);
+  CHECK(parse("12 (nfsd)", &line) != 0);
+  CHECK(parse("12 (nfsd) ", &line) != 0);
+  CHECK(parse("12 (nfsd) S 1 2 -", &line) != 0);
+  CHECK(parse("12 nfsd) S 1 2 3", &line) != 0);
+  CHECK(parse("12 (nfsd) S 1 x 3", &line) != 0);
+
+  /* Only `len` bytes are read, even when more follow. */
+  CHECK(stat_parse(NFSD_LINE, strlen("811 (nfsd) I 2 0"), &line) == 0);
+  CHECK(line.nfields == STAT_PGRP);
+
+  char buf[1024];
+  FILE *file = fopen("/proc/self/stat", "re");
+  size_t len = file != NULL ? fread(buf, 1, sizeof(buf), file) : 0;
+  if (file != NULL)
+    fclose(file);
+
+  CHECK(len > 0 && stat_parse(buf, len, &line) == 0);
+  CHECK(stat_signed(&line, STAT_PID) == getpid());
+  CHECK(stat_signed(&line, STAT_PPID) == getppid());
+  CHECK(line.nfields >= STAT_CGUEST_TIME);
+}
+
+/* Unit tests for the parsers that do not need root, fanotify or nfsd. */
+int main(void) {
+  test_stat_parse();
+
+  printf("%d checks, %d failed\n", checks, failures);
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
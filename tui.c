@@ -0,0 +1,242 @@
+#include "tui.h"
+#include "live.h"
+#include "mountstat.h"
+#include "rpcstat.h"
+#include "stat.h"
+#include "store.h"
+#include "utils.h"
+
+#include <poll.h>
+#include <sys/inotify.h>
+
+/* Store commits arrive every few hundred ms; redraw at most this often. */
+#define REFRESH_MIN_MS 250
+
+/* How often the live snapshot sequence is checked for new data. */
+#define LIVE_POLL_MS 250
+
+static long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Renders the daemon's live snapshot: top ops and processes on line 5, top
+ * files from line `top` down.
+ */
+static void show_live(const LiveSnapshot *snap, WINDOW *win, int top) {
+  char line[512];
+  size_t len = snprintf(line, sizeof(line), "ops:");
+
+  for (uint32_t i = 0; i < snap->nops && len < sizeof(line); ++i)
+    len += snprintf(line + len, sizeof(line) - len, " %s %lu",
+                    snap->ops[i].name, snap->ops[i].count);
+  if (len < sizeof(line))
+    len += snprintf(line + len, sizeof(line) - len, "  procs:");
+  for (uint32_t i = 0; i < snap->nprocs && len < sizeof(line); ++i)
+    len += snprintf(line + len, sizeof(line) - len, " %s %lu",
+                    snap->procs[i].name, snap->procs[i].count);
+
+  mvwprintw(win, 5, 2, "%.*s", getmaxx(win) - 4, line);
+
+  int y = getmaxy(win);
+  int row = top;
+
+  for (uint32_t i = 0; i < snap->nrows && row < y - 1; ++i) {
+    const LiveRow *r = &snap->rows[i];
+    if (r->count <= 1)
+      break;
+
+    char size[24];
+    mvwprintw(win, row++, 2,
+              "%-9lu %-15s %-10d %-10d %-10d %-10s %-10s %-20.20s %s",
+              r->count, r->proc, r->pid, r->uid, r->gid,
+              size_str(r->size < 0 ? -1 : r->size / 1024, r->path,
+                       (SizeMode)snap->size_mode, size, sizeof(size)),
+              op(r->mask), r->client, r->path);
+  }
+}
+
+/*
+ * Redraws the window into ncurses' virtual screen. The window is erased
+ * rather than cleared, so wrefresh() only sends the cells that changed.
+ */
+static int draw(const Args *args, store db, CpuSampler *sampler, RpcStat *rpc,
+                MountStat *mnt, const LiveSnapshot **live, LiveSnapshot *snap,
+                WINDOW *win) {
+  const ProcStat *p = procstat(sampler);
+  if (p == NULL)
+    return 1;
+
+  werase(win);
+  box(win, 0, 0);
+
+  showStat(p, win);
+
+  /* The RPC or mount panel, when available, pushes the table down. */
+  int header = 6;
+  if (rpc != NULL && rpcstat_sample(rpc) == 0) {
+    rpcstat_show(rpc, win, 6);
+    header = 8;
+  } else if (mnt != NULL && mountstat_sample(mnt) == 0) {
+    mountstat_show(mnt, win, 6);
+    header = 8;
+  }
+
+  wattron(win, COLOR_PAIR(1));
+  mvwprintw(win, header, 2,
+            "%-9s %-15s %-10s %-10s %-10s %-10s %-10s %-20s %-10s", "COUNT",
+            "PROC_NAME", "PID", "UID", "GID", "SIZE", "OP", "CLIENT", "PATH");
+  wattroff(win, COLOR_PAIR(1));
+
+  if (*live == NULL)
+    *live = live_open();
+
+  int stale = *live != NULL ? live_read(*live, snap) : 1;
+
+  if (stale == 0 && snap->window == args->window) {
+    show_live(snap, win, header + 1);
+  } else {
+    if (*live != NULL && stale != 0) {
+      live_close(*live);
+      *live = NULL;
+    }
+
+    if (store_show(db, win, args->window, header + 1) == 1)
+      return 1;
+  }
+
+  wrefresh(win);
+  return 0;
+}
+
+/*
+ * Runs the TUI until 'q' is pressed. The screen is redrawn on a key press,
+ * when the daemon commits to the store or publishes a new live snapshot,
+ * and at least every `args->refresh` seconds for the process stats.
+ */
+int tui_run(const Args *args) {
+  store db = store_open(false);
+  if (db == NULL)
+    return 1;
+
+  /* Windows matching the daemon's live snapshot skip the store. */
+  const LiveSnapshot *live = NULL;
+  LiveSnapshot *snap = (LiveSnapshot *)malloc(sizeof(LiveSnapshot));
+  if (snap == NULL) {
+    err("Failed to allocate live snapshot");
+    store_close(db);
+    return 1;
+  }
+
+  CpuSampler *sampler = sampler_new(args->client);
+  if (sampler == NULL) {
+    free(snap);
+    store_close(db);
+    return 1;
+  }
+
+  /* Only the server exports RPC statistics for its own service. */
+  RpcStat *rpc = args->client ? NULL : rpcstat_new();
+  MountStat *mnt = args->client ? mountstat_new() : NULL;
+
+  int notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (notify >= 0)
+    store_watch(db, notify);
+
+  initscr();
+  cbreak();
+  noecho();
+  keypad(stdscr, TRUE);
+  nodelay(stdscr, TRUE);
+
+  start_color();
+  init_pair(1, COLOR_BLACK, COLOR_WHITE);
+
+  WINDOW *win = newwin(0, 0, 0, 0);
+  refresh();
+
+  struct pollfd fds[2] = {{.fd = STDIN_FILENO, .events = POLLIN},
+                          {.fd = notify, .events = POLLIN}};
+  long max_ms = args->refresh * 1000;
+  long drawn = 0;
+  uint64_t seq = 0;
+  bool pending = true;
+  int rc = 0;
+
+  while (true) {
+    long now = now_ms();
+
+    if (pending && now - drawn >= REFRESH_MIN_MS) {
+      if (draw(args, db, sampler, rpc, mnt, &live, snap, win) != 0) {
+        rc = 1;
+        break;
+      }
+
+      drawn = now;
+      pending = false;
+      if (live != NULL)
+        seq = live_seq(live);
+    }
+
+    long timeout = drawn + max_ms - now;
+    if (pending)
+      timeout = drawn + REFRESH_MIN_MS - now;
+    else if (live != NULL && timeout > LIVE_POLL_MS)
+      timeout = LIVE_POLL_MS;
+    if (timeout < 0)
+      timeout = 0;
+
+    if (poll(fds, notify >= 0 ? 2 : 1, (int)timeout) < 0 && errno != EINTR) {
+      err("Failed to poll terminal, error code: %d", errno);
+      rc = 1;
+      break;
+    }
+
+    int ch;
+    bool quit = false;
+    while ((ch = getch()) != ERR) {
+      if (ch == 'q' || ch == 'Q')
+        quit = true;
+      pending = true;
+    }
+    if (quit)
+      break;
+
+    if (notify >= 0 && (fds[1].revents & POLLIN)) {
+      char buf[4096];
+
+      while (read(notify, buf, sizeof(buf)) > 0)
+        ;
+      pending = true;
+    }
+
+    if (live != NULL && live_seq(live) != seq)
+      pending = true;
+
+    if (now_ms() - drawn >= max_ms) {
+      pending = true;
+
+      /* Each day writes a new WAL, which goes when the daemon stops. */
+      if (notify >= 0)
+        store_watch(db, notify);
+    }
+  }
+
+  endwin();
+
+  if (live != NULL)
+    live_close(live);
+  free(snap);
+  sampler_free(sampler);
+  if (rpc != NULL)
+    rpcstat_free(rpc);
+  if (mnt != NULL)
+    mountstat_free(mnt);
+  if (notify >= 0)
+    close(notify);
+
+  store_close(db);
+  return rc;
+}
@@ -0,0 +1,16 @@
+#ifndef TUI_H
+#define TUI_H
+
+#include "args.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int tui_run(const Args *args);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif